@@ -0,0 +1,168 @@
+/*
+ * membox Progetto del corso di LSO 2017/2018
+ *
+ * Dipartimento di Informatica Università di Pisa
+ * Docenti: Prencipe, Torquati
+ *
+ */
+/**
+ * @file affinity.c
+ * @author Jacopo Massa 543870 \n( <mailto:jacopomassa97@gmail.com> )
+ * @brief Implementazione delle funzioni del file affinity.h
+ * @copyright **Si dichiara che il contenuto di questo file è in ogni sua parte opera
+       originale dell'autore**
+ * @see affinity.h
+ */
+
+#define _GNU_SOURCE // cpu_set_t, pthread_setaffinity_np
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <sched.h>
+#include <dirent.h>
+
+#include <affinity.h>
+
+int affinity_parse(const char *list, affinity_t *a)
+{
+    cpu_set_t set;
+    const char *p = list;
+    char *end;
+    long first, last, c;
+    int *cpus, *rank, n = 0, k = 0, r, i;
+
+    if(a == NULL)
+    {
+        errno = EINVAL;
+        return -1;
+    }
+    a->cpus = NULL;
+    a->ncpus = 0;
+    if(list == NULL || *list == '\0')
+        return 0;
+
+    // raccolgo le CPU in un cpu_set_t, così quelle ripetute contano una volta sola
+    CPU_ZERO(&set);
+    for(;;)
+    {
+        first = last = strtol(p,&end,10);
+        if(end == p || first < 0)
+            break;
+        p = end;
+        if(*p == '-')
+        {
+            last = strtol(++p,&end,10);
+            if(end == p || last < first)
+                break;
+            p = end;
+        }
+        if(last >= CPU_SETSIZE)
+            break;
+        for(c = first; c <= last; c++)
+            CPU_SET((int)c,&set);
+
+        if(*p == '\0')
+        {
+            n = CPU_COUNT(&set);
+            break;
+        }
+        if(*p++ != ',')
+            break;
+    }
+    if(n == 0)
+    {
+        errno = EINVAL;
+        return -1;
+    }
+
+    if((cpus = (int*) malloc(sizeof(int) * n)) == NULL)
+        return -1;
+    if((rank = (int*) calloc(n, sizeof(int))) == NULL)
+    {
+        free(cpus);
+        return -1;
+    }
+    for(c = 0, i = 0; c < CPU_SETSIZE && i < n; c++)
+    {
+        if(CPU_ISSET((int)c,&set))
+            cpus[i++] = (int)c;
+    }
+
+    // rank[i]: quante CPU dello stesso nodo precedono cpus[i]
+    for(i = 0; i < n; i++)
+    {
+        int node = affinity_node(cpus[i]);
+        for(c = 0; c < i; c++)
+            rank[i] += (affinity_node(cpus[c]) == node);
+    }
+
+    // prima la prima CPU di ogni nodo, poi la seconda, e così via
+    if((a->cpus = (int*) malloc(sizeof(int) * n)) == NULL)
+    {
+        free(cpus);
+        free(rank);
+        return -1;
+    }
+    for(r = 0; k < n; r++)
+    {
+        for(i = 0; i < n; i++)
+        {
+            if(rank[i] == r)
+                a->cpus[k++] = cpus[i];
+        }
+    }
+    a->ncpus = n;
+
+    free(cpus);
+    free(rank);
+    return 0;
+}
+
+void affinity_free(affinity_t *a)
+{
+    if(a == NULL)
+        return;
+    free(a->cpus);
+    a->cpus = NULL;
+    a->ncpus = 0;
+}
+
+int affinity_node(int cpu)
+{
+    char path[64];
+    struct dirent *e;
+    DIR *d;
+    int node = 0;
+
+    // la directory di ogni CPU contiene un collegamento "nodeN" al proprio nodo
+    snprintf(path,sizeof(path),"%s/cpu%d",AFFINITY_SYSFS,cpu);
+    if((d = opendir(path)) == NULL)
+        return 0;
+    while((e = readdir(d)) != NULL)
+    {
+        if(strncmp(e->d_name,"node",4) == 0 && sscanf(e->d_name + 4,"%d",&node) == 1)
+            break;
+    }
+    closedir(d);
+    return node;
+}
+
+int affinity_pin(pthread_t tid, const affinity_t *a, int i)
+{
+    cpu_set_t set;
+    int c;
+
+    if(a == NULL || a->ncpus == 0)
+        return 0;
+
+    CPU_ZERO(&set);
+    if(i >= 0)
+        CPU_SET(a->cpus[i % a->ncpus],&set);
+    else
+    {
+        for(c = 0; c < a->ncpus; c++)
+            CPU_SET(a->cpus[c],&set);
+    }
+    return pthread_setaffinity_np(tid,sizeof(set),&set);
+}
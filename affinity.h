@@ -0,0 +1,86 @@
+/*
+ * membox Progetto del corso di LSO 2017/2018
+ *
+ * Dipartimento di Informatica Università di Pisa
+ * Docenti: Prencipe, Torquati
+ *
+ */
+/**
+ * @file affinity.h
+ * @author Jacopo Massa 543870 \n( <mailto:jacopomassa97@gmail.com> )
+ * @brief Insiemi di CPU su cui vincolare i thread del server
+ *
+ * Un insieme si scrive come nella lista delle CPU di Linux (ad esempio "0-3,8,10-11").
+ * Le CPU vengono ordinate alternando i nodi NUMA: assegnando l'i-esimo thread
+ * all'i-esima CPU (in modo circolare), ogni nodo riceve la propria quota di thread.
+ * @copyright **Si dichiara che il contenuto di questo file è in ogni sua parte opera
+       originale dell'autore**
+ */
+
+#ifndef AFFINITY_H_
+#define AFFINITY_H_
+
+#include <pthread.h>
+
+#define AFFINITY_SYSFS "/sys/devices/system/cpu" /**< directory da cui si ricava il nodo NUMA di ogni CPU. */
+
+/**
+ * @typedef affinity_t
+ * @brief Ridefinizione della struttura affinity_s
+ *
+ * @struct affinity_s
+ * @brief Insieme di CPU
+ *
+ * @param[in] cpus  CPU dell'insieme, alternate fra i nodi NUMA (NULL se l'insieme è vuoto)
+ * @param[in] ncpus numero di CPU in \a cpus
+ */
+typedef struct affinity_s
+{
+    int *cpus;
+    int ncpus;
+} affinity_t;
+
+/**
+ * @function affinity_parse
+ * @brief Legge un insieme di CPU da una lista nel formato "0-3,8,10-11"
+ *
+ * @param[in]  list lista delle CPU (NULL o vuota = insieme vuoto, nessun vincolo)
+ * @param[out] a    insieme letto (da liberare con affinity_free)
+ *
+ * @return 0 in caso di successo.
+ * @return -1 in caso di errore (errno settato, EINVAL se la lista non è valida).
+ */
+int affinity_parse(const char *list, affinity_t *a);
+
+/**
+ * @function affinity_free
+ * @brief Libera la memoria allocata da affinity_parse
+ *
+ * @param[in] a insieme da liberare
+ */
+void affinity_free(affinity_t *a);
+
+/**
+ * @function affinity_node
+ * @brief Restituisce il nodo NUMA di una CPU
+ *
+ * @param[in] cpu numero della CPU
+ *
+ * @return nodo della CPU (0 se il sistema non ha nodi o non è possibile saperlo).
+ */
+int affinity_node(int cpu);
+
+/**
+ * @function affinity_pin
+ * @brief Vincola un thread all'insieme di CPU, o a una sola CPU dell'insieme
+ *
+ * @param[in] tid thread da vincolare
+ * @param[in] a   insieme di CPU (se vuoto la funzione non fa nulla)
+ * @param[in] i   indice del thread: viene scelta la CPU a->cpus[i % a->ncpus] (<0 = tutto l'insieme)
+ *
+ * @return 0 in caso di successo.
+ * @return codice d'errore di pthread_setaffinity_np altrimenti.
+ */
+int affinity_pin(pthread_t tid, const affinity_t *a, int i);
+
+#endif /* AFFINITY_H_ */
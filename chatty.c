@@ -14,10 +14,11 @@
  */
 
 #define _POSIX_C_SOURCE 200809L
+#define _GNU_SOURCE // accept4
 #include <chatty.h>
 
 /** struttura che memorizza le statistiche del server */
-struct statistics chattyStats  = {0,0,0,0,0,0,0};
+struct statistics chattyStats  = {0,0,0,0,0,0,0,0,0};
 
 /**< struttura che memorizza la configurazione del server */
 config_t *conf = NULL;
@@ -30,23 +31,58 @@ icl_hash_t *users = NULL;
 
 /**< pool di thread che soddisfano le richieste dei client, collocate in una coda condivisa nel pool */
 threadpool_t *thpool = NULL;
+/**< pool di thread che eseguono le operazioni sui file in DirName (NULL se DiskThreads è 0) */
+threadpool_t *diskpool = NULL;
 
 /**< thread listener */
 pthread_t listener;
+/**< event loop che si spartiscono le connessioni dei client */
+reactor_t *reactors = NULL;
+/**< numero di event loop avviati */
+int nreactors = 0;
+
+/**< buffer di ricezione dei client, indicizzati per descrittore (ognuno usato solo dal proprio event loop) */
+connbuf_t **conns = NULL;
+/**< dimensione della tabella dei buffer di ricezione */
+int maxconns = 0;
+/**< richieste già estratte dal buffer di un client che il pool non ha potuto accogliere, indicizzate per descrittore */
+request_t **held = NULL;
+/**< stato di inattività dei client, indicizzato per descrittore (NULL se IdleTimeout è 0) */
+idle_t *idle = NULL;
+/**< connessione con il processo che sta subentrando al server (-1 se non è in corso una sostituzione) */
+int handoverfd = -1;
+/**< flag che indica se i socket appartengono a questo processo, e vanno quindi eliminati alla terminazione */
+int ownsockets = 1;
 /**< thread gestore dei segnali */
 pthread_t sig_manager;
+/**< flag che indica che il pool ha superato HighWatermark e non è ancora sceso sotto LowWatermark */
+int throttled = 0;
+/**< CPU su cui eseguire il listener (vuoto se ListenerCPUs non è impostato) */
+affinity_t listenercpus = {NULL,0};
+/**< CPU fra cui distribuire gli event loop (vuoto se ReactorCPUs non è impostato) */
+affinity_t reactorcpus = {NULL,0};
+/**< CPU fra cui distribuire i thread del pool (vuoto se PoolCPUs non è impostato) */
+affinity_t poolcpus = {NULL,0};
+
+/**< epoll su cui le coroutine sospese attendono i propri client (-1 se Coroutines è 0) */
+int coroepfd = -1;
+/**< numero di coroutine create e non ancora terminate */
+int ncoroutines = 0;
+/**< attese delle coroutine sospese sui client, indicizzate per descrittore (NULL se Coroutines è 0) */
+corowait_t *corowaits = NULL;
+/**< ruota delle scadenze delle attese, fatta avanzare da coro_function */
+twheel_t *corowheel = NULL;
+/**< mutex per corowaits e corowheel */
+pthread_mutex_t mtx_coro = PTHREAD_MUTEX_INITIALIZER;
 
 /**< array di mutex usate per l'accesso concorrente alla tabella hash degli utenti registrati */
 pthread_mutex_t mtx_users[MAX_MTX_USR];
-/**< array di mutex usate nell'invio di risposte ai client */
+/**< code dei messaggi in uscita dei client, indicizzate per descrittore (NULL se ConnectionAffinity è 0) */
+outbox_t *outbox = NULL;
+/**< array di mutex usate nell'invio di risposte ai client (solo se ConnectionAffinity è 0) */
 pthread_mutex_t mtx_req[MAX_MTX_REQ];
 /**< mutex per le statistiche del server */
 pthread_mutex_t mtx_stats = PTHREAD_MUTEX_INITIALIZER;
-/**< mutex per la pipe usata dai thread worker */
-pthread_mutex_t mtx_pipe = PTHREAD_MUTEX_INITIALIZER;
-
-/**< pipe per la comunicazione tra listener e thread del pool */
-int answers[2];
 
 /* ----- FUNZIONI DI UTILITÀ ------ */
 
@@ -63,6 +99,266 @@ static void usage(const char *progname);
  */
 static void unlinkSocket();
 
+/**
+ * @function getReactor
+ * @brief Individua l'event loop a cui è assegnata una connessione
+ * @param[in] fd descrittore del client
+ * @return puntatore all'event loop proprietario di \a fd
+ */
+static inline reactor_t* getReactor(int fd) { return &reactors[fd % nreactors]; }
+
+/**
+ * @function rearm
+ * @brief Riarma un client nell'event loop, che tornerà a notificare nuovi dati
+ * @param[in] r  event loop proprietario del client
+ * @param[in] fd descrittore del client
+ */
+static void rearm(reactor_t *r, int fd);
+
+/**
+ * @function dispatchRequest
+ * @brief Estrae dal buffer del client le richieste complete (al più MAX_PIPELINE) e le affida al pool con un solo task
+ * @param[in] fd    descrittore del client
+ * @param[in] eof   flag che indica che il client ha chiuso la connessione: tutte le richieste complete vengono eseguite prima della chiusura
+ * @param[in] reply risposta da inviare al client prima della chiusura (0 = nessuna)
+ * @param[in] r     event loop nel cui gruppo accumulare il task, affidato al pool da flushDispatch (NULL = affidato subito)
+ * @return 1 se delle richieste sono state affidate (eventualmente da rifiutare), 0 se il buffer non ne contiene di complete
+ * @return -1 se il pool è sovraccarico o pieno: le richieste complete restano nel buffer (o in held) e il client va parcheggiato
+ */
+static int dispatchRequest(int fd, int eof, op_t reply, reactor_t *r);
+
+/**
+ * @function flushDispatch
+ * @brief Affida al pool i task accumulati da un event loop, con un solo threadpool_add_batch per corsia
+ *
+ * I task che non entrano nella coda del pool restano in held e i loro client vengono
+ * parcheggiati: saranno ripresi da resumeParked, mai eseguiti dall'event loop.
+ *
+ * @param[in] r event loop che ha accumulato i task
+ */
+static void flushDispatch(reactor_t *r);
+
+/**
+ * @function overloaded
+ * @brief Controlla il carico del pool, con isteresi fra LowWatermark e HighWatermark
+ * @return 1 se il server non deve affidare nuove richieste al pool, 0 altrimenti
+ */
+static int overloaded(void);
+
+/**
+ * @function resumeConnection
+ * @brief Affida al pool le richieste complete di un client disarmato; se non ce ne sono lo riarma, se il pool è sovraccarico lo parcheggia
+ * @param[in] r  event loop proprietario del client
+ * @param[in] fd descrittore del client
+ */
+static void resumeConnection(reactor_t *r, int fd);
+
+/**
+ * @function parkConnection
+ * @brief Lascia disarmato un client con richieste complete finché il pool è sovraccarico
+ * @param[in] r  event loop proprietario del client
+ * @param[in] fd descrittore del client
+ */
+static void parkConnection(reactor_t *r, int fd);
+
+/**
+ * @function resumeParked
+ * @brief Riprende, nell'ordine in cui sono stati parcheggiati, i client dell'event loop non appena il pool scende sotto LowWatermark
+ * @param[in] r event loop proprietario dei client
+ */
+static void resumeParked(reactor_t *r);
+
+/**
+ * @function requestLane
+ * @brief Sceglie la corsia di priorità del pool per un gruppo di richieste dello stesso client
+ *
+ * Il gruppo prende la corsia della richiesta più lunga: trasferimenti di file, history
+ * e messaggi a tutti vanno nella corsia bassa, le operazioni di controllo in quella alta.
+ * @param[in] head prima richiesta del gruppo
+ * @return corsia (threadpool_lane_t)
+ */
+static int requestLane(request_t *head);
+
+/**
+ * @function executeRequest
+ * @brief Esegue una singola richiesta di un client
+ * @param[in] r richiesta da eseguire
+ */
+static void executeRequest(request_t *r);
+
+/**
+ * @function fileRequest
+ * @brief Funzione eseguita dai thread di diskpool: esegue una GETFILE_OP o una POSTFILE_OP,
+ * poi riaffida al pool delle richieste quelle successive dello stesso client
+ * @param[in] req lista di richieste di un client (request_t), a partire da quella sul file
+ */
+static void fileRequest(void *req);
+
+/**
+ * @function completeRequest
+ * @brief Conclude l'esecuzione delle richieste di un client: lo riarma o lo segnala al suo event loop
+ * @param[in] fd descrittore del client
+ */
+static void completeRequest(int fd);
+
+/**
+ * @function monotonicTime
+ * @brief Restituisce l'istante corrente, in secondi, di un orologio che non torna mai indietro
+ * @return secondi trascorsi da un istante arbitrario
+ */
+static long monotonicTime(void);
+
+/**
+ * @function touchConnection
+ * @brief Registra l'attività di un client e, se necessario, attiva il suo timer di inattività
+ * @param[in] r  event loop proprietario del client
+ * @param[in] fd descrittore del client
+ */
+static void touchConnection(reactor_t *r, int fd);
+
+/**
+ * @function expireConnection
+ * @brief Funzione eseguita alla scadenza del timer di inattività: chiude il client o rinvia la scadenza
+ * @param[in] timer timer scaduto
+ * @param[in] reactor event loop proprietario del client
+ */
+static void expireConnection(twnode_t *timer, void *reactor);
+
+/**
+ * @function closeConnection
+ * @brief Libera lo stato del client nell'event loop e affida al pool la sua chiusura
+ * @param[in] r     event loop proprietario del client
+ * @param[in] fd    descrittore del client
+ * @param[in] reply risposta da inviare al client prima di chiuderlo (0 = nessuna)
+ */
+static void closeConnection(reactor_t *r, int fd, op_t reply);
+
+/**
+ * @function drainCompleted
+ * @brief Estrae dalla coda di completamento i client le cui richieste sono terminate, e li riarma
+ * @param[in] r event loop proprietario della coda
+ */
+static void drainCompleted(reactor_t *r);
+
+/**
+ * @function registerConnection
+ * @brief Affida un nuovo client all'event loop che ne è proprietario
+ * @param[in] fd      descrittore del client
+ * @param[in] pending flag che indica che il buffer del client contiene già dei dati
+ */
+static void registerConnection(int fd, int pending);
+
+/**
+ * @function startReactor
+ * @brief Avvia il thread di un event loop
+ * @param[in] r event loop da avviare
+ */
+static void startReactor(reactor_t *r);
+
+/**
+ * @function handoverServer
+ * @brief Ferma gli event loop e il pool e invia socket, client e stato al processo che subentra
+ * @param[in] hfd connessione con il nuovo processo
+ * @param[in] sfd socket di connessione dei client
+ * @return 0 se il nuovo processo ha ricevuto tutto, -1 altrimenti (gli event loop sono fermi)
+ */
+static int handoverServer(int hfd, int sfd);
+
+/**
+ * @function deliver
+ * @brief Invia un messaggio a un client, senza mai mescolarlo con un altro messaggio per lo stesso client
+ *
+ * Senza ConnectionAffinity l'invio avviene con la mutex mtx_req del descrittore.
+ * Altrimenti, se un altro thread sta già scrivendo sul client, il messaggio viene
+ * copiato nella sua coda in uscita e sarà quel thread a inviarlo.
+ *
+ * @param[in] fd      descrittore del client
+ * @param[in] msg     messaggio da inviare
+ * @param[in] hdronly flag che indica che va inviato solo l'header
+ */
+static void deliver(long fd, message_t *msg, int hdronly);
+
+/**
+ * @function deliverHeader
+ * @brief Invia un header a un client (vedi deliver)
+ */
+static inline void deliverHeader(long fd, message_hdr_t *hdr)
+{
+    message_t msg;
+    msg.hdr = *hdr;
+    deliver(fd,&msg,1);
+}
+
+/**
+ * @function deliverRequest
+ * @brief Invia un messaggio completo a un client (vedi deliver)
+ */
+static inline void deliverRequest(long fd, message_t *msg) { deliver(fd,msg,0); }
+
+/**
+ * @function compareReceivers
+ * @brief Ordina i destinatari di un POSTTXTLIST_OP per partizione e poi per nickname (per qsort)
+ */
+static int compareReceivers(const void *a, const void *b);
+
+/**
+ * @function flushOutbox
+ * @brief Invia i messaggi nella coda in uscita del client e ne rilascia la proprietà
+ *
+ * Va chiamata dal thread che ha ottenuto outbox[fd].owner.
+ * @param[in] fd descrittore del client
+ */
+static void flushOutbox(long fd);
+
+/**
+ * @function discardOutbox
+ * @brief Scarta i messaggi in attesa per un client che sta per essere chiuso
+ * @param[in] fd descrittore del client
+ */
+static void discardOutbox(int fd);
+
+/**
+ * @function runCoroutine
+ * @brief Esegue una coroutine finché non termina o si sospende
+ *
+ * Se la coroutine attende un client la registra su coroepfd, e verrà ripresa da
+ * coro_function; se ha solo ceduto il thread la rimette in coda al pool.
+ * @param[in] c coroutine da eseguire
+ */
+static void runCoroutine(coro_t *c);
+
+/**
+ * @function resumeCoroutine
+ * @brief Funzione eseguita dai thread del pool: riprende una coroutine sospesa (vedi runCoroutine)
+ * @param[in] coro coroutine da riprendere
+ */
+static void resumeCoroutine(void *coro);
+
+/**
+ * @function scheduleCoroutine
+ * @brief Fa riprendere una coroutine dal thread del pool associato al suo client, come le sue richieste
+ * @param[in] c coroutine sospesa
+ */
+static void scheduleCoroutine(coro_t *c);
+
+/**
+ * @function expireCoroutine
+ * @brief Annulla l'attesa scaduta di una coroutine, chiude il client e accoda l'attesa fra quelle da riprendere
+ *
+ * Viene chiamata da coro_function con mtx_coro acquisita.
+ * @param[in] timer timer dell'attesa (vedi corowait_t)
+ * @param[in] list  lista delle attese scadute
+ */
+static void expireCoroutine(twnode_t *timer, void *list);
+
+/**
+ * @function readRequest
+ * @brief Legge senza bloccarsi tutti i dati già inviati dal client e affida al pool le richieste complete
+ * @param[in] r  event loop proprietario del client
+ * @param[in] fd descrittore del client
+ */
+static void readRequest(reactor_t *r, int fd);
+
 
 /**
  * @function cleanup
@@ -108,11 +404,12 @@ int main(int argc, char *argv[])
     /* ------- Parsing del file di configurazione ------- */
 
     int opt; /* opzione della riga di comando */
+    int upgrade = 0; /* subentro a un server in esecuzione */
 
     if (argc < 2)
         usage(argv[0]);
 
-    while ((opt = getopt(argc, argv, "f:")) != -1)
+    while ((opt = getopt(argc, argv, "f:u")) != -1)
     {
         switch (opt)
         {
@@ -120,168 +417,1047 @@ int main(int argc, char *argv[])
                 conf_filepath = strdup(optarg);
                 break;
 
+            case 'u':
+                upgrade = 1;
+                break;
+
+            default:
+                usage(argv[0]);
+                break;
+        }
+    }
+
+    /* ------- Inizializzazione dei parametri di configurazione del server ------- */
+    SYSCALL( conf = (config_t*) malloc(sizeof(config_t)), NULL, "malloc conf in main")
+    parseConfigurationFile(conf,conf_filepath);
+
+    // abilito la accept io_uring del listener se richiesta e supportata, altrimenti uso accept4
+    uring_enable(conf->IoUring);
+
+    /* gli event loop non ricevono richieste che dichiarano body oltre i limiti: i controlli
+     * esatti (con risposta OP_MSG_TOOLONG) restano nelle singole operazioni */
+    connbuf_setLimits((size_t)conf->MaxMsgSize + MAX_BODY_EXTRA,(size_t)conf->MaxFileSize*1024 + 1023);
+
+    //creo la directory (se essa non esiste) in cui salverò i file ricevuti dai client
+    struct stat st;
+    if (stat(conf->DirName, &st) == -1)
+        mkdir(conf->DirName, 0777);
+
+    /* il numero di partizioni della hash table è fissato all'avvio (LockPartitions, o in mancanza
+     * ThreadsInPool) e non cambia quando il pool viene ridimensionato */
+    int npartitions = (conf->LockPartitions > 0) ? conf->LockPartitions : conf->ThreadsInPool;
+    assert(npartitions <= MAX_MTX_USR);
+
+    // tabella dei buffer di ricezione: un descrittore non può superare il limite del processo
+    struct rlimit rl;
+    SYSCALL(getrlimit(RLIMIT_NOFILE,&rl),-1,"getrlimit in main");
+    maxconns = (rl.rlim_cur == RLIM_INFINITY || rl.rlim_cur > MAX_FDS) ? MAX_FDS : (int) rl.rlim_cur;
+    SYSCALL(conns = (connbuf_t**) calloc((size_t)maxconns,sizeof(connbuf_t*)),NULL,"calloc conns in main");
+    SYSCALL(held = (request_t**) calloc((size_t)maxconns,sizeof(request_t*)),NULL,"calloc held in main");
+    if(conf->IdleTimeout > 0)
+        SYSCALL(idle = (idle_t*) calloc((size_t)maxconns,sizeof(idle_t)),NULL,"calloc idle in main");
+    if(conf->ConnectionAffinity)
+        SYSCALL(outbox = (outbox_t*) calloc((size_t)maxconns,sizeof(outbox_t)),NULL,"calloc outbox in main");
+
+    /* senza ConnectionAffinity gli invii avvengono con una mutex mtx_req acquisita,
+     * e una coroutine non può sospendersi finché la tiene */
+    if(conf->Coroutines && !conf->ConnectionAffinity)
+    {
+        fprintf(stderr,"Coroutines richiede ConnectionAffinity: le richieste vengono eseguite dai thread del pool\n");
+        conf->Coroutines = 0;
+    }
+    if(conf->Coroutines)
+    {
+        pthread_t coro_poller;
+        SYSCALL(corowaits = (corowait_t*) calloc((size_t)maxconns,sizeof(corowait_t)),NULL,"calloc corowaits in main");
+        SYSCALL(corowheel = twheel_create((unsigned long)monotonicTime()),NULL,"twheel_create corowheel in main");
+        SYSCALL(coroepfd = epoll_create1(0),-1,"epoll_create1 coroepfd in main");
+        DIVZERO(pthread_create(&coro_poller,&attr,&coro_function,(void*)(long)coroepfd),"coro_poller pthread_create in main");
+
+        // da qui le attese di readn/writen nelle coroutine cedono il thread invece di bloccarlo
+        waitHook = coro_wait;
+    }
+
+    /* ------- Inizializzazione delle mutex ------ */
+    int m;
+    for(m = 0; m<npartitions; m++)
+        DIVZERO(pthread_mutex_init(&mtx_users[m],NULL),"pthread_mutex_init mtx_users in main");
+
+    for(m = 0; m<MAX_MTX_REQ; m++)
+        DIVZERO(pthread_mutex_init(&mtx_req[m],NULL),"pthread_mutex_init mtx_req in main");
+
+    /* ------- Creazione hash table degli gli utenti registrati ------- */
+    SYSCALL(users = icl_hash_create(MAX_ICL_BUCKETS,npartitions,NULL,NULL),
+            NULL,"icl_hash_create in main");
+
+    /* ------- Insiemi di CPU dei thread del server ------ */
+    SYSCALL(affinity_parse(conf->ListenerCPUs,&listenercpus),-1,"affinity_parse ListenerCPUs in main");
+    SYSCALL(affinity_parse(conf->ReactorCPUs,&reactorcpus),-1,"affinity_parse ReactorCPUs in main");
+    SYSCALL(affinity_parse(conf->PoolCPUs,&poolcpus),-1,"affinity_parse PoolCPUs in main");
+
+    /* ------- Creazione del pool di thread ------ */
+    // senza MinThreads e MaxThreads il pool ha esattamente ThreadsInPool thread
+    int minthreads = (conf->MinThreads > 0) ? conf->MinThreads : conf->ThreadsInPool;
+    int maxthreads = (conf->MaxThreads > 0) ? conf->MaxThreads : minthreads;
+    // con PoolCPUs ogni thread resta su una CPU, e quindi su un nodo NUMA, per tutta la sua vita
+    if ((thpool = threadpool_create_pinned(minthreads,maxthreads,MAX_QUEUE,
+                                           (conf->WorkStealing) ? threadpool_stealing : 0,
+                                           poolcpus.cpus,poolcpus.ncpus)) == NULL)
+        ERRORE("threadpool_create in main");
+
+    // un disco lento o un file grande occupano solo i thread di questo pool, non quelli che servono la chat
+    if (conf->DiskThreads > 0 && (diskpool = threadpool_create(conf->DiskThreads,MAX_QUEUE)) == NULL)
+        ERRORE("threadpool_create diskpool in main");
+
+    // soglie di carico oltre le quali gli event loop smettono di affidare richieste al pool
+    if(conf->HighWatermark <= 0 || conf->HighWatermark > MAX_QUEUE)
+        conf->HighWatermark = MAX_QUEUE/4;
+    if(conf->LowWatermark <= 0 || conf->LowWatermark >= conf->HighWatermark)
+        conf->LowWatermark = conf->HighWatermark/2;
+
+    /* ------- Creazione socket di connessione con i client ------ */
+    int sfd=0;
+    int *restored = NULL, nrestored = 0;
+
+    if(upgrade) // ricevo il socket, i client e lo stato dal server in esecuzione, che poi terminerà
+    {
+        int hfd;
+        if(conf->HandoverPath == NULL)
+        {
+            usage(argv[0]);
+            exit(EXIT_FAILURE);
+        }
+        ownsockets = 0;
+        SYSCALL(hfd = handover_connect(conf->HandoverPath),-1,"handover_connect in main");
+        SYSCALL(nrestored = handover_recv(hfd,&sfd,users,&chattyStats,conns,maxconns,&restored),-1,"handover_recv in main");
+        close(hfd);
+        ownsockets = 1;
+    }
+    else
+    {
+        unlinkSocket();
+        struct sockaddr_un sa;
+
+        //creo il descrittore per il socket
+        SYSCALL( sfd = socket(AF_UNIX,SOCK_STREAM,0) , -1, "socket in main");
+
+        //inizializzo la struttura sockaddr_un
+        memset(&sa,'0', sizeof(sa));
+        sa.sun_family = AF_UNIX;
+        strncpy(sa.sun_path, conf->UnixPath, sizeof(sa.sun_path)-1);
+
+        //con bind associo il socket all'indirizzo specificato nella struttura precedente
+        SYSCALL( bind(sfd,(struct sockaddr *) &sa, sizeof(sa)) , -1, "bind in main");
+
+        /* con listen specifico che il socket può accettare altre connessioni da parte di altri processi;
+         * la coda è indipendente da MaxConnections, così una raffica di connessioni non la riempie */
+        SYSCALL( listen(sfd,(conf->ListenBacklog > 0) ? conf->ListenBacklog : SOMAXCONN) , -1 , "listen in main");
+    }
+
+    /* ------- Creazione degli event loop ------- */
+    nreactors = (conf->ReactorThreads > 0) ? conf->ReactorThreads : 1;
+    assert(nreactors <= MAX_REACTORS);
+    SYSCALL(reactors = (reactor_t*) calloc((size_t)nreactors,sizeof(reactor_t)),NULL,"calloc reactors in main");
+
+    for(m = 0; m<nreactors; m++)
+    {
+        struct epoll_event ev;
+        SYSCALL(reactors[m].epfd = epoll_create1(0),-1,"epoll_create1 in main");
+        SYSCALL(reactors[m].completed = cqueue_create(MAX_CQUEUE),NULL,"cqueue_create in main");
+        if(idle)
+            SYSCALL(reactors[m].idle = twheel_create((unsigned long)monotonicTime()),NULL,"twheel_create in main");
+
+        // registro l'eventfd della coda di completamento, che rimane sempre in ascolto
+        memset(&ev,0,sizeof(ev));
+        ev.events = EPOLLIN;
+        ev.data.fd = reactors[m].completed->efd;
+        SYSCALL(epoll_ctl(reactors[m].epfd,EPOLL_CTL_ADD,reactors[m].completed->efd,&ev),-1,"epoll_ctl efd in main");
+
+        startReactor(&reactors[m]);
+    }
+
+    // affido agli event loop i client ricevuti dal server precedente
+    for(m = 0; m<nrestored; m++)
+        registerConnection(restored[m],conns[restored[m]]->end > conns[restored[m]]->start);
+    free(restored);
+
+    /* ------- Creazione del thread listener ------- */
+    DIVZERO(pthread_create(&listener,NULL,&listener_function,(void*)(unsigned long)sfd),"listener pthread_create in main");
+    DIVZERO(affinity_pin(listener,&listenercpus,-1),"affinity_pin listener in main");
+
+    /* ------- Creazione del thread che attende un processo sostitutivo ------- */
+    if(conf->HandoverPath)
+    {
+        long hsfd;
+        pthread_t handover;
+        SYSCALL(hsfd = handover_listen(conf->HandoverPath),-1,"handover_listen in main");
+        DIVZERO(pthread_create(&handover,&attr,&handover_function,(void*)hsfd),"handover pthread_create in main");
+    }
+
+    // attendo la terminazione del thread listener, per chiudere il server o per passare i client a un nuovo processo
+    int status_listener;
+    while(1)
+    {
+        pthread_join(listener,(void*)&status_listener);
+
+        int hfd = __atomic_load_n(&handoverfd,__ATOMIC_ACQUIRE);
+        if(hfd < 0) // terminazione richiesta con un segnale
+            break;
+
+        if(handoverServer(hfd,sfd) == 0)
+        {
+            ownsockets = 0;
+            close(hfd);
+            break;
+        }
+
+        // il nuovo processo non ha ricevuto lo stato: riprendo l'esecuzione
+        fprintf(stderr,"handover fallito, il server riprende l'esecuzione\n");
+        close(hfd);
+        __atomic_store_n(&handoverfd,-1,__ATOMIC_RELEASE);
+        for(m = 0; m<nreactors; m++)
+            startReactor(&reactors[m]);
+        DIVZERO(pthread_create(&listener,NULL,&listener_function,(void*)(unsigned long)sfd),"listener pthread_create in main");
+        DIVZERO(affinity_pin(listener,&listenercpus,-1),"affinity_pin listener in main");
+    }
+
+    /* ----- TERMINAZIONE SERVER ----- */
+    for(m = 0; m<nreactors; m++)
+    {
+        if(!reactors[m].started)
+            continue;
+        pthread_cancel(reactors[m].tid);
+        pthread_join(reactors[m].tid,NULL);
+        reactors[m].started = 0;
+    }
+    close(sfd);
+    pthread_attr_destroy(&attr);
+    return 0;
+}
+
+/* IMPLEMENTAZIONE FUNZIONI DI UTILITÀ*/
+static void usage(const char *progname)
+{
+    fprintf(stderr, "Il server va lanciato con il seguente comando:\n");
+    fprintf(stderr, "  %s -f conffile [-u]\n", progname);
+    fprintf(stderr, "  -u subentra al server in esecuzione, ricevendo da esso connessioni e stato (richiede HandoverPath)\n");
+}
+
+static void unlinkSocket()
+{
+    // durante e dopo una sostituzione i socket appartengono anche all'altro processo
+    if(!ownsockets)
+        return;
+
+    unlink(conf->UnixPath);
+    if(conf->HandoverPath)
+        unlink(conf->HandoverPath);
+}
+
+void cleanup()
+{
+    if(reactors)
+    {
+        int running = 0;
+        for(int i=0; i<nreactors; i++)
+        {
+            if(reactors[i].started) // event loop ancora attivo, non posso liberarlo
+            {
+                running = 1;
+                continue;
+            }
+            close(reactors[i].epfd);
+            cqueue_destroy(reactors[i].completed);
+            twheel_destroy(reactors[i].idle);
+            free(reactors[i].parked);
+        }
+        if(!running) free(reactors);
+    }
+    if(conns)
+    {
+        for(int i=0; i<maxconns; i++)
+            connbuf_destroy(conns[i]);
+        free(conns);
+    }
+    if(held)
+    {
+        for(int i=0; i<maxconns; i++)
+        {
+            for(request_t *r = held[i], *next; r != NULL; r = next)
+            {
+                next = r->next;
+                free(r->msg.data.buf);
+                free(r->file.buf);
+                free(r);
+            }
+        }
+        free(held);
+    }
+    if(idle) free(idle);
+    if(corowaits) free(corowaits);
+    if(corowheel) twheel_destroy(corowheel);
+    if(outbox)
+    {
+        for(int i=0; i<maxconns; i++)
+        {
+            for(outmsg_t *m = outbox[i].inbox, *next; m != NULL; m = next)
+            {
+                next = m->next;
+                free(m->msg.data.buf);
+                free(m);
+            }
+        }
+        free(outbox);
+    }
+    if(conf_filepath) free(conf_filepath);
+    affinity_free(&listenercpus);
+    affinity_free(&reactorcpus);
+    affinity_free(&poolcpus);
+    if(conf) conf_destroy(conf);
+    if(diskpool) threadpool_destroy(diskpool,0);
+    if(thpool) threadpool_destroy(thpool,0);
+    if(users) icl_hash_destroy(users,free,deleteQueue);
+}
+
+void* listener_function(void *connfd)
+{
+    //imposto il thread come cancellabile in qualsiasi momento
+    pthread_setcanceltype(PTHREAD_CANCEL_ASYNCHRONOUS,NULL);
+
+    long sfd = (unsigned long) connfd;
+    int fdc[MAX_EVENTS], naccepted, starved = 0, err;
+
+    // con io_uring una raffica di connessioni viene raccolta con una sola system call
+    uring_t *ring = uring_get();
+    struct pollfd pfd;
+
+    /* senza io_uring attendo le connessioni con poll e le accetto finché il socket non è vuoto;
+     * il socket può essere stato ricevuto da un processo che usava l'altra modalità */
+    pfd.fd = (int)sfd;
+    pfd.events = POLLIN;
+    int flags;
+    SYSCALL(flags = fcntl((int)sfd,F_GETFL),-1,"fcntl in listener_function");
+    flags = (ring == NULL) ? (flags | O_NONBLOCK) : (flags & ~O_NONBLOCK);
+    SYSCALL(fcntl((int)sfd,F_SETFL,flags),-1,"fcntl in listener_function");
+
+    // termino quando un nuovo processo chiede di subentrare al server
+    while(__atomic_load_n(&handoverfd,__ATOMIC_ACQUIRE) < 0)
+    {
+        // il listener si occupa solo di accettare nuove connessioni
+        err = 0;
+        if(ring != NULL)
+        {
+            if((naccepted = uring_accept(ring,(int)sfd,fdc,MAX_EVENTS)) == -1)
+            {
+                err = errno;
+                naccepted = 0;
+            }
+        }
+        else
+        {
+            SYSCALL(poll(&pfd,1,-1),-1,"poll in listener_function");
+
+            // svuoto la coda delle connessioni in attesa con un solo risveglio
+            naccepted = 0;
+            while(naccepted < MAX_EVENTS)
+            {
+                if((fdc[naccepted] = accept4((int)sfd,NULL,NULL,SOCK_NONBLOCK | SOCK_CLOEXEC)) != -1)
+                    naccepted++;
+                else if(errno == EAGAIN || errno == EWOULDBLOCK)
+                    break;
+                else if(errno != EINTR && errno != ECONNABORTED)
+                {
+                    err = errno;
+                    break;
+                }
+            }
+        }
+
+        // ogni nuova connessione parte con il protocollo v1, finché il client non negozia la v2
+        for(int i=0; i<naccepted; i++)
+        {
+            wire_setVersion(fdc[i],WIRE_V1);
+            registerConnection(fdc[i],0);
+        }
+
+        if(err == 0)
+        {
+            starved = 0;
+            continue;
+        }
+        if(err != EMFILE && err != ENFILE && err != ENOBUFS && err != ENOMEM)
+        {
+            errno = err;
+            ERRORE(ring != NULL ? "uring_accept in listener_function" : "accept4 in listener_function");
+        }
+
+        /* finiti i descrittori o la memoria: le connessioni restano in coda nel socket, che
+         * resta in ascolto; smetto di svuotarla e riprovo quando i client chiusi ne hanno
+         * liberati. Segnalo l'errore una volta sola per ogni periodo di esaurimento */
+        if(!starved)
+        {
+            errno = err;
+            perror(ring != NULL ? "uring_accept in listener_function" : "accept4 in listener_function");
+            starved = 1;
+        }
+        struct timespec pause = {0, ACCEPT_BACKOFF * 1000000L};
+        nanosleep(&pause,NULL);
+    }
+
+    // le connessioni già accettate dal kernel nel ring vanno comunque affidate agli event loop
+    if(ring != NULL)
+    {
+        while((naccepted = uring_accept_stop(ring,fdc,MAX_EVENTS)) > 0)
+            for(int i=0; i<naccepted; i++)
+            {
+                wire_setVersion(fdc[i],WIRE_V1);
+                registerConnection(fdc[i],0);
+            }
+        SYSCALL(naccepted,-1,"uring_accept_stop in listener_function");
+    }
+
+    return NULL;
+}
+
+void* reactor_function(void *reactor)
+{
+    //imposto il thread come cancellabile in qualsiasi momento
+    pthread_setcanceltype(PTHREAD_CANCEL_ASYNCHRONOUS,NULL);
+
+    reactor_t *r = (reactor_t*) reactor;
+    int nready;
+    struct epoll_event events[MAX_EVENTS];
+
+    // se l'event loop viene riavviato, la coda può contenere completamenti già notificati
+    drainCompleted(r);
+    flushDispatch(r);
+
+    // termino quando un nuovo processo chiede di subentrare al server
+    while(__atomic_load_n(&handoverfd,__ATOMIC_ACQUIRE) < 0)
+    {
+        // attendo solo i FD effettivamente pronti, senza scorrere tutti i descrittori
+        // con il timeout di inattività mi risveglio almeno una volta al secondo per far avanzare la ruota dei timer,
+        // con dei client parcheggiati ogni BACKPRESSURE_POLL millisecondi per ricontrollare il carico del pool
+        int timeout = (r->nparked > 0) ? BACKPRESSURE_POLL : (r->idle != NULL) ? 1000 : -1;
+        SYSCALL(nready = epoll_wait(r->epfd, events, MAX_EVENTS, timeout),-1, "epoll_wait in reactor_function");
+
+        for(int i=0; i < nready; i++)
+        {
+            int fd = events[i].data.fd;
+
+            if(fd == r->completed->efd) // fine dell'esecuzione di una o più richieste
+            {
+                uint64_t cnt;
+                SYSCALL(read(fd,&cnt,sizeof(cnt)),-1,"read efd in reactor_function");
+                drainCompleted(r);
+            }
+            else /* sock I/0 pronto (già disarmato grazie a EPOLLONESHOT) */
+            {
+                touchConnection(r,fd);
+
+                /* primo evento di un client registrato in scrittura: affido le richieste già
+                 * ricevute (da un processo precedente) o inizio ad ascoltarlo */
+                if(!(events[i].events & (EPOLLIN | EPOLLHUP | EPOLLERR)))
+                    resumeConnection(r,fd);
+                else
+                    readRequest(r,fd);
+            }
+        }
+
+        // il pool si è scaricato: riprendo i client lasciati in attesa
+        resumeParked(r);
+
+        // chiudo i client inattivi da più di IdleTimeout secondi
+        if(r->idle != NULL)
+            twheel_advance(r->idle,(unsigned long)monotonicTime(),expireConnection,r);
+
+        // affido al pool in blocco le richieste estratte in questo giro
+        flushDispatch(r);
+    }
+
+    return NULL;
+}
+
+static void drainCompleted(reactor_t *r)
+{
+    int fdc;
+    long ndone, left;
+
+    // con un solo risveglio riarmo tutti i client le cui richieste sono state soddisfatte
+    do
+    {
+        ndone = 0;
+        while(cqueue_pop(r->completed,&fdc))
+        {
+            // se nel buffer sono rimaste richieste complete le affido subito, altrimenti torno ad ascoltare il client
+            resumeConnection(r,fdc);
+            ndone++;
+        }
+        // un produttore ha riservato uno slot ma non l'ha ancora pubblicato
+        if((left = cqueue_ack(r->completed,ndone)) > 0 && ndone == 0)
+            sched_yield();
+    } while(left > 0);
+}
+
+static void registerConnection(int fd, int pending)
+{
+    struct epoll_event ev;
+
+    if(fd >= maxconns) // non posso tenere lo stato del client
+    {
+        close(fd);
+        return;
+    }
+
+    if(conns[fd] == NULL)
+        SYSCALL(conns[fd] = connbuf_create(),NULL,"connbuf_create in registerConnection");
+
+    /* affido il client all'event loop che ne è proprietario; i client sono registrati
+     * in modalità one-shot: dopo il primo evento il FD viene disarmato finché un worker
+     * non ne segnala la fine della richiesta.
+     * I client sono già non bloccanti: vengono letti solo dall'event loop.
+     * Con il timeout di inattività, o con richieste già ricevute, registro il client in
+     * scrittura: il socket è subito scrivibile, quindi l'event loop lo prende in carico
+     * anche se il client resta muto */
+    memset(&ev,0,sizeof(ev));
+    ev.events = ((idle != NULL || pending) ? EPOLLOUT : EPOLLIN) | EPOLLONESHOT;
+    ev.data.fd = fd;
+    SYSCALL(epoll_ctl(getReactor(fd)->epfd,EPOLL_CTL_ADD,fd,&ev),-1,"epoll_ctl add in registerConnection");
+}
+
+static void startReactor(reactor_t *r)
+{
+    DIVZERO(pthread_create(&r->tid,NULL,&reactor_function,(void*)r),"reactor pthread_create in startReactor");
+    // ogni event loop su una CPU diversa: i buffer dei suoi client vengono allocati sul suo nodo
+    DIVZERO(affinity_pin(r->tid,&reactorcpus,(int)(r - reactors)),"affinity_pin in startReactor");
+    r->started = 1;
+}
+
+static int handoverServer(int hfd, int sfd)
+{
+    uint64_t one = 1;
+
+    // il listener è già terminato: risveglio gli event loop, che terminano dopo gli eventi già ricevuti
+    for(int i=0; i<nreactors; i++)
+    {
+        SYSCALL(write(reactors[i].completed->efd,&one,sizeof(one)),-1,"write efd in handoverServer");
+        DIVZERO(pthread_join(reactors[i].tid,NULL),"pthread_join in handoverServer");
+        reactors[i].started = 0;
+    }
+
+    // le richieste che il pool non aveva potuto accogliere vanno eseguite prima di cedere i client
+    for(int fd = 0; fd < maxconns; fd++)
+    {
+        while(held[fd] != NULL && threadpool_add_to(thpool,fd,chooseRequest,(void*)held[fd]) < 0)
+        {
+            struct timespec pause = {0, BACKPRESSURE_POLL * 1000000L};
+            nanosleep(&pause,NULL);
+        }
+        held[fd] = NULL;
+    }
+
+    /* attendo le richieste in esecuzione: da qui in poi nessun thread legge o scrive sui client.
+     * Una richiesta passa da un pool all'altro (fileRequest) prima di lasciare il precedente,
+     * ma i due pool non si leggono nello stesso istante: una richiesta può passare dall'uno
+     * all'altro fra le due letture. Considero finito il lavoro solo quando entrambi i pool,
+     * e le coroutine sospese su un client, risultano vuoti in due controlli consecutivi */
+    for(int quiet = 0; quiet < 2; )
+    {
+        DIVZERO(threadpool_wait(thpool),"threadpool_wait in handoverServer");
+        if(diskpool)
+            DIVZERO(threadpool_wait(diskpool),"threadpool_wait diskpool in handoverServer");
+
+        if(threadpool_pending(thpool) == 0 && (diskpool == NULL || threadpool_pending(diskpool) == 0) &&
+           __atomic_load_n(&ncoroutines,__ATOMIC_SEQ_CST) == 0)
+            quiet++;
+        else
+        {
+            struct timespec pause = {0, BACKPRESSURE_POLL * 1000000L};
+            quiet = 0;
+            nanosleep(&pause,NULL);
+        }
+    }
+
+    if(handover_send(hfd,sfd,users,&chattyStats,conns,maxconns) == -1)
+    {
+        perror("handover_send in handoverServer");
+        return -1;
+    }
+
+    return 0;
+}
+
+void* handover_function(void *hsfd)
+{
+    //imposto il thread come cancellabile in qualsiasi momento
+    pthread_setcanceltype(PTHREAD_CANCEL_ASYNCHRONOUS,NULL);
+
+    int hfd, wfd, none;
+    struct sockaddr_un sa;
+
+    memset(&sa,0,sizeof(sa));
+    sa.sun_family = AF_UNIX;
+    strncpy(sa.sun_path, conf->UnixPath, sizeof(sa.sun_path)-1);
+
+    while(1)
+    {
+        SYSCALL(hfd = accept((int)(long)hsfd,NULL,NULL),-1,"accept in handover_function");
+
+        // una sola sostituzione alla volta
+        none = -1;
+        if(!__atomic_compare_exchange_n(&handoverfd,&none,hfd,0,__ATOMIC_ACQ_REL,__ATOMIC_ACQUIRE))
+        {
+            close(hfd);
+            continue;
+        }
+
+        /* risveglio il listener con una connessione fittizia: verrà trattata come un
+         * client che chiude subito la connessione, da questo o dal nuovo processo */
+        SYSCALL(wfd = socket(AF_UNIX,SOCK_STREAM,0),-1,"socket in handover_function");
+        connect(wfd,(struct sockaddr*)&sa,sizeof(sa));
+        close(wfd);
+    }
+}
+
+static void rearm(reactor_t *r, int fd)
+{
+    struct epoll_event ev;
+    memset(&ev,0,sizeof(ev));
+    ev.events = EPOLLIN | EPOLLONESHOT;
+    ev.data.fd = fd;
+    SYSCALL(epoll_ctl(r->epfd,EPOLL_CTL_MOD,fd,&ev),-1,"epoll_ctl mod in rearm");
+}
+
+static int dispatchRequest(int fd, int eof, op_t reply, reactor_t *r)
+{
+    request_t *req, *head, **last;
+    int n = 0;
+    op_t refuse = 0;
+
+    // un client chiuso può avere ancora in held le richieste e la chiusura
+    if(conns[fd] == NULL && held[fd] == NULL && !eof)
+        return 0;
+
+    /* controllo di non aver raggiunto il massimo numero di utenti connessi consentiti dal server:
+     * le richieste vengono comunque estratte, e il pool risponderà OP_FAIL senza eseguirle */
+    if(!eof && held[fd] == NULL && chattyStats.nonline >= conf->MaxConnections)
+        refuse = OP_FAIL;
+
+    /* pool sovraccarico: non estraggo altre richieste (la chiusura invece viene sempre eseguita).
+     * Con BusyReply le estraggo comunque, ma il pool risponderà OP_SERVER_BUSY senza eseguirle:
+     * l'event loop non scrive mai sui client */
+    if(!eof && (held[fd] != NULL || connbuf_ready(conns[fd],wire_version(fd))) && overloaded())
+    {
+        if(!conf->BusyReply)
+            return -1;
+        refuse = OP_SERVER_BUSY;
+    }
+
+    // le richieste rimaste in sospeso precedono quelle ancora nel buffer
+    head = held[fd];
+    held[fd] = NULL;
+    for(last = &head; *last != NULL; last = &(*last)->next)
+        n++;
+
+    /* le richieste già ricevute vengono eseguite in ordine da un solo thread del pool,
+     * senza ripassare dall'event loop; il limite evita che un client monopolizzi un thread */
+    while(conns[fd] != NULL && (eof || n < MAX_PIPELINE))
+    {
+        SYSCALL(req = (request_t*) malloc(sizeof(request_t)),NULL,"malloc req in dispatchRequest");
+        if(!connbuf_getRequest(conns[fd],wire_version(fd),&req->msg,&req->file,req->zlen))
+        {
+            free(req);
+            break;
+        }
+        req->fd = fd;
+        req->eof = 0;
+        req->reply = refuse;
+        req->next = NULL;
+        *last = req;
+        last = &req->next;
+        n++;
+    }
+
+    // la chiusura viene eseguita dopo le richieste che la precedono
+    if(eof)
+    {
+        SYSCALL(req = (request_t*) calloc(1,sizeof(request_t)),NULL,"calloc req in dispatchRequest");
+        req->fd = fd;
+        req->eof = 1;
+        req->reply = reply;
+        *last = req;
+    }
+
+    if(head == NULL)
+        return 0;
+
+    // il client non è inattivo finché un thread del pool ne esegue le richieste
+    if(idle != NULL && !eof)
+        __atomic_store_n(&idle[fd].last,IDLE_BUSY,__ATOMIC_RELEASE);
+
+    // le richieste normali di un client vanno preferibilmente sempre allo stesso thread del pool
+    int lane = requestLane(head), err;
+    if(r != NULL)
+    {
+        dispatch_t *batch = &r->batch;
+        if(batch->n[lane] == MAX_EVENTS)
+            flushDispatch(r);
+        batch->reqs[lane][batch->n[lane]] = head;
+        batch->keys[lane][batch->n[lane]++] = (unsigned int)fd;
+        return 1;
+    }
+    if(lane == threadpool_lane_normal)
+        err = threadpool_add_to(thpool, fd, chooseRequest,(void*)head);
+    else
+        err = threadpool_add_prio(thpool, lane, chooseRequest,(void*)head);
+    // coda del pool piena nonostante le soglie: tengo da parte le richieste e il client verrà parcheggiato
+    if (err < 0)
+    {
+        held[fd] = head;
+        return -1;
+    }
+
+    return 1;
+}
+
+static void flushDispatch(reactor_t *r)
+{
+    dispatch_t *batch = &r->batch;
+    int lane, added, i, fd;
+
+    for(lane = 0; lane < THREADPOOL_LANES; lane++)
+    {
+        if(batch->n[lane] == 0)
+            continue;
+
+        added = threadpool_add_batch(thpool, lane, chooseRequest, batch->reqs[lane], batch->keys[lane], batch->n[lane]);
+        // come in dispatchRequest: quello che non entra nella coda resta da parte, e il client attende il prossimo giro
+        for(i = (added > 0) ? added : 0; i < batch->n[lane]; i++)
+        {
+            fd = (int)batch->keys[lane][i];
+            held[fd] = (request_t*) batch->reqs[lane][i];
+            parkConnection(r,fd);
+        }
+        batch->n[lane] = 0;
+    }
+}
+
+static int overloaded(void)
+{
+    int pending = threadpool_pending(thpool);
+
+    if(!__atomic_load_n(&throttled,__ATOMIC_RELAXED))
+    {
+        if(pending < conf->HighWatermark)
+            return 0;
+        // solo il thread che cambia lo stato conta l'evento
+        if(__sync_bool_compare_and_swap(&throttled,0,1))
+        {
+            LOCK(mtx_stats, "mtx_stats in overloaded");
+            chattyStats.nthrottled++;
+            UNLOCK(mtx_stats, "mtx_stats in overloaded");
+        }
+        return 1;
+    }
+
+    if(pending > conf->LowWatermark)
+        return 1;
+    __atomic_store_n(&throttled,0,__ATOMIC_RELAXED);
+    return 0;
+}
+
+static void resumeConnection(reactor_t *r, int fd)
+{
+    switch(dispatchRequest(fd,0,0,r))
+    {
+        case 0: rearm(r,fd); break;
+        case -1: parkConnection(r,fd); break;
+    }
+}
+
+static void parkConnection(reactor_t *r, int fd)
+{
+    if(r->nparked == r->maxparked)
+    {
+        r->maxparked = (r->maxparked > 0) ? 2*r->maxparked : 64;
+        SYSCALL(r->parked = (int*) realloc(r->parked,(size_t)r->maxparked*sizeof(int)),NULL,"realloc parked in parkConnection");
+    }
+    r->parked[r->nparked++] = fd;
+
+    // il client parcheggiato non è inattivo: ha delle richieste da eseguire
+    if(idle != NULL)
+        __atomic_store_n(&idle[fd].last,IDLE_BUSY,__ATOMIC_RELEASE);
+}
+
+static void resumeParked(reactor_t *r)
+{
+    int i, ret = 0;
+
+    if(r->nparked == 0 || overloaded())
+        return;
+
+    // mi fermo al primo client che non riesco ad affidare: resterà in testa per il prossimo controllo
+    for(i = 0; i < r->nparked; i++)
+    {
+        int fd = r->parked[i];
+
+        if((ret = dispatchRequest(fd,0,0,r)) < 0)
+            break;
+        if(ret == 0) // torna ad attendere dati, e quindi a poter scadere
+        {
+            touchConnection(r,fd);
+            rearm(r,fd);
+        }
+    }
+
+    r->nparked -= i;
+    memmove(r->parked,r->parked + i,(size_t)r->nparked*sizeof(int));
+}
+
+static int requestLane(request_t *head)
+{
+    int lane = threadpool_lane_high;
+
+    for(; head != NULL; head = head->next)
+    {
+        if(head->eof || head->reply != 0)
+            continue;
+
+        switch(head->msg.hdr.op)
+        {
+            case REGISTER_OP:
+            case CONNECT_OP:
+            case USRLIST_OP:
+            case UNREGISTER_OP:
+            case DISCONNECT_OP:
+                break;
+
+            case POSTFILE_OP:
+            case GETFILE_OP:
+            case GETPREVMSGS_OP:
+            case POSTTXTALL_OP:
+                return threadpool_lane_low;
+
             default:
-                usage(argv[0]);
+                lane = threadpool_lane_normal;
                 break;
         }
     }
+    return lane;
+}
 
-    /* ------- Inizializzazione della pipe  ------- */
-    SYSCALL(pipe(answers),-1,"pipe in main");
-
-    /* ------- Inizializzazione dei parametri di configurazione del server ------- */
-    SYSCALL( conf = (config_t*) malloc(sizeof(config_t)), NULL, "malloc conf in main")
-    parseConfigurationFile(conf,conf_filepath);
+static void readRequest(reactor_t *r, int fd)
+{
+    ssize_t n;
 
-    //creo la directory (se essa non esiste) in cui salverò i file ricevuti dai client
-    struct stat st;
-    if (stat(conf->DirName, &st) == -1)
-        mkdir(conf->DirName, 0777);
+    if(fd >= maxconns)
+        ERRORE("fd out of range in readRequest");
 
-    // il numero di partizioni della hash table è pari al numero di thread nel pool
-    int npartitions = conf->ThreadsInPool;// + (MAX_ICL_BUCKETS % conf->ThreadsInPool);
-    assert(npartitions <= MAX_MTX_USR);
+    if(conns[fd] == NULL)
+        SYSCALL(conns[fd] = connbuf_create(),NULL,"connbuf_create in readRequest");
 
-    /* ------- Inizializzazione delle mutex ------ */
-    int m;
-    for(m = 0; m<npartitions; m++)
-        DIVZERO(pthread_mutex_init(&mtx_users[m],NULL),"pthread_mutex_init mtx_users in main");
+    // svuoto il socket, così una raffica di richieste viene affidata al pool in blocco
+    for(int i=0; i < MAX_PIPELINE; i++)
+    {
+        if((n = connbuf_fill(conns[fd],fd)) > 0)
+            continue;
 
-    for(m = 0; m<MAX_MTX_REQ; m++)
-        DIVZERO(pthread_mutex_init(&mtx_req[m],NULL),"pthread_mutex_init mtx_req in main");
+        if(n == -1 && errno == EINTR)
+            continue;
 
-    /* ------- Creazione hash table degli gli utenti registrati ------- */
-    SYSCALL(users = icl_hash_create(MAX_ICL_BUCKETS,npartitions,NULL,NULL),
-            NULL,"icl_hash_create in main");
+        if(n == -1 && (errno == EAGAIN || errno == EWOULDBLOCK)) // nessun altro dato disponibile
+            break;
 
-    /* ------- Creazione del pool di thread ------ */
-    if ((thpool = threadpool_create(conf->ThreadsInPool,MAX_QUEUE)) == NULL)
-        ERRORE("threadpool_create in main");
+        if(n == -1 && errno == EMSGSIZE) // il client dichiara un body oltre i limiti: non lo ricevo
+        {
+            closeConnection(r,fd,OP_MSG_TOOLONG);
+            return;
+        }
 
-    /* ------- Creazione socket di connessione con i client ------ */
-    unlinkSocket();
-    int sfd=0;
-    struct sockaddr_un sa;
+        if(n == -1 && errno != ENOMEM && errno != EPROTO)
+            ERRORE("connbuf_fill in readRequest");
 
-    //creo il descrittore per il socket
-    SYSCALL( sfd = socket(AF_UNIX,SOCK_STREAM,0) , -1, "socket in main");
+        // connessione chiusa dal client, richiesta malformata o memoria insufficiente: chiudo solo questo client
+        closeConnection(r,fd,0);
+        return;
+    }
 
-    //inizializzo la struttura sockaddr_un
-    memset(&sa,'0', sizeof(sa));
-    sa.sun_family = AF_UNIX;
-    strncpy(sa.sun_path, conf->UnixPath, sizeof(sa.sun_path)-1);
+    // se non ho ancora una richiesta completa attendo altri dati
+    resumeConnection(r,fd);
+}
 
-    //con bind associo il socket all'indirizzo specificato nella struttura precedente
-    SYSCALL( bind(sfd,(struct sockaddr *) &sa, sizeof(sa)) , -1, "bind in main");
+static long monotonicTime(void)
+{
+    struct timespec ts;
+    SYSCALL(clock_gettime(CLOCK_MONOTONIC,&ts),-1,"clock_gettime in monotonicTime");
+    return (long) ts.tv_sec;
+}
 
-    /* con listen specifico che il socket può accettare altre connessioni da parte di altri processi
-     * fino a un numero massimo (specificato nel file di configurazione) */
-    SYSCALL( listen(sfd,conf->MaxConnections) , -1 , "listen in main");
+static void touchConnection(reactor_t *r, int fd)
+{
+    long now;
 
-    /* ------- Creazione del thread listener ------- */
-    DIVZERO(pthread_create(&listener,NULL,&listener_function,(void*)(unsigned long)sfd),"listener pthread_create in main");
+    if(idle == NULL || fd >= maxconns)
+        return;
 
+    // il timer viene spostato solo alla scadenza: qui basta aggiornare l'istante dell'ultima attività
+    now = monotonicTime();
+    __atomic_store_n(&idle[fd].last,now,__ATOMIC_RELEASE);
+    if(!twheel_pending(&idle[fd].timer))
+        twheel_add(r->idle,&idle[fd].timer,(unsigned long)(now + conf->IdleTimeout));
+}
 
-    // attendo la terminazione del thread listener, per chiudere il server
-    int status_listener;
-    pthread_join(listener,(void*)&status_listener);
+static void expireConnection(twnode_t *timer, void *reactor)
+{
+    reactor_t *r = (reactor_t*) reactor;
+    idle_t *c = (idle_t*) timer;
+    int fd = (int)(c - idle);
+    long now = monotonicTime();
+    long last = __atomic_load_n(&c->last,__ATOMIC_ACQUIRE);
+
+    // richiesta in esecuzione o attività recente: rinvio la scadenza
+    if(last == IDLE_BUSY || now - last < conf->IdleTimeout)
+    {
+        twheel_add(r->idle,timer,(unsigned long)(((last == IDLE_BUSY) ? now : last) + conf->IdleTimeout));
+        return;
+    }
 
-    /* ----- TERMINAZIONE SERVER ----- */
-    close(sfd);
-    pthread_attr_destroy(&attr);
-    return 0;
+    // il client è armato solo nell'event loop: lo rimuovo, così nessun altro evento lo riguarderà
+    SYSCALL(epoll_ctl(r->epfd,EPOLL_CTL_DEL,fd,NULL),-1,"epoll_ctl del in expireConnection");
+    closeConnection(r,fd,0);
 }
 
-/* IMPLEMENTAZIONE FUNZIONI DI UTILITÀ*/
-static void usage(const char *progname)
+static void closeConnection(reactor_t *r, int fd, op_t reply)
 {
-    fprintf(stderr, "Il server va lanciato con il seguente comando:\n");
-    fprintf(stderr, "  %s -f conffile\n", progname);
-}
+    if(idle != NULL)
+        twheel_del(&idle[fd].timer);
 
-static void unlinkSocket()  { unlink(conf->UnixPath); }
+    // eseguo le richieste complete rimaste: sarà un thread del pool ad aggiornare lo stato dell'utente e a chiudere il descrittore
+    dispatchRequest(fd,1,reply,r);
+    connbuf_destroy(conns[fd]);
+    conns[fd] = NULL;
+}
 
-void cleanup()
+/**
+ * @function acquireOutbox
+ * @brief Prova a diventare il proprietario della coda in uscita di un client
+ * @return 1 in caso di successo, 0 se un altro thread sta già scrivendo sul client
+ */
+static inline int acquireOutbox(outbox_t *o)
 {
-    close(answers[0]);
-    close(answers[1]);
-    if(conf_filepath) free(conf_filepath);
-    if(conf) conf_destroy(conf);
-    if(thpool) threadpool_destroy(thpool,0);
-    if(users) icl_hash_destroy(users,free,deleteQueue);
+    int free = 0;
+    return __atomic_compare_exchange_n(&o->owner,&free,1,0,__ATOMIC_SEQ_CST,__ATOMIC_RELAXED);
 }
 
-void* listener_function(void *connfd)
+static void deliver(long fd, message_t *msg, int hdronly)
 {
-    //imposto il thread come cancellabile in qualsiasi momento
-    pthread_setcanceltype(PTHREAD_CANCEL_ASYNCHRONOUS,NULL);
+    outbox_t *o;
+    outmsg_t *m;
 
-    fd_set set,tmpset;
-    long sfd = (unsigned long) connfd;
-    int fdc;
+    if(outbox == NULL || fd >= maxconns)
+    {
+        int mtxnum = (int)fd % MAX_MTX_REQ;
+        LOCK(mtx_req[mtxnum],"mtx_req in deliver");
+        if(hdronly)
+            sendHeader(fd,&msg->hdr);
+        else
+            sendRequest(fd,msg);
+        UNLOCK(mtx_req[mtxnum],"mtx_req in deliver");
+        return;
+    }
+
+    // nessun messaggio in attesa e nessun altro thread sul client: invio direttamente
+    o = &outbox[fd];
+    if(__atomic_load_n(&o->inbox,__ATOMIC_ACQUIRE) == NULL && acquireOutbox(o))
+    {
+        if(hdronly)
+            sendHeader(fd,&msg->hdr);
+        else
+            sendRequest(fd,msg);
+        flushOutbox(fd);
+        return;
+    }
 
-    // azzero il master set e il set temporaneo usato nella select
-    FD_ZERO(&set);
-    FD_ZERO(&tmpset);
+    // il chiamante può liberare i dati appena ritorno: il messaggio in coda ne ha una copia
+    SYSCALL(m = (outmsg_t*) malloc(sizeof(outmsg_t)),NULL,"malloc m in deliver");
+    m->msg = *msg;
+    m->hdronly = hdronly;
+    if(!hdronly && msg->data.hdr.len > 0)
+    {
+        SYSCALL(m->msg.data.buf = (char*) malloc(msg->data.hdr.len),NULL,"malloc buf in deliver");
+        memcpy(m->msg.data.buf,msg->data.buf,msg->data.hdr.len);
+    }
+    else
+        m->msg.data.buf = NULL;
 
-    // aggiungo FD del socket e della pipe al master set
-    FD_SET(sfd, &set);
-    FD_SET(answers[0], &set);
+    m->next = __atomic_load_n(&o->inbox,__ATOMIC_RELAXED);
+    while(!__atomic_compare_exchange_n(&o->inbox,&m->next,m,1,__ATOMIC_SEQ_CST,__ATOMIC_RELAXED));
 
-    // tengo traccia del FD con id più grande
-    int fdmax = (sfd > answers[0]) ? (int)sfd : answers[0];
+    // se il proprietario ha appena rilasciato il client il messaggio lo invio io
+    if(acquireOutbox(o))
+        flushOutbox(fd);
+}
 
-    while(1)
-    {
-        // copio il set nella variabile temporanea per la select
-        tmpset = set;
-        SYSCALL(select(fdmax+1, &tmpset, NULL, NULL, NULL),-1, "select in listener_function");
+static void flushOutbox(long fd)
+{
+    outbox_t *o = &outbox[fd];
+    outmsg_t *list, *m, *prev;
 
-        // identifico il FD dal quale ho ricevuto una richiesta
-        for(int fd=0; fd <= fdmax; fd++)
+    for(;;)
+    {
+        // estraggo tutti i messaggi in attesa e li invio nell'ordine di inserimento
+        while((list = __atomic_exchange_n(&o->inbox,NULL,__ATOMIC_ACQUIRE)) != NULL)
         {
-            if (FD_ISSET(fd, &tmpset))
+            for(prev = NULL; list != NULL; list = m)
             {
-                if (fd == sfd) // nuova richiesta di connessione
-                {
-                    SYSCALL(fdc = accept((int)sfd, (struct sockaddr*)NULL ,NULL),-1, "accept in listener_function");
-                    FD_SET(fdc, &set);
-                    if(fdc > fdmax)
-                        fdmax = fdc;
-                }
-                else if(fd == answers[0]) // fine dell'esecuzione di una richiesta
-                {
-                    LOCK(mtx_pipe,"mtx_pipe in listener_function");
-                    SYSCALL(read(fd,&fdc,sizeof(fdc)),-1,"read fdc in listener_function");
-                    UNLOCK(mtx_pipe,"mtx_pipe in listener_function");
+                m = list->next;
+                list->next = prev;
+                prev = list;
+            }
+            for(m = prev; m != NULL; m = prev)
+            {
+                prev = m->next;
+                if(m->hdronly)
+                    sendHeader(fd,&m->msg.hdr);
+                else
+                    sendRequest(fd,&m->msg);
+                free(m->msg.data.buf);
+                free(m);
+            }
+        }
 
-                    //il listener ricomincia ad ascoltare il client, la cui richiesta è stata soddisfatta
-                    FD_SET(fdc, &set);
+        /* rilascio il client e ricontrollo la coda: un messaggio inserito prima del
+         * rilascio ha trovato il client occupato, e deve inviarlo qualcuno */
+        __atomic_store_n(&o->owner,0,__ATOMIC_SEQ_CST);
+        if(__atomic_load_n(&o->inbox,__ATOMIC_SEQ_CST) == NULL || !acquireOutbox(o))
+            return;
+    }
+}
 
-                    if(fdc > fdmax)
-                        fdmax = fdc;
-                    break;
-                }
-                else /* sock I/0 pronto */
-                {
-                    FD_CLR(fd,&set);
+static void discardOutbox(int fd)
+{
+    outbox_t *o;
+    outmsg_t *list, *m;
 
-                    // controllo di non aver raggiunto il massimo numero di utenti connessi consentiti dal server
-                    if(chattyStats.nonline >= conf->MaxConnections)
-                    {
-                        message_hdr_t hdr_reply;
-                        setHeader(&hdr_reply, OP_FAIL, "server");
-                        sendHeader(fd, &hdr_reply);
-                    }
-                    else
-                    {
-                        if ((threadpool_add(thpool, chooseRequest,(void*)(unsigned long) fd)) < 0)
-                            ERRORE("threadpool_add in listener_function")
-                    }
-                }
-            }
-        }
+    if(outbox == NULL || fd >= maxconns)
+        return;
+
+    /* attendo che l'eventuale proprietario finisca di scrivere sul client; in una coroutine
+     * cedo il thread del pool, che potrebbe servire proprio a riprendere il proprietario */
+    o = &outbox[fd];
+    while(!acquireOutbox(o))
+    {
+        if(coro_wait(-1,0) < 0)
+            sched_yield();
+    }
+
+    for(list = __atomic_exchange_n(&o->inbox,NULL,__ATOMIC_ACQUIRE); list != NULL; list = m)
+    {
+        m = list->next;
+        free(list->msg.data.buf);
+        free(list);
     }
+    __atomic_store_n(&o->owner,0,__ATOMIC_RELEASE);
 }
 
 void* sig_manager_function(void* sigset)
@@ -322,83 +1498,318 @@ void* sig_manager_function(void* sigset)
     }
 }
 
-void chooseRequest(void* fd)
+void chooseRequest(void* req)
 {
-    int fdc = (int)((long)fd);
-    int res;
-    message_t msg;
-    SYSCALL(res = readMsg(fdc,&msg),-1,"readMsg in chooseRequest")
-    if(res == 0)
+    request_t *r = (request_t*) req, *next;
+    int fdc = r->fd, closed = 0;
+    coro_t *c;
+
+    // in una coroutine un client non pronto sospende le richieste, invece di bloccare il thread
+    if(coroepfd >= 0 && coro_self() == NULL && (c = coro_create(chooseRequest,req,CORO_STACK)) != NULL)
+    {
+        __atomic_add_fetch(&ncoroutines,1,__ATOMIC_SEQ_CST);
+        runCoroutine(c);
+        return;
+    }
+
+    // eseguo le richieste del client nell'ordine in cui sono arrivate
+    for(; r != NULL; r = next)
     {
-        if (icl_hash_set_offline(users,fdc) == 0)
+        next = r->next;
+        if(r->eof)
         {
-            LOCK(mtx_stats, "mtx_stats in chooseRequest");
-            chattyStats.nonline--;
-            UNLOCK(mtx_stats, "mtx_stats in chooseRequest");
+            // client rifiutato dall'event loop: gli rispondo prima di chiuderlo
+            if(r->reply != 0)
+            {
+                message_hdr_t hdr_reply;
+                setHeader(&hdr_reply, r->reply, "server");
+                deliverHeader(fdc, &hdr_reply);
+                LOCK(mtx_stats, "mtx_stats in chooseRequest");
+                chattyStats.nerrors++;
+                UNLOCK(mtx_stats, "mtx_stats in chooseRequest");
+            }
+            if (icl_hash_set_offline(users,fdc) == 0)
+            {
+                LOCK(mtx_stats, "mtx_stats in chooseRequest");
+                chattyStats.nonline--;
+                UNLOCK(mtx_stats, "mtx_stats in chooseRequest");
+            }
+            discardOutbox(fdc);
+            close(fdc);
+            closed = 1;
+        }
+        else if(r->reply != 0)
+        {
+            // richiesta rifiutata dall'event loop (sovraccarico o troppi utenti connessi): rispondo senza eseguirla
+            message_hdr_t hdr_reply;
+            setHeader(&hdr_reply, r->reply, "server");
+            deliverHeader(fdc, &hdr_reply);
+            free(r->msg.data.buf);
+            free(r->file.buf);
+            if(r->reply == OP_SERVER_BUSY)
+            {
+                LOCK(mtx_stats, "mtx_stats in chooseRequest");
+                chattyStats.nbusy++;
+                UNLOCK(mtx_stats, "mtx_stats in chooseRequest");
+            }
+        }
+        else if(diskpool != NULL && (r->msg.hdr.op == GETFILE_OP || r->msg.hdr.op == POSTFILE_OP))
+        {
+            // il file viene gestito da diskpool, che riprenderà dalle richieste successive
+            if(threadpool_add(diskpool,fileRequest,(void*)r) == 0)
+                return;
+            executeRequest(r); // coda piena: eseguo qui
         }
-        close(fdc);
+        else
+            executeRequest(r);
+        free(r);
     }
-    else
+
+    if(!closed)
+        completeRequest(fdc);
+}
+
+static void fileRequest(void *req)
+{
+    request_t *r = (request_t*) req, *next = r->next;
+    int fdc = r->fd;
+
+    executeRequest(r);
+    free(r);
+
+    if(next == NULL)
+    {
+        completeRequest(fdc);
+        return;
+    }
+
+    // le richieste successive tornano al pool delle richieste, sempre nell'ordine di arrivo
+    if(threadpool_add_to(thpool,fdc,chooseRequest,(void*)next) < 0)
+        chooseRequest((void*)next);
+}
+
+static void completeRequest(int fdc)
+{
+    // il client torna inattivo da questo istante
+    if(idle != NULL)
+        __atomic_store_n(&idle[fdc].last,monotonicTime(),__ATOMIC_RELEASE);
+
+    /* il client è ancora disarmato, quindi nessun altro thread ne legge il buffer: posso
+     * affidare le richieste rimaste o riarmarlo da qui, senza risvegliare l'event loop */
+    if(conf->WorkerRearm)
+    {
+        int ret = dispatchRequest(fdc,0,0,NULL);
+        if(ret == 0)
+            rearm(getReactor(fdc),fdc);
+        else if(ret < 0) // solo l'event loop può parcheggiare il client
+            SYSCALL(cqueue_push(getReactor(fdc)->completed,fdc),-1,"cqueue_push in completeRequest");
+    }
+    else //inserisco il fd nella coda di completamento, così da segnalare all'event loop proprietario l'esecuzione delle richieste
+        SYSCALL(cqueue_push(getReactor(fdc)->completed,fdc),-1,"cqueue_push in completeRequest");
+}
+
+static void runCoroutine(coro_t *c)
+{
+    struct epoll_event ev;
+    int fd;
+
+    while(!coro_resume(c))
     {
-        //esegui richiesta
-        switch (msg.hdr.op)
+        if(c->waitfd < 0) // la coroutine ha solo ceduto il thread
         {
-            case REGISTER_OP:
-                registerUser(fdc, msg.hdr.sender);
-                break;
+            if(threadpool_add(thpool,resumeCoroutine,(void*)c) == 0)
+                return;
+            continue; // coda piena: la riprendo subito
+        }
 
-            case UNREGISTER_OP:
-                unregisterUser(fdc, msg.data.hdr.receiver);
-                break;
+        /* la coroutine è già sospesa: appena registrata può essere ripresa da un altro
+         * thread, quindi dopo epoll_ctl non la tocco più. La scadenza viene registrata
+         * insieme all'attesa, così coro_function trova sempre l'una con l'altra */
+        fd = c->waitfd;
+        memset(&ev,0,sizeof(ev));
+        ev.events = ((c->waitev & POLLIN) ? EPOLLIN : EPOLLOUT) | EPOLLONESHOT;
+        ev.data.ptr = c;
+        LOCK(mtx_coro, "mtx_coro in runCoroutine");
+        if(fd < maxconns)
+        {
+            corowaits[fd].coro = c;
+            twheel_add(corowheel,&corowaits[fd].timer,(unsigned long)(monotonicTime() + CORO_TIMEOUT));
+        }
+        if(epoll_ctl(coroepfd,EPOLL_CTL_MOD,fd,&ev) == 0 || (errno == ENOENT && epoll_ctl(coroepfd,EPOLL_CTL_ADD,fd,&ev) == 0))
+        {
+            UNLOCK(mtx_coro, "mtx_coro in runCoroutine");
+            return;
+        }
+        if(fd < maxconns)
+        {
+            corowaits[fd].coro = NULL;
+            twheel_del(&corowaits[fd].timer);
+        }
+        UNLOCK(mtx_coro, "mtx_coro in runCoroutine");
+        // client non registrabile: la riprendo, e sarà la system call a restituire l'errore
+    }
 
-            case CONNECT_OP:
-                connectUser(fdc, msg.hdr.sender);
-                break;
+    coro_destroy(c);
+    __atomic_sub_fetch(&ncoroutines,1,__ATOMIC_SEQ_CST);
+}
 
-            case DISCONNECT_OP: //non implementato nel client
-                icl_hash_set_offline(users,fdc);
-                break;
+static void resumeCoroutine(void *coro)
+{
+    runCoroutine((coro_t*) coro);
+}
 
-            case POSTTXT_OP:
-                postText(fdc, msg);
-                break;
+static void scheduleCoroutine(coro_t *c)
+{
+    if(threadpool_add_to(thpool,(unsigned int)c->waitfd,resumeCoroutine,(void*)c) < 0)
+        runCoroutine(c);
+}
 
-            case POSTTXTALL_OP:
-                postTextAll(fdc,msg);
-                break;
+static void expireCoroutine(twnode_t *timer, void *list)
+{
+    corowait_t *w = (corowait_t*) timer;
+    int fd = (int)(w - corowaits);
+
+    /* nessun evento riprenderà più la coroutine; il client non riceve da troppo tempo
+     * e il messaggio resterebbe a metà: lo chiudo, e l'event loop ne vedrà la chiusura */
+    epoll_ctl(coroepfd,EPOLL_CTL_DEL,fd,NULL);
+    shutdown(fd,SHUT_RDWR);
+
+    w->expired = w->coro;
+    w->coro = NULL;
+    w->next = *(corowait_t**) list;
+    *(corowait_t**) list = w;
+}
 
-            case GETFILE_OP:
-                getFile(fdc,msg);
-                break;
+void* coro_function(void *epfd)
+{
+    int nready, fd;
+    struct epoll_event events[MAX_EVENTS];
+    corowait_t *expired, *w, *next;
 
-            case POSTFILE_OP:
-                postFile(fdc, msg);
-                break;
+    while(1)
+    {
+        // mi risveglio almeno una volta al secondo per far avanzare la ruota delle scadenze
+        SYSCALL(nready = epoll_wait((int)(long)epfd, events, MAX_EVENTS, 1000),-1, "epoll_wait in coro_function");
 
-            case USRLIST_OP:
-                usrList(fdc,msg.hdr.sender);
-                break;
+        for(int i=0; i < nready; i++)
+        {
+            coro_t *c = (coro_t*) events[i].data.ptr;
 
-            case GETPREVMSGS_OP:
-                getPrevMSGS(fdc,msg);
-                break;
+            // il client è pronto: l'attesa non può più scadere
+            if((fd = c->waitfd) < maxconns)
+            {
+                LOCK(mtx_coro, "mtx_coro in coro_function");
+                corowaits[fd].coro = NULL;
+                twheel_del(&corowaits[fd].timer);
+                UNLOCK(mtx_coro, "mtx_coro in coro_function");
+            }
+            scheduleCoroutine(c);
+        }
 
-            default: //operazione non riconosciuta dal server
+        expired = NULL;
+        LOCK(mtx_coro, "mtx_coro in coro_function");
+        twheel_advance(corowheel,(unsigned long)monotonicTime(),expireCoroutine,&expired);
+        // un processo sta subentrando al server: non attendo oltre i client che non ricevono
+        if(__atomic_load_n(&handoverfd,__ATOMIC_ACQUIRE) >= 0)
+        {
+            for(fd = 0; fd < maxconns; fd++)
             {
-                int mtxnum = fdc % MAX_MTX_REQ;
-                message_hdr_t hdr_reply;
-                setHeader(&hdr_reply, OP_FAIL, "server");
-                LOCK(mtx_req[mtxnum],"mtx_req in chooseRequest");
-                sendHeader(fdc,&hdr_reply);
-                UNLOCK(mtx_req[mtxnum],"mtx_req in chooseRequest");
-                break;
+                if(corowaits[fd].coro == NULL)
+                    continue;
+                twheel_del(&corowaits[fd].timer);
+                expireCoroutine(&corowaits[fd].timer,&expired);
             }
         }
+        UNLOCK(mtx_coro, "mtx_coro in coro_function");
+
+        // le riprendo fuori dalla mutex: tornando a sospendersi la riacquisirebbero
+        for(w = expired; w != NULL; w = next)
+        {
+            next = w->next;
+            coro_cancel(w->expired);
+            scheduleCoroutine(w->expired);
+        }
+    }
+
+    return NULL;
+}
+
+static void executeRequest(request_t *r)
+{
+    int fdc = r->fd;
+    message_t msg;
+
+    // i body compressi vengono decompressi qui, fuori dall'event loop: un blocco non valido fa fallire solo questa richiesta
+    if(connbuf_uncompressRequest(&r->msg,&r->file,r->zlen) == -1)
+    {
+        message_hdr_t hdr_reply;
+        free(r->msg.data.buf);
+        free(r->file.buf);
+        setHeader(&hdr_reply, OP_FAIL, "server");
+        deliverHeader(fdc,&hdr_reply);
+        LOCK(mtx_stats, "mtx_stats in executeRequest");
+        chattyStats.nerrors++;
+        UNLOCK(mtx_stats, "mtx_stats in executeRequest");
+        return;
+    }
+    msg = r->msg;
+
+    //esegui richiesta
+    switch (msg.hdr.op)
+    {
+        case REGISTER_OP: // se il client offre una versione compatta del protocollo, la risposta la accetta
+            wire_offer(fdc, &msg, conf->Compression ? WIRE_V3 : WIRE_V2);
+            registerUser(fdc, msg.hdr.sender);
+            break;
+
+        case UNREGISTER_OP:
+            unregisterUser(fdc, msg.data.hdr.receiver);
+            break;
+
+        case CONNECT_OP:
+            wire_offer(fdc, &msg, conf->Compression ? WIRE_V3 : WIRE_V2);
+            connectUser(fdc, msg.hdr.sender);
+            break;
+
+        case DISCONNECT_OP: //non implementato nel client
+            icl_hash_set_offline(users,fdc);
+            break;
+
+        case POSTTXT_OP:
+            postText(fdc, msg);
+            break;
+
+        case POSTTXTALL_OP:
+            postTextAll(fdc,msg);
+            break;
+
+        case POSTTXTLIST_OP:
+            postTextList(fdc,msg);
+            break;
 
-        //scrivo sulla pipe il fd, così da segnalare al listener l'esecuzione della richiesta
-        LOCK(mtx_pipe,"mtx_pipe in chooseRequest");
-        SYSCALL(write(answers[1],&fdc,sizeof(fdc)),-1,"write fdc in chooseRequest");
-        UNLOCK(mtx_pipe,"mtx_pipe in chooseRequest");
+        case GETFILE_OP:
+            getFile(fdc,msg);
+            break;
+
+        case POSTFILE_OP:
+            postFile(fdc, msg, r->file);
+            break;
+
+        case USRLIST_OP:
+            usrList(fdc,msg.hdr.sender);
+            break;
+
+        case GETPREVMSGS_OP:
+            getPrevMSGS(fdc,msg);
+            break;
+
+        default: //operazione non riconosciuta dal server
+        {
+            message_hdr_t hdr_reply;
+            setHeader(&hdr_reply, OP_FAIL, "server");
+            deliverHeader(fdc,&hdr_reply);
+            break;
+        }
     }
 }
 
@@ -407,13 +1818,11 @@ void chooseRequest(void* fd)
 void registerUser(long fd, char* nickname)
 {
     int partition;
-    int mtxnum = (int)fd % MAX_MTX_REQ;
     message_t reply;
     int res;
 
     SYSCALL(partition = icl_hash_get_partition(users,nickname),-1,"icl_hash_get_partition in registerUser");
     LOCK(mtx_users[partition],"mtxusers registerUser");
-    //SYSCALL(mtxnum = icl_hash_get_mtxnum(users,nickname,MAX_MTX_REQ),-1,"icl_hash_get_mtxnum in registerUser");
 
     if((res = icl_hash_isRegistered(users,nickname)) == 0) // nickname non registrato, lo resgistro
     {
@@ -442,16 +1851,13 @@ void registerUser(long fd, char* nickname)
         //risposta: nickname già utilizzato
         op_t op = (res == 1) ? OP_NICK_ALREADY : OP_FAIL;
         setHeader(&reply.hdr,op,"server");
-        LOCK(mtx_req[mtxnum],"mtxreq registerUser");
-        sendHeader(fd,&reply.hdr);
-        UNLOCK(mtx_req[mtxnum],"mtxreq registerUser");
+        deliverHeader(fd,&reply.hdr);
     }
 }
 
 void unregisterUser(long fd, char* nickname)
 {
     int partition;
-    int mtxnum = (int)fd % MAX_MTX_REQ;
     message_hdr_t reply;
     int res;
 
@@ -470,9 +1876,7 @@ void unregisterUser(long fd, char* nickname)
         UNLOCK(mtx_stats,"mtxstats in unregisterUser");
         //risposta: OP_OK al sender
         setHeader(&reply,OP_OK,"server");
-        LOCK(mtx_req[mtxnum],"mtxreq unregisterUser");
-        sendHeader(fd,&reply);
-        UNLOCK(mtx_req[mtxnum],"mtxreq unregisterUser");
+        deliverHeader(fd,&reply);
     }
     else // utente NON registrato, errore
     {
@@ -487,16 +1891,13 @@ void unregisterUser(long fd, char* nickname)
 
         op_t op = (res == 0) ? OP_NICK_UNKNOWN : OP_FAIL;
         setHeader(&reply,op,"server");
-        LOCK(mtx_req[mtxnum],"mtxreq unregisterUser");
-        sendHeader(fd,&reply);
-        UNLOCK(mtx_req[mtxnum],"mtxreq unregisterUser");
+        deliverHeader(fd,&reply);
     }
 }
 
 void connectUser(long fd, char* nickname)
 {
     int partition;
-    int mtxnum = (int)fd % MAX_MTX_REQ;
     message_t reply;
     int res;
 
@@ -532,9 +1933,7 @@ void connectUser(long fd, char* nickname)
         //rispondo con: utente sconosciuto
         op_t op = (res == 0) ? OP_NICK_UNKNOWN : OP_FAIL;
         setHeader(&reply.hdr,op,"server");
-        LOCK(mtx_req[mtxnum],"mtxreq connectUser");
-        sendHeader(fd,&reply.hdr);
-        UNLOCK(mtx_req[mtxnum],"mtxreq connectUser");
+        deliverHeader(fd,&reply.hdr);
     }
 }
 
@@ -542,7 +1941,6 @@ void getFile(long fd, message_t msg)
 {
     message_t reply;
     char* path, *filename;
-    int mtxnum = (int)fd % MAX_MTX_REQ;
 
     SYSCALL(path = (char*) malloc(sizeof(char)*MAX_FILE_PATH),NULL,"malloc path in getFile");
     strncpy(path,conf->DirName,strlen(conf->DirName)+1);
@@ -559,9 +1957,7 @@ void getFile(long fd, message_t msg)
         //file non esistente , o errore generico nell'apertura del file
         op_t op = (errno == EACCES) ? OP_NO_SUCH_FILE : OP_FAIL;
         setHeader(&reply.hdr,op,"server");
-        LOCK(mtx_req[mtxnum],"mtx_req in getFile");
-        sendHeader(fd,&reply.hdr);
-        UNLOCK(mtx_req[mtxnum],"mtx_req in getFile");
+        deliverHeader(fd,&reply.hdr);
     }
     else
     {
@@ -577,9 +1973,7 @@ void getFile(long fd, message_t msg)
 
         setHeader(&reply.hdr,OP_OK,"server");
         setData(&reply.data,"",buf,(unsigned int)flen);
-        LOCK(mtx_req[mtxnum],"mtx_req in getFile");
-        sendRequest(fd,&reply);
-        UNLOCK(mtx_req[mtxnum],"mtx_req in getFile");
+        deliverRequest(fd,&reply);
 
         LOCK(mtx_stats,"mtxstats in getFile");
         chattyStats.nfilenotdelivered--;
@@ -595,20 +1989,13 @@ void getFile(long fd, message_t msg)
     free(msg.data.buf);
 }
 
-void postFile(long fd, message_t msg)
+void postFile(long fd, message_t msg, message_data_t file)
 {
     int partition;
-    int mtxnums, mtxnumr;
     message_t replyr;
     message_hdr_t replys;
 
     SYSCALL(partition = icl_hash_get_partition(users,msg.data.hdr.receiver),-1,"icl_hash_get_partition in postFile");
-    mtxnums = (int) fd % MAX_MTX_REQ;
-
-    LOCK(mtx_req[mtxnums],"mtx_req in postFile");
-    message_data_t file;
-    readData(fd,&file);
-    UNLOCK(mtx_req[mtxnums],"mtx_req in postFile");
     int len = file.hdr.len;
 
 
@@ -624,9 +2011,7 @@ void postFile(long fd, message_t msg)
 
         //non conoscono mittente e/o destinatario, quindi errore
         setHeader(&replys,OP_NICK_UNKNOWN,"server");
-        LOCK(mtx_req[mtxnums],"mtxreq postFile");
-        sendHeader(fd,&replys);
-        UNLOCK(mtx_req[mtxnums],"mtxreq postFile");
+        deliverHeader(fd,&replys);
     }
     else //destinatario registrato, preparo il file
     {
@@ -641,9 +2026,7 @@ void postFile(long fd, message_t msg)
             op_t op = (len <= 0) ? OP_FAIL : OP_MSG_TOOLONG;
             setHeader(&replys,op,"server");
 
-            LOCK(mtx_req[mtxnums],"mtx_req postFile");
-            sendHeader(fd,&replys);
-            UNLOCK(mtx_req[mtxnums],"mtx_req postFile");
+            deliverHeader(fd,&replys);
         }
         else
         {
@@ -683,12 +2066,8 @@ void postFile(long fd, message_t msg)
             int fdr = (icl_hash_find(users, msg.data.hdr.receiver))->fd;
             if(icl_hash_isOnline(users,msg.data.hdr.receiver)) //receiver online, mando il file "immediatamente"
             {
-                //SYSCALL(mtxnumr = icl_hash_get_mtxnum(users,msg.data.hdr.receiver,MAX_MTX_REQ),-1,"icl_hash_get_mtxnumr in postFile");
-                mtxnumr = fdr % MAX_MTX_REQ;
                 UNLOCK(mtx_users[partition],"mtx_users in postFile");
-                LOCK(mtx_req[mtxnumr],"mtx_req postFile");
-                sendRequest(fdr,&replyr);
-                UNLOCK(mtx_req[mtxnumr],"mtx_req postFile");
+                deliverRequest(fdr,&replyr);
 
                 //aggiorno le statistiche
                 LOCK(mtx_stats,"mtxstats in postFile");
@@ -707,9 +2086,7 @@ void postFile(long fd, message_t msg)
 
             //mando OP_OK al mittente
             setHeader(&replys,OP_OK,msg.hdr.sender);
-            LOCK(mtx_req[mtxnums],"mtx_req postFile");
-            sendHeader(fd,&replys);
-            UNLOCK(mtx_req[mtxnums],"mtx_req postFile");
+            deliverHeader(fd,&replys);
         }
     }
     free(file.buf);
@@ -721,8 +2098,6 @@ void postText(long fd, message_t msg)
     message_t replyr;
     message_hdr_t replys;
     int partition;
-    int mtxnums = (int) fd % MAX_MTX_REQ;
-    int mtxnumr;
     int reg;
 
     SYSCALL(partition = icl_hash_get_partition(users,msg.data.hdr.receiver),-1,"icl_hash_get_partition in postText");
@@ -740,9 +2115,7 @@ void postText(long fd, message_t msg)
         op_t op = (reg == 0) ? OP_NICK_UNKNOWN : OP_MSG_TOOLONG;
         setHeader(&replys,op,"server");
 
-        LOCK(mtx_req[mtxnums],"mtx_req postText");
-        sendHeader(fd,&replys);
-        UNLOCK(mtx_req[mtxnums],"mtx_req postText");
+        deliverHeader(fd,&replys);
     }
     else //destinatario registrato, preparo il messaggio testuale
     {
@@ -762,12 +2135,8 @@ void postText(long fd, message_t msg)
         int fdr = (icl_hash_find(users, msg.data.hdr.receiver))->fd;
         if(icl_hash_isOnline(users,msg.data.hdr.receiver)) //receiver online, mando il messaggio "immediatamente"
         {
-            //SYSCALL(mtxnumr = icl_hash_get_mtxnum(users,msg.data.hdr.receiver,MAX_MTX_REQ),-1,"icl_hash_get_mtxnumr in postText");
-            mtxnumr = fdr % MAX_MTX_REQ;
             UNLOCK(mtx_users[partition],"mtx_users in postText");
-            LOCK(mtx_req[mtxnumr],"mtx_req postText");
-            sendRequest(fdr,&replyr);
-            UNLOCK(mtx_req[mtxnumr],"mtx_req postText");
+            deliverRequest(fdr,&replyr);
 
             //aggiorno le statistiche
             LOCK(mtx_stats,"mtxstats in postText");
@@ -782,20 +2151,131 @@ void postText(long fd, message_t msg)
 
         //mando OP_OK al mittente
         setHeader(&replys,OP_OK,msg.hdr.sender);
-        LOCK(mtx_req[mtxnums],"mtx_req postText");
-        sendHeader(fd,&replys);
-        UNLOCK(mtx_req[mtxnums],"mtx_req postText");
+        deliverHeader(fd,&replys);
     }
     //free(msg.data.buf);
 }
 
+static int compareReceivers(const void *a, const void *b)
+{
+    const receiver_t *ra = (const receiver_t*) a, *rb = (const receiver_t*) b;
+
+    if(ra->partition != rb->partition)
+        return (ra->partition < rb->partition) ? -1 : 1;
+    return strcmp(ra->name,rb->name);
+}
+
+void postTextList(long fd, message_t msg)
+{
+    message_t replyr;
+    message_hdr_t replys;
+    receiver_t *rcv = NULL;
+    char *p = msg.data.buf, *end = msg.data.buf + msg.data.hdr.len, *buf;
+    size_t len;
+    int n = 0, i, j, partition, sent = 0, stored = 0;
+    op_t op = OP_OK;
+
+    // conto i destinatari: la lista termina con un nickname vuoto, seguito dal testo
+    while(p < end && *p != '\0')
+    {
+        if((len = strnlen(p,(size_t)(end - p))) == (size_t)(end - p) || len > MAX_NAME_LENGTH)
+            break;
+        p += len + 1;
+        n++;
+    }
+    if(p >= end || *p != '\0' || n == 0)
+        op = OP_FAIL;
+    else if((len = (size_t)(end - ++p)) > (size_t)conf->MaxMsgSize)
+        op = OP_MSG_TOOLONG;
+
+    if(op != OP_OK)
+    {
+        LOCK(mtx_stats,"mtxstats in postTextList");
+        chattyStats.nerrors++;
+        UNLOCK(mtx_stats,"mtxstats in postTextList");
+
+        setHeader(&replys,op,"server");
+        deliverHeader(fd,&replys);
+        free(msg.data.buf);
+        return;
+    }
+
+    SYSCALL(rcv = (receiver_t*) malloc(sizeof(receiver_t) * n),NULL,"malloc rcv in postTextList");
+    for(i = 0, buf = msg.data.buf; i < n; i++, buf += strlen(buf) + 1)
+    {
+        rcv[i].name = buf;
+        rcv[i].fd = -1;
+        SYSCALL(rcv[i].partition = icl_hash_get_partition(users,buf),-1,"icl_hash_get_partition in postTextList");
+    }
+
+    // una sola acquisizione per partizione; i nickname ripetuti, dopo l'ordinamento adiacenti, ricevono il messaggio una volta
+    qsort(rcv,(size_t)n,sizeof(receiver_t),compareReceivers);
+    setHeader(&replyr.hdr,TXT_MESSAGE,msg.hdr.sender);
+    for(i = 0; i < n; i = j)
+    {
+        partition = rcv[i].partition;
+        LOCK(mtx_users[partition],"mtx_users postTextList");
+        for(j = i; j < n && rcv[j].partition == partition; j++)
+        {
+            icl_entry_t *usr;
+
+            if(j > i && strcmp(rcv[j].name,rcv[j-1].name) == 0)
+                continue;
+            if((usr = icl_hash_find(users,rcv[j].name)) == NULL)
+            {
+                if(op == OP_OK)
+                    op = OP_NICK_UNKNOWN;
+                continue;
+            }
+
+            // la history è proprietaria dei propri messaggi: ne salvo una copia
+            SYSCALL(buf = (char*) malloc(len > 0 ? len : 1),NULL,"malloc buf in postTextList");
+            memcpy(buf,p,len);
+            setData(&replyr.data,"",buf,(unsigned int) len);
+            if(push(usr->queue,replyr) == -1)
+            {
+                free(buf);
+                if(op == OP_OK)
+                    op = OP_FAIL;
+                continue;
+            }
+            stored++;
+            if(usr->online == 1)
+                rcv[j].fd = usr->fd;
+        }
+        UNLOCK(mtx_users[partition],"mtx_users postTextList");
+    }
+
+    // i destinatari online ricevono tutti lo stesso buffer, quello della richiesta
+    setData(&replyr.data,"",p,(unsigned int) len);
+    for(i = 0; i < n; i++)
+    {
+        if(rcv[i].fd >= 0)
+        {
+            deliverRequest(rcv[i].fd,&replyr);
+            sent++;
+        }
+    }
+
+    LOCK(mtx_stats,"mtxstats in postTextList");
+    chattyStats.ndelivered += sent;
+    chattyStats.nnotdelivered += stored - sent;
+    if(op != OP_OK)
+        chattyStats.nerrors++;
+    UNLOCK(mtx_stats,"mtxstats in postTextList");
+
+    setHeader(&replys,op,(op == OP_OK) ? msg.hdr.sender : "server");
+    deliverHeader(fd,&replys);
+
+    free(rcv);
+    free(msg.data.buf);
+}
+
 void postTextAll(long fd, message_t msg)
 {
     message_t replyr;
     message_hdr_t replys;
     int partition;
-    int mtxnums = (int) fd % MAX_MTX_REQ;;
-    int mtxnumr;
 
     //se destinatario non è registrato o messaggio troppo lungo, fallisco
     if(msg.data.hdr.len > conf->MaxMsgSize)
@@ -807,9 +2287,7 @@ void postTextAll(long fd, message_t msg)
 
         setHeader(&replys,OP_MSG_TOOLONG,"server");
 
-        LOCK(mtx_req[mtxnums],"mtx_req postTextAll");
-        sendHeader(fd,&replys);
-        UNLOCK(mtx_req[mtxnums],"mtx_req postTextAll");
+        deliverHeader(fd,&replys);
     }
     else
     {
@@ -853,12 +2331,10 @@ void postTextAll(long fd, message_t msg)
 
                     if(curr->online == 1) //utente online, mando subito il messaggio
                     {
-                        mtxnumr = curr->fd % MAX_MTX_REQ;
+                        int fdr = curr->fd;
                         UNLOCK(mtx_users[partition],"mtxusers in postTextAll");
 
-                        LOCK(mtx_req[mtxnumr],"mtx_req in postTextAll");
-                        sendRequest(curr->fd,&replyr);
-                        UNLOCK(mtx_req[mtxnumr],"mtx_req in postTextAll");
+                        deliverRequest(fdr,&replyr);
 
                         LOCK(mtx_stats,"mtxstats in postTextAll");
                         chattyStats.nnotdelivered--;
@@ -873,9 +2349,7 @@ void postTextAll(long fd, message_t msg)
         }
         op_t op = (err) ? OP_FAIL : OP_OK;
         setHeader(&replys,op,"server");
-        LOCK(mtx_req[mtxnums],"mtx_req postTextAll");
-        sendHeader(fd,&replys);
-        UNLOCK(mtx_req[mtxnums],"mtx_req postTextAll");
+        deliverHeader(fd,&replys);
     }
     free(msg.data.buf);
 }
@@ -884,7 +2358,6 @@ void usrList(long fd, char* sender)
 {
     message_t reply;
     int partition;
-    int mtxnum = (int) fd % MAX_MTX_REQ;
     SYSCALL(partition = icl_hash_get_partition(users,sender),-1,"icl_hash_get_partition in usrList");
 
     //ottengo il numero di persone attualmente online
@@ -901,9 +2374,7 @@ void usrList(long fd, char* sender)
     //rispondo con OP_OK e invio la lista degli utenti
     setHeader(&reply.hdr,OP_OK,"server");
     setData(&reply.data,"",usrlist,(unsigned int) nonline*(MAX_NAME_LENGTH+1));
-    LOCK(mtx_req[mtxnum],"mtxreq usrList");
-    sendRequest(fd,&reply);
-    UNLOCK(mtx_req[mtxnum],"mtxreq usrList");
+    deliverRequest(fd,&reply);
 
     free(usrlist);
 }
@@ -912,7 +2383,6 @@ void getPrevMSGS(long fd, message_t msg)
 {
     message_t reply;
     int partition;
-    int mtxnum = (int) fd % MAX_MTX_REQ;
 
     SYSCALL(partition = icl_hash_get_partition(users,msg.hdr.sender),-1,"icl_hash_get_partition in getPrevMSGS");
 
@@ -926,9 +2396,7 @@ void getPrevMSGS(long fd, message_t msg)
     setData(&reply.data,"",(const char*)&nmsgs, (unsigned int) sizeof(size_t*));
 
 
-    LOCK(mtx_req[mtxnum],"mtx_num in getPrevMSGS");
-    sendRequest(fd,&reply);
-    UNLOCK(mtx_req[mtxnum],"mtx_num in getPrevMSGS");
+    deliverRequest(fd,&reply);
 
     //estraggo i messaggi dalla coda e li mando al client
     LOCK(mtx_users[partition],"mtx_req in getPrevMSGS");
@@ -938,10 +2406,7 @@ void getPrevMSGS(long fd, message_t msg)
     {
         reply = curr->msg;
         UNLOCK(mtx_users[partition],"mtx_req in getPrevMSGS");
-        LOCK(mtx_req[mtxnum],"mtx_num in getPrevMSGS");
-        sendRequest(fd,&reply);
-        //free(reply.data.buf);
-        UNLOCK(mtx_req[mtxnum],"mtx_num in getPrevMSGS");
+        deliverRequest(fd,&reply);
 
         LOCK(mtx_stats,"mtx_stats in getPrevMSGS");
         if(reply.hdr.op == FILE_MESSAGE)
@@ -54,19 +54,214 @@
 #include <sys/un.h>
 #include <sys/types.h>
 #include <fcntl.h>
-#include <sys/select.h>
+#include <poll.h>
+#include <time.h>
+#include <sys/epoll.h>
+#include <stdint.h>
+#include <sched.h>
+#include <sys/resource.h>
 #include <threadpool.h>
 #include <connections.h>
+#include <cqueue.h>
+#include <twheel.h>
+#include <uring.h>
+#include <handover.h>
+#include <affinity.h>
+#include <coro.h>
+
+/**
+ * @typedef dispatch_t
+ * @brief Ridefinizione della struttura dispatch_s
+ *
+ * @struct dispatch_s
+ * @brief Gruppi di richieste estratti da un event loop in un giro, affidati al pool
+ * con un solo threadpool_add_batch per corsia
+ *
+ * @param[in] reqs richieste di ogni client (liste di request_t), per corsia
+ * @param[in] keys descrittore di ogni client, che sceglie il thread del pool
+ * @param[in] n    numero di gruppi in attesa, per corsia
+ */
+typedef struct dispatch_s
+{
+    void *reqs[THREADPOOL_LANES][MAX_EVENTS];
+    unsigned int keys[THREADPOOL_LANES][MAX_EVENTS];
+    int n[THREADPOOL_LANES];
+} dispatch_t;
+
+/**
+ * @typedef reactor_t
+ * @brief Ridefinizione della struttura reactor_s
+ *
+ * @struct reactor_s
+ * @brief Event loop che gestisce una partizione delle connessioni dei client
+ *
+ * @param[in] tid       id del thread che esegue l'event loop
+ * @param[in] epfd      descrittore epoll delle connessioni assegnate
+ * @param[in] completed coda su cui i thread del pool segnalano la fine di una richiesta
+ * @param[in] idle      ruota dei timer di inattività dei client (NULL se IdleTimeout è 0)
+ * @param[in] started   flag che indica se il thread è in esecuzione
+ * @param[in] parked    client con richieste complete, lasciati disarmati finché il pool è sovraccarico
+ * @param[in] nparked   numero di client in \a parked
+ * @param[in] maxparked dimensione di \a parked
+ * @param[in] batch     richieste estratte nel giro corrente, non ancora affidate al pool
+ */
+typedef struct reactor_s
+{
+    pthread_t tid;
+    int epfd;
+    cqueue_t *completed;
+    twheel_t *idle;
+    int started;
+    int *parked;
+    int nparked;
+    int maxparked;
+    dispatch_t batch;
+} reactor_t;
+
+#define IDLE_BUSY (-1L) /**< valore di idle_t.last mentre una richiesta del client è in esecuzione. */
+
+/**
+ * @typedef idle_t
+ * @brief Ridefinizione della struttura idle_s
+ *
+ * @struct idle_s
+ * @brief Stato di inattività di un client
+ *
+ * Il timer viene gestito solo dall'event loop proprietario; i thread del pool
+ * aggiornano soltanto \a last, che viene confrontato alla scadenza del timer.
+ *
+ * @param[in] timer timer nella ruota dell'event loop (primo campo, per risalire alla struttura)
+ * @param[in] last  istante (in secondi) dell'ultima attività, o IDLE_BUSY
+ */
+typedef struct idle_s
+{
+    twnode_t timer;
+    long last;
+} idle_t;
+
+/**
+ * @typedef corowait_t
+ * @brief Ridefinizione della struttura corowait_s
+ *
+ * @struct corowait_s
+ * @brief Attesa di una coroutine sospesa su un client, con la sua scadenza
+ *
+ * Ogni client è atteso al più da una coroutine: è lei l'unica a scriverci (vedi outbox_t).
+ * \a timer e \a coro sono protetti da mtx_coro; \a expired e \a next li usa solo coro_function.
+ *
+ * @param[in] timer   scadenza nella ruota di coro_function (primo campo, per risalire alla struttura)
+ * @param[in] coro    coroutine sospesa sul client (NULL se nessuna)
+ * @param[in] expired coroutine la cui attesa è scaduta, da riprendere
+ * @param[in] next    attesa scaduta successiva
+ */
+typedef struct corowait_s
+{
+    twnode_t timer;
+    coro_t *coro;
+    coro_t *expired;
+    struct corowait_s *next;
+} corowait_t;
+
+/**
+ * @typedef outmsg_t
+ * @brief Ridefinizione della struttura outmsg_s
+ *
+ * @struct outmsg_s
+ * @brief Messaggio in attesa di essere scritto su un client
+ *
+ * @param[in] msg     messaggio da inviare (con una copia dei dati)
+ * @param[in] hdronly flag che indica che va inviato solo l'header
+ * @param[in] next    messaggio inserito prima di questo
+ */
+typedef struct outmsg_s
+{
+    message_t msg;
+    int hdronly;
+    struct outmsg_s *next;
+} outmsg_t;
+
+/**
+ * @typedef outbox_t
+ * @brief Ridefinizione della struttura outbox_s
+ *
+ * @struct outbox_s
+ * @brief Coda dei messaggi in uscita di un client (modalità ConnectionAffinity)
+ *
+ * Un solo thread alla volta, il proprietario, scrive sul client: è quello che ha
+ * ottenuto \a owner, di solito il thread che ne sta eseguendo le richieste.
+ * Gli altri thread inseriscono i messaggi in \a inbox senza lock e proseguono;
+ * il proprietario li invia prima di rilasciare il client.
+ *
+ * @param[in] inbox messaggi in attesa, dal più recente (pila senza lock)
+ * @param[in] owner flag che indica che un thread sta scrivendo sul client
+ */
+typedef struct outbox_s
+{
+    outmsg_t *inbox;
+    int owner;
+} outbox_t;
+
+/**
+ * @typedef request_t
+ * @brief Ridefinizione della struttura request_s
+ *
+ * @struct request_s
+ * @brief Richiesta completa di un client, affidata dagli event loop ai thread del pool
+ *
+ * @param[in] fd   descrittore del client
+ * @param[in] eof  flag che indica che il client ha chiuso la connessione
+ * @param[in] reply risposta da inviare al client: prima di chiuderlo se eof, altrimenti al posto
+ *                  dell'esecuzione (OP_SERVER_BUSY, OP_FAIL per troppi utenti connessi; 0 = nessuna)
+ * @param[in] msg  messaggio ricevuto
+ * @param[in] file contenuto del file (solo per POSTFILE_OP)
+ * @param[in] zlen dimensioni dei blocchi compressi di msg.data e file, ancora da decomprimere (0 = non compressi)
+ * @param[in] next richiesta successiva dello stesso client, da eseguire nell'ordine di arrivo
+ */
+typedef struct request_s
+{
+    int fd;
+    int eof;
+    op_t reply;
+    message_t msg;
+    message_data_t file;
+    unsigned int zlen[2];
+    struct request_s *next;
+} request_t;
+
+/**
+ * @typedef receiver_t
+ * @brief Ridefinizione della struttura receiver_s
+ *
+ * @struct receiver_s
+ * @brief Destinatario di un POSTTXTLIST_OP
+ *
+ * @param[in] name      nickname del destinatario (nel buffer della richiesta)
+ * @param[in] partition partizione della tabella degli utenti che contiene il nickname
+ * @param[in] fd        descrittore a cui consegnare il messaggio (-1 se offline o non registrato)
+ */
+typedef struct receiver_s
+{
+    char *name;
+    int partition;
+    int fd;
+} receiver_t;
 
 /* ----- FUNZIONI ESEGUITE DAI THREAD ------ */
 
 /**
  * @function listener_function
- * @brief Funzione eseguita dal thread listener
+ * @brief Funzione eseguita dal thread listener: accetta le connessioni e le distribuisce agli event loop
  * @param[in] connfd descrittore del socket di connessione
  */
 void* listener_function(void *connfd);
 
+/**
+ * @function reactor_function
+ * @brief Funzione eseguita da ogni event loop: attende richieste dai propri client e le affida al pool
+ * @param[in] reactor puntatore all'event loop da eseguire
+ */
+void* reactor_function(void *reactor);
+
 /**
  * @function sig_manager_function
  * @brief Funzione eseguita dal thread gestore dei segnali
@@ -74,12 +269,26 @@ void* listener_function(void *connfd);
  */
 void* sig_manager_function(void* sigset);
 
+/**
+ * @function handover_function
+ * @brief Funzione eseguita dal thread che attende un processo sostitutivo: quando si connette, ferma il listener
+ * @param[in] hsfd descrittore del socket su cui attendere il nuovo processo
+ */
+void* handover_function(void *hsfd);
+
+/**
+ * @function coro_function
+ * @brief Funzione eseguita dal thread che riprende le coroutine sospese, quando i loro client sono pronti
+ * @param[in] epfd descrittore epoll su cui le coroutine attendono i client
+ */
+void* coro_function(void *epfd);
+
 /**
  * @function chooseRequest
  * @brief Funzione eseguita dai thread del pool
- * @param[in] fd descrittore del client
+ * @param[in] req lista di richieste complete di un client (request_t), eseguite in ordine e liberate al termine
  */
-void chooseRequest(void* fd);
+void chooseRequest(void* req);
 
 
 /* ----- OPERAZIONI EFFETTUATE DAL SERVER ----- */
@@ -121,8 +330,9 @@ void getFile(long fd, message_t msg);
  * @brief Invia un file ad un nickname
  * @param[in] fd descrittore del client
  * @param[in] msg messaggio ricevuto dal client
+ * @param[in] file contenuto del file ricevuto dal client
  */
-void postFile(long fd, message_t msg);
+void postFile(long fd, message_t msg, message_data_t file);
 
 /**
  * @function postText
@@ -132,6 +342,17 @@ void postFile(long fd, message_t msg);
  */
 void postText(long fd, message_t msg);
 
+/**
+ * @function postTextList
+ * @brief Invia un messaggio testuale a una lista di nickname, con un'unica risposta al mittente
+ *
+ * La risposta è OP_OK se il messaggio è stato consegnato o salvato per tutti i destinatari,
+ * altrimenti l'errore del primo destinatario fallito (gli altri ricevono comunque il messaggio).
+ * @param[in] fd descrittore del client
+ * @param[in] msg messaggio ricevuto dal client (vedi POSTTXTLIST_OP)
+ */
+void postTextList(long fd, message_t msg);
+
 /**
  * @function postTextAll
  * @brief Invia un messaggio testuale a tutti gli utenti
@@ -64,6 +64,7 @@ static void use(const char * filename) {
 	    "  -p richiede di recuperare la history dei messaggi\n"
 	    "  -t specifica i millisecondi 'milli' che intercorrono tra la gestione di due comandi consecutivi\n"
 	    "  -S spedisce il messaggio 'msg' al destinatario 'to' che puo' essere un nickname o groupname\n"
+	    "     o una lista di nickname separati da virgole (to1,to2,...)\n"
 	    "  -s come l'opzione -S ma permette di spedire files\n"
 	    "  -R riceve un messaggio da un nickname o groupname, se viene ricevuto un identificatore di file\n"
 	    "     il file viene scaricato dal server. In base al valore di n il comportamento e' diverso, se:\n"
@@ -122,6 +123,10 @@ static int downloadFile(int connfd, char *filename, char *sender) {
 	     */
 	    if (readMessage(connfd, &msg.hdr)<=0) return -1;
 	} break;
+	case OP_SERVER_BUSY: {
+	    fprintf(stderr, "Download di %s NON ESEGUITO: server sovraccarico\n", filename);
+	    return -1;
+	} break;
 	default: {
 	    fprintf(stderr, "ERRORE: ricevuto messaggio non valido\n");
 	    return -1;
@@ -138,11 +143,18 @@ static int execute_requestreply(int connfd, operation_t *o) {
     op_t op     = o->op;
     message_t msg;
     char  *mappedfile = NULL;
+
+    // alla prima connessione offro la versione piu' alta del protocollo (vedi connections.h)
+    char hello[MAX_NAME_LENGTH+1];
+    if ((op == CONNECT_OP || op == REGISTER_OP) && wire_version(connfd) == WIRE_V1) {
+	snprintf(hello, sizeof(hello), WIRE_HELLO "%d", WIRE_MAX);
+	rname = hello;
+    }
     
     //setData(&msg.data, "", NULL, 0);
     setData(&msg.data, rname, NULL, 0);
     setHeader(&msg.hdr, op, sname);
-    if (op == POSTTXT_OP || op == POSTTXTALL_OP || op == POSTFILE_OP) {
+    if (op == POSTTXT_OP || op == POSTTXTALL_OP || op == POSTTXTLIST_OP || op == POSTFILE_OP) {
 	if (o->size == 0) {
 	    fprintf(stderr, "ERRORE: size non valida per l'operazione di POST\n");
 	    return -1;
@@ -170,21 +182,23 @@ static int execute_requestreply(int connfd, operation_t *o) {
     } 
     
     // spedizione effettiva
-    if (sendRequest(connfd, &msg) == -1) {
-	perror("request");
-	return -1;
-    }
-    if (mappedfile) { // devo inviare il file
+    if (mappedfile) { // devo inviare il file, insieme alla richiesta
 	message_data_t data;
 	setData(&data, "", mappedfile, o->size);
-	if (sendData(connfd, &data) == -1) { // invio il contenuto del file
+	if (sendFileRequest(connfd, &msg, &data) == -1) {
 	    perror("sending data");
 	    fprintf(stderr, "ERRORE: spedendo il file %s\n", o->msg);
 	    munmap(mappedfile, o->size);
 	    return -1;
 	}
 	munmap(mappedfile, o->size);
-    } else if (msg.data.buf) free(msg.data.buf);
+    } else {
+	if (sendRequest(connfd, &msg) == -1) {
+	    perror("request");
+	    return -1;
+	}
+	if (msg.data.buf) free(msg.data.buf);
+    }
 
     // devo ricevere l'ack
     int ackok = 0;
@@ -213,6 +227,10 @@ static int execute_requestreply(int connfd, operation_t *o) {
 	    else  	      fprintf(stderr, "Operazione %d FALLITA\n", op);
 	    return -msg.hdr.op; // codice di errore ritornato
 	} break;
+	case OP_SERVER_BUSY: {
+	    fprintf(stderr, "Operazione %d NON ESEGUITA: server sovraccarico, riprovare\n", op);
+	    return -msg.hdr.op;
+	} break;
 	default: {
 	    fprintf(stderr, "ERRORE: risposta non valida\n");
 	    return -1;
@@ -229,6 +247,9 @@ static int execute_requestreply(int connfd, operation_t *o) {
 	    perror("reply data");
 	    return -1; 
 	}	
+	// il server ha accettato una versione: la usano i messaggi successivi a questo
+	if (op != USRLIST_OP && wire_hello(msg.hdr.sender) != 0)
+	    wire_setVersion(connfd, wire_hello(msg.hdr.sender));
 	int nusers = msg.data.hdr.len / (MAX_NAME_LENGTH+1);
 	assert(nusers > 0);
 	printf("Lista utenti online:\n");
@@ -271,6 +292,7 @@ static int execute_requestreply(int connfd, operation_t *o) {
     } break;
     case POSTTXT_OP:
     case POSTTXTALL_OP:
+    case POSTTXTLIST_OP:
     case POSTFILE_OP:
     case DISCONNECT_OP:
     case UNREGISTER_OP: 
@@ -459,10 +481,32 @@ int main(int argc, char *argv[]) {
 	    }
 
 	    ops[k].sname = nick;    
-	    ops[k].rname = strlen(p)?p:NULL;
-	    ops[k].op    = strlen(p)?POSTTXT_OP:POSTTXTALL_OP;
-	    ops[k].msg   = arg;
-	    ops[k].size  = strlen(arg)+1;
+	    if (strchr(p, ',')) { 
+		// piu' destinatari: i nickname separati da '\0', un nickname vuoto e poi il messaggio
+		size_t nlen = strlen(p)+1, mlen = strlen(arg)+1;
+		if (p[0] == ',' || p[nlen-2] == ',' || strstr(p, ",,")) {
+		    fprintf(stderr, "ERRORE: lista di destinatari non valida\n");
+		    return -1;
+		}
+		char *buf = malloc(nlen+1+mlen);
+		if (!buf) {
+		    perror("malloc");
+		    return -1;
+		}
+		for(size_t i=0;i<nlen;++i) buf[i] = (p[i]==',')?'\0':p[i];
+		buf[nlen] = '\0';
+		memcpy(buf+nlen+1, arg, mlen);
+		free(arg);
+		ops[k].rname = NULL;
+		ops[k].op    = POSTTXTLIST_OP;
+		ops[k].msg   = buf;
+		ops[k].size  = nlen+1+mlen;
+	    } else {
+		ops[k].rname = strlen(p)?p:NULL;
+		ops[k].op    = strlen(p)?POSTTXT_OP:POSTTXTALL_OP;
+		ops[k].msg   = arg;
+		ops[k].size  = strlen(arg)+1;
+	    }
 
 	    ++k;
 	} break;
@@ -31,6 +31,24 @@
 
 #define MAX_MTX_USR 128 /**< numero massimo di lock usate per l'accesso alla hash table degli utenti. */
 
+#define MAX_EVENTS 64 /**< numero massimo di eventi restituiti da una singola epoll_wait. */
+
+#define MAX_REACTORS 32 /**< numero massimo di event loop che gestiscono le connessioni. */
+
+#define MAX_FDS 1048576 /**< numero massimo di descrittori di cui il server tiene lo stato. */
+
+#define MAX_PIPELINE 32 /**< numero massimo di richieste di un client affidate al pool in blocco, prima di passare agli altri client. */
+
+#define CORO_STACK (256*1024) /**< dimensione dello stack di ogni coroutine che esegue le richieste di un client. */
+
+#define CORO_TIMEOUT 30 /**< secondi dopo cui una coroutine sospesa su un client che non diventa pronto viene ripresa, chiudendo il client. */
+
+#define MAX_BODY_EXTRA (64*1024) /**< byte oltre MaxMsgSize ammessi nel body di una richiesta (nomi di file, destinatari di POSTTXTLIST_OP). */
+
+#define BACKPRESSURE_POLL 10 /**< intervallo (millisecondi) con cui un event loop ricontrolla il pool mentre ha client in attesa per sovraccarico. */
+
+#define ACCEPT_BACKOFF 100 /**< pausa (millisecondi) del listener quando accept fallisce per mancanza di descrittori o di memoria. */
+
 
 
 // to avoid warnings like "ISO C forbids an empty translation unit"
@@ -24,6 +24,67 @@
 #include <string.h>
 #include <message.h>
 #include <connections.h>
+#include <lz.h>
+
+/**< buffer di lettura di readHeader e readData, indicizzati per descrittore (lato client, un solo thread) */
+static connbuf_t **readers = NULL;
+/**< dimensione della tabella dei buffer di lettura */
+static long nreaders = 0;
+
+#define REQ_TOOLONG ((size_t)-1) /**< dimensione di una richiesta che dichiara un body oltre i limiti (vedi connbuf_setLimits). */
+#define REQ_INVALID ((size_t)-2) /**< dimensione di un header, di un body o di una richiesta che viola il protocollo. */
+
+/**< lunghezza massima del body di una richiesta (il primo, o l'unico), e del contenuto di un file */
+static size_t maxdata = (size_t)-1, maxfile = (size_t)-1;
+
+#define WIRE_OFFERED 0x80 /**< flag di una connessione che ha offerto una versione, in attesa della risposta. */
+
+/**< versione del protocollo di ogni connessione, indicizzata per descrittore (0 = v1),
+ * eventualmente con WIRE_OFFERED e la versione che la risposta accetterà */
+static unsigned char wire[MAX_FDS];
+
+int wire_version(long fd)
+{
+    unsigned char state;
+
+    if(fd < 0 || fd >= MAX_FDS)
+        return WIRE_V1;
+    state = __atomic_load_n(&wire[fd],__ATOMIC_ACQUIRE);
+    return (state >= WIRE_V2 && state <= WIRE_MAX) ? state : WIRE_V1;
+}
+
+void wire_setVersion(long fd, int version)
+{
+    if(fd >= 0 && fd < MAX_FDS)
+        __atomic_store_n(&wire[fd],(version >= WIRE_V2 && version <= WIRE_MAX) ? version : 0,__ATOMIC_RELEASE);
+}
+
+int wire_hello(const char *name)
+{
+    size_t n = strlen(WIRE_HELLO);
+
+    if(name == NULL || strncmp(name,WIRE_HELLO,n) != 0 || name[n] < '2' || name[n] > '9' || name[n+1] != '\0')
+        return 0;
+    return name[n] - '0';
+}
+
+int wire_offer(long fd, message_t *msg, int max)
+{
+    int version;
+
+    if(fd < 0 || fd >= MAX_FDS || msg == NULL)
+        return 0;
+    if((version = wire_hello(msg->data.hdr.receiver)) == 0 || wire_version(fd) != WIRE_V1)
+        return 0;
+
+    // accetto la versione offerta, o la più alta fra quelle che conosco
+    if(version > max)
+        version = max;
+    if(version > WIRE_MAX)
+        version = WIRE_MAX;
+    __atomic_store_n(&wire[fd],(unsigned char)(WIRE_OFFERED | version),__ATOMIC_RELEASE);
+    return 1;
+}
 
 int openConnection(char* path, unsigned int ntimes, unsigned int secs)
 {
@@ -50,6 +111,10 @@ int openConnection(char* path, unsigned int ntimes, unsigned int secs)
         }
         else
         {
+            // il descrittore potrebbe essere già stato usato: scarto i byte rimasti nel suo buffer
+            if(sfd < nreaders && readers[sfd] != NULL)
+                readers[sfd]->start = readers[sfd]->end = 0;
+            wire_setVersion(sfd,WIRE_V1);
             printf("connected on %d\n",sfd);
             return sfd;
         }
@@ -58,36 +123,55 @@ int openConnection(char* path, unsigned int ntimes, unsigned int secs)
     return -1;
 }
 
+/**
+ * @function getReader
+ * @brief Restituisce il buffer di lettura della connessione, creandolo al primo utilizzo
+ *
+ * @param[in] fd descrittore della connessione
+ *
+ * @return puntatore al buffer, NULL in caso di errore (errno settato).
+ */
+static connbuf_t *getReader(long fd)
+{
+    if(fd >= nreaders)
+    {
+        connbuf_t **tmp;
+        long n = (fd < 16) ? 16 : 2*fd;
+
+        if((tmp = (connbuf_t**) realloc(readers,sizeof(connbuf_t*)*n)) == NULL)
+            return NULL;
+        memset(tmp + nreaders,0,sizeof(connbuf_t*)*(n - nreaders));
+        readers = tmp;
+        nreaders = n;
+    }
+    if(readers[fd] == NULL)
+        readers[fd] = connbuf_create();
+
+    return readers[fd];
+}
+
 int readHeader(long connfd, message_hdr_t *hdr)
 {
+    connbuf_t *cb;
+
     if(connfd < 0 || hdr == NULL)
         return 0;
+    if((cb = getReader(connfd)) == NULL)
+        return -1;
 
-    ssize_t n_read;
-    n_read = readn((int)connfd,&hdr->op,sizeof(op_t),"op read in readHeader");
-    EQZERO(n_read);
-    n_read = readn((int)connfd,hdr->sender,MAX_NAME_LENGTH+1,"sender read in readHeader");
-    EQZERO(n_read);
-
-    return 1;
+    return connbuf_readHeader(cb,connfd,hdr);
 }
 
 int readData(long fd, message_data_t *data)
 {
+    connbuf_t *cb;
+
     if(fd < 0 || data == NULL)
         return 0;
+    if((cb = getReader(fd)) == NULL)
+        return -1;
 
-    ssize_t n_read;
-
-    n_read = readn((int)fd,data->hdr.receiver,MAX_NAME_LENGTH+1,"receiver read in readData");
-    EQZERO(n_read);
-    n_read = readn((int)fd,&data->hdr.len, sizeof(unsigned int),"length read in readData");
-    if(data->hdr.len == 0) return 1; // il buffer potrebbe essere vuoto, ma va bene comunque
-    SYSCALL(data->buf = (char*) malloc(sizeof(char)*data->hdr.len),NULL,"malloc buffer in readData");
-    n_read = readn((int)fd,data->buf,data->hdr.len,"buf read in readData");
-    EQZERO(n_read);
-
-    return 1;
+    return connbuf_readData(cb,fd,data);
 }
 
 int readMsg(long fd, message_t *msg)
@@ -102,47 +186,883 @@ int readMsg(long fd, message_t *msg)
     return res_hdr && res_data;
 }
 
+/**
+ * @function putVarint
+ * @brief Codifica \a v come varint: 7 bit per byte, dal meno significativo, con il bit alto
+ * a indicare che segue un altro byte
+ * @return numero di byte scritti in \a p (al più VARINT_MAX).
+ */
+static inline size_t putVarint(char *p, unsigned int v)
+{
+    size_t n = 0;
+
+    while(v >= 0x80)
+    {
+        p[n++] = (char)(v | 0x80);
+        v >>= 7;
+    }
+    p[n++] = (char)v;
+    return n;
+}
+
+/**
+ * @function putName
+ * @brief Codifica un nickname in v2: lunghezza (varint) seguita dai caratteri, senza terminatore
+ * @return numero di byte scritti in \a p.
+ */
+static inline size_t putName(char *p, const char *name)
+{
+    size_t len = strnlen(name,MAX_NAME_LENGTH);
+    size_t n = putVarint(p,(unsigned int)len);
+
+    memcpy(p + n,name,len);
+    return n + len;
+}
+
+/**
+ * @function headerIov
+ * @brief Prepara in \a iov i campi di un header: in v1 puntano all'header stesso,
+ * in v2 a \a frame, in cui l'header viene codificato
+ * @return numero di buffer usati.
+ */
+static inline int headerIov(struct iovec *iov, char *frame, message_hdr_t *hdr, int version)
+{
+    if(version >= WIRE_V2)
+    {
+        size_t n = putVarint(frame,(unsigned int)hdr->op);
+        iov[0].iov_base = frame;    iov[0].iov_len = n + putName(frame + n,hdr->sender);
+        return 1;
+    }
+
+    iov[0].iov_base = &hdr->op;     iov[0].iov_len = sizeof(op_t);
+    iov[1].iov_base = hdr->sender;  iov[1].iov_len = MAX_NAME_LENGTH+1;
+    return 2;
+}
+
+/**
+ * @function compressData
+ * @brief Comprime il buffer dati di un body da inviare in v3
+ *
+ * @param[in]  data body da inviare
+ * @param[out] zlen dimensione del blocco compresso (0 se il body va inviato così com'è)
+ *
+ * @return blocco compresso, da liberare dopo l'invio (NULL se il body non viene compresso).
+ */
+static char *compressData(message_data_t *data, size_t *zlen)
+{
+    char *z;
+
+    *zlen = 0;
+    if(data->hdr.len < WIRE_ZMIN || data->buf == NULL)
+        return NULL;
+
+    // senza memoria, o se la compressione non rende, il body parte non compresso
+    if((z = (char*) malloc(lz_bound(data->hdr.len))) == NULL)
+        return NULL;
+    if((*zlen = lz_compress(data->buf,data->hdr.len,z,lz_bound(data->hdr.len))) == 0 || *zlen >= data->hdr.len)
+    {
+        free(z);
+        *zlen = 0;
+        return NULL;
+    }
+    return z;
+}
+
+/**
+ * @function dataIov
+ * @brief Prepara in \a iov i campi di un body, senza copiare il buffer dati (vedi headerIov)
+ *
+ * In v3 il buffer dati può essere sostituito da un blocco compresso, restituito in \a z:
+ * va liberato dopo l'invio.
+ * @return numero di buffer usati.
+ */
+static inline int dataIov(struct iovec *iov, char *frame, message_data_t *data, int version, char **z)
+{
+    size_t zlen = 0;
+    int n;
+
+    *z = NULL;
+    if(version >= WIRE_V2)
+    {
+        size_t len = putName(frame,data->hdr.receiver);
+        len += putVarint(frame + len,data->hdr.len);
+        if(version >= WIRE_V3)
+        {
+            *z = compressData(data,&zlen);
+            len += putVarint(frame + len,(unsigned int)zlen);
+        }
+        iov[0].iov_base = frame;               iov[0].iov_len = len;
+        n = 1;
+    }
+    else
+    {
+        iov[0].iov_base = data->hdr.receiver;  iov[0].iov_len = MAX_NAME_LENGTH+1;
+        iov[1].iov_base = &data->hdr.len;      iov[1].iov_len = sizeof(unsigned int);
+        n = 2;
+    }
+    if(data->hdr.len == 0 || data->buf == NULL)
+        return n;
+    if(*z != NULL)
+    {
+        iov[n].iov_base = *z;                  iov[n].iov_len = zlen;
+    }
+    else
+    {
+        iov[n].iov_base = data->buf;           iov[n].iov_len = data->hdr.len;
+    }
+    return n + 1;
+}
+
+/**
+ * @function sendVersion
+ * @brief Sceglie la versione con cui inviare un messaggio, chiudendo una negoziazione in corso
+ *
+ * Dopo wire_offer, la prima risposta che non sia una notifica è quella al CONNECT_OP:
+ * un OP_OK accetta la v2 e parte ancora in v1, con sender WIRE_HELLO; qualsiasi altra
+ * risposta la rifiuta. Su un client scrive un solo thread alla volta, quindi il cambio
+ * di versione cade esattamente fra due messaggi.
+ *
+ * @param[in]     fd  descrittore della connessione
+ * @param[in,out] hdr copia dell'header da inviare (il sender può essere sostituito)
+ *
+ * @return versione con cui codificare il messaggio.
+ */
+static int sendVersion(long fd, message_hdr_t *hdr)
+{
+    unsigned char state;
+
+    if(fd < 0 || fd >= MAX_FDS)
+        return WIRE_V1;
+    if(!((state = __atomic_load_n(&wire[fd],__ATOMIC_ACQUIRE)) & WIRE_OFFERED))
+        return wire_version(fd);
+    if(hdr->op == TXT_MESSAGE || hdr->op == FILE_MESSAGE)
+        return WIRE_V1;
+
+    state &= (unsigned char) ~WIRE_OFFERED;
+    if(hdr->op == OP_OK)
+        snprintf(hdr->sender,MAX_NAME_LENGTH+1,WIRE_HELLO "%d",state);
+
+    // il client invia la richiesta successiva solo dopo questa risposta: l'event loop deve già leggerla nella nuova versione
+    __atomic_store_n(&wire[fd],(hdr->op == OP_OK) ? state : 0,__ATOMIC_RELEASE);
+    return WIRE_V1;
+}
+
+/**
+ * @function sendFrame
+ * @brief Invia tutti i campi di un messaggio con una sola scrittura vettoriale
+ *
+ * @param[in] fd     descrittore della connessione
+ * @param[in] iov    campi da inviare (modificati durante l'invio)
+ * @param[in] iovcnt numero di campi
+ *
+ * @return 1 in caso di successo, 0 se la connessione è chiusa.
+ */
+static int sendFrame(long fd, struct iovec *iov, int iovcnt)
+{
+    return writevn(fd,iov,iovcnt,"writevn in sendFrame") > 0;
+}
+
 int sendHeader(long fd, message_hdr_t *msg)
 {
+    struct iovec iov[2];
+    char frame[WIRE_UNIT_MAX];
+    message_hdr_t hdr;
+
     if(fd < 0 || msg == NULL)
         return 0;
 
-    ssize_t n_write;
+    hdr = *msg;
+    return sendFrame(fd,iov,headerIov(iov,frame,&hdr,sendVersion(fd,&hdr)));
+}
+
+int sendData(long fd, message_data_t *msg)
+{
+    struct iovec iov[3];
+    char frame[WIRE_UNIT_MAX];
+    char *z;
+    int r;
 
-    n_write = writen((int)fd,&msg->op, sizeof(unsigned int),"op write in sendHeader");
-    EQZERO(n_write);
-    n_write = writen((int)fd,msg->sender, MAX_NAME_LENGTH+1,"sender write in sendHeader");
-    EQZERO(n_write);
+    if(fd < 0 || msg == NULL)
+        return 0;
 
-    return 1;
+    r = sendFrame(fd,iov,dataIov(iov,frame,msg,wire_version(fd),&z));
+    free(z);
+    return r;
 }
 
-int sendData(long fd, message_data_t *msg)
+int sendRequest(long fd, message_t *msg)
 {
+    struct iovec iov[5];
+    char frame[2][WIRE_UNIT_MAX];
+    message_hdr_t hdr;
+    char *z;
+    int n, r, version;
+
     if(fd < 0 || msg == NULL)
         return 0;
 
-    ssize_t n_write;
+    // header e body escono insieme, senza essere spezzati in più scritture
+    hdr = msg->hdr;
+    version = sendVersion(fd,&hdr);
+    n = headerIov(iov,frame[0],&hdr,version);
+    n += dataIov(iov + n,frame[1],&msg->data,version,&z);
+    r = sendFrame(fd,iov,n);
+    free(z);
+    return r;
+}
+
+int sendFileRequest(long fd, message_t *msg, message_data_t *file)
+{
+    struct iovec iov[8];
+    char frame[3][WIRE_UNIT_MAX];
+    message_hdr_t hdr;
+    char *z[2];
+    int n, r, version;
+
+    if(fd < 0 || msg == NULL || file == NULL)
+        return 0;
+
+    hdr = msg->hdr;
+    version = sendVersion(fd,&hdr);
+    n = headerIov(iov,frame[0],&hdr,version);
+    n += dataIov(iov + n,frame[1],&msg->data,version,&z[0]);
+    n += dataIov(iov + n,frame[2],file,version,&z[1]);
+    r = sendFrame(fd,iov,n);
+    free(z[0]);
+    free(z[1]);
+    return r;
+}
+
+void connbuf_setLimits(size_t data, size_t file)
+{
+    maxdata = data;
+    maxfile = file;
+}
+
+connbuf_t *connbuf_create(void)
+{
+    connbuf_t *cb;
+
+    if((cb = (connbuf_t*) malloc(sizeof(connbuf_t))) == NULL)
+        return NULL;
+
+    if((cb->buf = (char*) malloc(sizeof(char)*CONNBUF_CHUNK)) == NULL)
+    {
+        free(cb);
+        return NULL;
+    }
+    cb->size = CONNBUF_CHUNK;
+    cb->start = cb->end = 0;
+
+    return cb;
+}
+
+void connbuf_destroy(connbuf_t *cb)
+{
+    if(cb == NULL)
+        return;
+
+    free(cb->buf);
+    free(cb);
+}
+
+/**
+ * @function getVarint
+ * @brief Decodifica un varint (vedi putVarint)
+ *
+ * @param[in]  p     inizio del varint
+ * @param[in]  avail byte disponibili a partire da \a p
+ * @param[out] v     valore decodificato
+ *
+ * @return numero di byte consumati, 0 se il varint non è ancora stato ricevuto tutto.
+ * @return REQ_INVALID se il varint supera VARINT_MAX byte o i 32 bit.
+ */
+static size_t getVarint(const char *p, size_t avail, unsigned int *v)
+{
+    const unsigned char *u = (const unsigned char*) p;
+    unsigned int x = 0;
+    size_t i;
+
+    for(i = 0; i < avail && i < VARINT_MAX; i++)
+    {
+        x |= (unsigned int)(u[i] & 0x7f) << (7*i);
+        if(!(u[i] & 0x80))
+        {
+            // l'ultimo byte possibile porta solo i 4 bit più alti
+            if(i == VARINT_MAX-1 && u[i] > 0x0f)
+                return REQ_INVALID;
+            *v = x;
+            return i + 1;
+        }
+    }
+
+    return (i == VARINT_MAX) ? REQ_INVALID : 0;
+}
+
+/**
+ * @function nameSize
+ * @brief Calcola i byte di un nickname codificato in v2 (vedi putName)
+ * @return numero di byte, 0 se la lunghezza non è ancora stata ricevuta.
+ * @return REQ_INVALID se la lunghezza non è valida o supera MAX_NAME_LENGTH.
+ */
+static size_t nameSize(const char *p, size_t avail)
+{
+    unsigned int len;
+    size_t n;
+
+    if((n = getVarint(p,avail,&len)) == 0 || n == REQ_INVALID)
+        return n;
+    if(len > MAX_NAME_LENGTH)
+        return REQ_INVALID;
+    return n + len;
+}
+
+/**
+ * @function parseName
+ * @brief Copia in \a name un nickname codificato in v2, già controllato da nameSize
+ * @return numero di byte consumati.
+ */
+static size_t parseName(const char *p, char *name)
+{
+    unsigned int len;
+    size_t n = getVarint(p,VARINT_MAX,&len);
+
+    memset(name,0,MAX_NAME_LENGTH+1);
+    memcpy(name,p + n,len);
+    return n + len;
+}
+
+/**
+ * @function hdrSize
+ * @brief Calcola i byte dell'header che inizia in \a p
+ *
+ * @param[in] p       inizio dell'header
+ * @param[in] avail   byte disponibili a partire da \a p
+ * @param[in] version versione del protocollo
+ *
+ * @return numero di byte dell'header, se la parte ricevuta permette di calcolarlo (0 altrimenti).
+ * @return REQ_INVALID se l'header viola il protocollo.
+ */
+static size_t hdrSize(const char *p, size_t avail, int version)
+{
+    unsigned int op;
+    size_t n, name;
+
+    if(version < WIRE_V2)
+        return HDR_SIZE;
+
+    if((n = getVarint(p,avail,&op)) == 0 || n == REQ_INVALID)
+        return n;
+    if((name = nameSize(p + n,avail - n)) == 0 || name == REQ_INVALID)
+        return name;
+    return n + name;
+}
+
+/**
+ * @function dataUnit
+ * @brief Calcola i byte del body che inizia in \a p, compreso il buffer dati (vedi hdrSize)
+ *
+ * @param[out] len  lunghezza dichiarata del buffer dati (decompresso, in v3)
+ * @param[out] zlen dimensione del blocco compresso (0 se il buffer dati non è compresso)
+ */
+static size_t dataUnit(const char *p, size_t avail, int version, unsigned int *len, unsigned int *zlen)
+{
+    size_t name, n;
+    size_t nz;
+
+    *zlen = 0;
+    if(version < WIRE_V2)
+    {
+        if(avail < DATA_HDR_SIZE)
+            return 0;
+        memcpy(len,p + MAX_NAME_LENGTH+1,sizeof(unsigned int));
+        return DATA_HDR_SIZE + *len;
+    }
+
+    if((name = nameSize(p,avail)) == 0 || name == REQ_INVALID)
+        return name;
+    if(name >= avail || (n = getVarint(p + name,avail - name,len)) == 0)
+        return 0;
+    if(n == REQ_INVALID)
+        return REQ_INVALID;
+    if(version < WIRE_V3)
+        return name + n + *len;
+
+    // un body compresso occupa zlen byte
+    if(name + n >= avail || (nz = getVarint(p + name + n,avail - name - n,zlen)) == 0)
+        return 0;
+    if(nz == REQ_INVALID)
+        return REQ_INVALID;
+    /* compressData invia un blocco compresso solo se è più piccolo del buffer dati (e quindi
+     * di lz_bound): un blocco più grande, o un buffer vuoto compresso, viola il protocollo */
+    if(*zlen != 0 && (*len == 0 || *zlen >= *len))
+        return REQ_INVALID;
+    return name + n + nz + (*zlen ? *zlen : *len);
+}
+
+/**
+ * @function dataSize
+ * @brief Calcola i byte del body che inizia in \a p, compreso il buffer dati (vedi dataUnit)
+ */
+static size_t dataSize(const char *p, size_t avail, int version)
+{
+    unsigned int len, zlen;
+    return dataUnit(p,avail,version,&len,&zlen);
+}
+
+/**
+ * @function requestSize
+ * @brief Calcola la dimensione della richiesta che inizia in \a p
+ *
+ * @param[in] p       inizio della richiesta
+ * @param[in] avail   byte disponibili a partire da \a p
+ * @param[in] version versione del protocollo
+ *
+ * @return numero di byte della richiesta, se la parte ricevuta permette di calcolarlo.
+ * @return 0 se non sono ancora stati ricevuti tutti gli header necessari.
+ * @return REQ_TOOLONG se la richiesta dichiara un body oltre i limiti.
+ * @return REQ_INVALID se la richiesta viola il protocollo.
+ */
+static size_t requestSize(const char *p, size_t avail, int version)
+{
+    unsigned int op, len, zlen;
+    op_t op1;
+    size_t size, n;
+
+    if((size = hdrSize(p,avail,version)) == 0 || size == REQ_INVALID)
+        return size;
+    if(size > avail || (n = dataUnit(p + size,avail - size,version,&len,&zlen)) == 0)
+        return 0;
+    if(n == REQ_INVALID)
+        return REQ_INVALID;
+    if(len > maxdata || zlen > maxdata)
+        return REQ_TOOLONG;
 
-    n_write = writen((int)fd,msg->hdr.receiver, MAX_NAME_LENGTH+1,"receiver write in sendData");
-    EQZERO(n_write);
-    n_write = writen((int)fd,&msg->hdr.len, sizeof(unsigned int),"length write in sendData");
-    if(msg->hdr.len == 0) return 1;
-    n_write = writen(fd,msg->buf, msg->hdr.len,"buf write in sendData");
-    EQZERO(n_write);
+    if(version >= WIRE_V2)
+        getVarint(p,avail,&op);
+    else
+    {
+        memcpy(&op1,p,sizeof(op_t));
+        op = (unsigned int)op1;
+    }
+    size += n;
+
+    // la POSTFILE_OP è seguita dal body con il contenuto del file
+    if(op == POSTFILE_OP)
+    {
+        if(size >= avail || (n = dataUnit(p + size,avail - size,version,&len,&zlen)) == 0)
+            return 0;
+        if(n == REQ_INVALID)
+            return REQ_INVALID;
+        if(len > maxfile || zlen > maxfile)
+            return REQ_TOOLONG;
+        size += n;
+    }
+
+    return size;
+}
+
+/**
+ * @function parseHeader
+ * @brief Copia un header a partire da \a p
+ *
+ * @param[in]  p       inizio dell'header
+ * @param[out] hdr     header estratto
+ * @param[in]  version versione del protocollo
+ *
+ * @return numero di byte consumati.
+ */
+static size_t parseHeader(const char *p, message_hdr_t *hdr, int version)
+{
+    unsigned int op;
+    size_t n;
+
+    memset(hdr,0,sizeof(message_hdr_t));
+    if(version >= WIRE_V2)
+    {
+        n = getVarint(p,VARINT_MAX,&op);
+        hdr->op = (op_t)op;
+        return n + parseName(p + n,hdr->sender);
+    }
+
+    memcpy(&hdr->op,p,sizeof(op_t));
+    memcpy(hdr->sender,p + sizeof(op_t),MAX_NAME_LENGTH+1);
+    hdr->sender[MAX_NAME_LENGTH] = '\0';
+
+    return HDR_SIZE;
+}
+
+/**
+ * @function uncompressBlock
+ * @brief Decomprime nel buffer dati di \a data un blocco ricevuto in v3
+ *
+ * Un blocco non valido, che dichiara una lunghezza oltre \a max o che non può
+ * produrre, o per cui non c'è memoria, viene scartato: il body risulta vuoto.
+ *
+ * @param[in]     p    inizio del blocco
+ * @param[in]     zlen dimensione del blocco
+ * @param[in,out] data body, con la lunghezza decompressa già letta
+ * @param[in]     max  lunghezza decompressa massima
+ *
+ * @return 0 in caso di successo, -1 se il blocco è stato scartato.
+ */
+static int uncompressBlock(const char *p, unsigned int zlen, message_data_t *data, size_t max)
+{
+    char *buf;
+
+    // ogni byte del blocco produce al più 255 byte: non alloco per lunghezze impossibili
+    if(data->hdr.len > 0 && data->hdr.len <= max && data->hdr.len / 255 <= zlen &&
+       (buf = (char*) malloc(sizeof(char)*data->hdr.len)) != NULL)
+    {
+        if(lz_decompress(p,zlen,buf,data->hdr.len) == 0)
+        {
+            data->buf = buf;
+            return 0;
+        }
+        free(buf);
+    }
+
+    data->buf = NULL;
+    data->hdr.len = 0;
+    return -1;
+}
+
+/**
+ * @function parseData
+ * @brief Copia un body a partire da \a p, allocando il buffer dati
+ *
+ * @param[in]  p       inizio del body
+ * @param[out] data    body estratto
+ * @param[in]  version versione del protocollo
+ * @param[out] pzlen   se non NULL, un blocco compresso viene copiato così com'è in buf e
+ *                     la sua dimensione scritta qui (0 se il body non è compresso)
+ *
+ * @return numero di byte consumati.
+ */
+static size_t parseData(const char *p, message_data_t *data, int version, unsigned int *pzlen)
+{
+    unsigned int zlen = 0;
+    size_t n;
+
+    memset(&data->hdr,0,sizeof(message_data_hdr_t));
+    if(version >= WIRE_V2)
+    {
+        n = parseName(p,data->hdr.receiver);
+        n += getVarint(p + n,VARINT_MAX,&data->hdr.len);
+        if(version >= WIRE_V3)
+            n += getVarint(p + n,VARINT_MAX,&zlen);
+    }
+    else
+    {
+        memcpy(data->hdr.receiver,p,MAX_NAME_LENGTH+1);
+        memcpy(&data->hdr.len,p + MAX_NAME_LENGTH+1,sizeof(unsigned int));
+        data->hdr.receiver[MAX_NAME_LENGTH] = '\0';
+        n = DATA_HDR_SIZE;
+    }
+    data->buf = NULL;
+    if(pzlen != NULL)
+        *pzlen = zlen;
+
+    if(zlen > 0)
+    {
+        // decompressione rimandata (vedi connbuf_uncompressRequest): se manca la memoria il blocco risulterà non valido
+        if(pzlen != NULL && (data->buf = (char*) malloc(sizeof(char)*zlen)) != NULL)
+            memcpy(data->buf,p + n,zlen);
+        else if(pzlen == NULL)
+            uncompressBlock(p + n,zlen,data,(size_t)-1);
+        return n + zlen;
+    }
+
+    if(data->hdr.len > 0)
+    {
+        SYSCALL(data->buf = (char*) malloc(sizeof(char)*data->hdr.len),NULL,"malloc buffer in parseData");
+        memcpy(data->buf,p + n,data->hdr.len);
+    }
+
+    return n + data->hdr.len;
+}
+
+/**
+ * @function connbuf_reserve
+ * @brief Fa spazio in fondo al buffer per almeno \a need byte
+ *
+ * @param[in] cb   buffer di ricezione
+ * @param[in] need byte da poter ricevere senza spostare i dati
+ *
+ * @return 0 in caso di successo, -1 se la memoria non è sufficiente.
+ */
+static int connbuf_reserve(connbuf_t *cb, size_t need)
+{
+    size_t avail = cb->end - cb->start;
+
+    if(cb->size - cb->end >= need)
+        return 0;
+
+    // sposto in testa i byte non consumati, ed eventualmente ingrandisco il buffer
+    memmove(cb->buf,cb->buf + cb->start,avail);
+    cb->start = 0;
+    cb->end = avail;
+
+    if(cb->size - cb->end < need)
+    {
+        char *tmp;
+        if((tmp = (char*) realloc(cb->buf,cb->end + need)) == NULL)
+            return -1;
+        cb->buf = tmp;
+        cb->size = cb->end + need;
+    }
+
+    return 0;
+}
+
+/**
+ * @function connbuf_read
+ * @brief Riceve con una sola read tutti i byte disponibili, fino allo spazio libero nel buffer
+ *
+ * @param[in] cb   buffer di ricezione
+ * @param[in] fd   descrittore della connessione
+ * @param[in] need byte attesi (viene comunque lasciato spazio per almeno CONNBUF_CHUNK byte)
+ *
+ * @return come connbuf_fill.
+ */
+static ssize_t connbuf_read(connbuf_t *cb, long fd, size_t need)
+{
+    ssize_t r;
+
+    if(connbuf_reserve(cb,(need < CONNBUF_CHUNK) ? CONNBUF_CHUNK : need) == -1)
+        return -1;
+
+    if((r = read((int)fd,cb->buf + cb->end,cb->size - cb->end)) > 0)
+        cb->end += r;
+    else if(r == -1 && errno == ECONNRESET) // connessione resettata: la tratto come chiusa
+        r = 0;
+
+    return r;
+}
+
+ssize_t connbuf_fill(connbuf_t *cb, long fd)
+{
+    size_t need, avail;
+
+    if(cb == NULL || fd < 0)
+    {
+        errno = EINVAL;
+        return -1;
+    }
+
+    // se la richiesta in corso ha dimensione nota, preparo lo spazio per riceverla tutta
+    avail = cb->end - cb->start;
+    if((need = requestSize(cb->buf + cb->start,avail,wire_version(fd))) == REQ_TOOLONG)
+    {
+        errno = EMSGSIZE;
+        return -1;
+    }
+    if(need == REQ_INVALID)
+    {
+        errno = EPROTO;
+        return -1;
+    }
+
+    return connbuf_read(cb,fd,(need > avail) ? need - avail : 0);
+}
+
+/**
+ * @function connbuf_need
+ * @brief Attende che il buffer contenga almeno \a n byte non consumati
+ *
+ * @param[in] cb buffer di ricezione
+ * @param[in] fd descrittore della connessione (bloccante o no)
+ * @param[in] n  byte richiesti
+ *
+ * @return 1 in caso di successo, 0 se la connessione è chiusa, -1 in caso di errore (errno settato).
+ */
+static int connbuf_need(connbuf_t *cb, long fd, size_t n)
+{
+    ssize_t r;
+
+    while(cb->end - cb->start < n)
+    {
+        if((r = connbuf_read(cb,fd,n - (cb->end - cb->start))) > 0)
+            continue;
+        if(r == 0)
+            return 0;
+        if(errno == EINTR)
+            continue;
+        if(errno != EAGAIN && errno != EWOULDBLOCK)
+            return -1;
+
+        // socket non bloccante: attendo nuovi dati
+        if(!waitReady(fd,POLLIN))
+            return 0;
+    }
 
     return 1;
 }
 
-int sendRequest(long fd, message_t *msg)
+/**
+ * @function connbuf_needUnit
+ * @brief Attende che il buffer contenga per intero l'header (o il body) in testa
+ *
+ * @param[in] cb      buffer di ricezione
+ * @param[in] fd      descrittore della connessione
+ * @param[in] size    funzione che calcola la dimensione dell'unità (hdrSize o dataSize)
+ * @param[in] version versione del protocollo
+ *
+ * @return come connbuf_need (errno EPROTO se l'unità viola il protocollo).
+ */
+static int connbuf_needUnit(connbuf_t *cb, long fd, size_t (*size)(const char*, size_t, int), int version)
 {
-    if(fd < 0 || msg == NULL)
+    size_t n, avail;
+    int r;
+
+    for(;;)
+    {
+        avail = cb->end - cb->start;
+        if((n = size(cb->buf + cb->start,avail,version)) == REQ_INVALID)
+        {
+            errno = EPROTO;
+            return -1;
+        }
+        if(n != 0 && n <= avail)
+            return 1;
+
+        // dimensione ancora ignota (v2): basta ricevere qualche byte in più per calcolarla
+        if((r = connbuf_need(cb,fd,(n != 0) ? n : avail + 1)) <= 0)
+            return r;
+    }
+}
+
+int connbuf_readHeader(connbuf_t *cb, long fd, message_hdr_t *hdr)
+{
+    int r, version = wire_version(fd);
+
+    if(cb == NULL || fd < 0 || hdr == NULL)
+    {
+        errno = EINVAL;
+        return -1;
+    }
+    if((r = connbuf_needUnit(cb,fd,hdrSize,version)) <= 0)
+        return r;
+
+    cb->start += parseHeader(cb->buf + cb->start,hdr,version);
+    if(cb->start == cb->end)
+        cb->start = cb->end = 0;
+
+    return 1;
+}
+
+int connbuf_readData(connbuf_t *cb, long fd, message_data_t *data)
+{
+    int r, version = wire_version(fd);
+
+    if(cb == NULL || fd < 0 || data == NULL)
+    {
+        errno = EINVAL;
+        return -1;
+    }
+    if((r = connbuf_needUnit(cb,fd,dataSize,version)) <= 0)
+        return r;
+
+    cb->start += parseData(cb->buf + cb->start,data,version,NULL);
+    if(cb->start == cb->end)
+        cb->start = cb->end = 0;
+
+    return 1;
+}
+
+int connbuf_put(connbuf_t *cb, const char *data, size_t len)
+{
+    if(cb == NULL || (data == NULL && len > 0))
+    {
+        errno = EINVAL;
+        return -1;
+    }
+
+    if(connbuf_reserve(cb,len) == -1)
+        return -1;
+
+    memcpy(cb->buf + cb->end,data,len);
+    cb->end += len;
+
+    return 0;
+}
+
+int connbuf_getRequest(connbuf_t *cb, int version, message_t *msg, message_data_t *file, unsigned int zlen[2])
+{
+    size_t size, avail;
+    const char *p;
+
+    if(cb == NULL || msg == NULL || file == NULL || zlen == NULL)
         return 0;
 
-    ssize_t res_hdr, res_data;
+    p = cb->buf + cb->start;
+    avail = cb->end - cb->start;
 
-    res_hdr = sendHeader(fd,&msg->hdr);
-    res_data = sendData(fd,&msg->data);
+    if((size = requestSize(p,avail,version)) == 0 || size > avail)
+        return 0;
 
-    return res_hdr && res_data;
+    p += parseHeader(p,&msg->hdr,version);
+    p += parseData(p,&msg->data,version,&zlen[0]);
+
+    zlen[1] = 0;
+    if(msg->hdr.op == POSTFILE_OP)
+        parseData(p,file,version,&zlen[1]);
+    else
+        setData(file,"",NULL,0);
+
+    // se ho consumato tutto il buffer riparto dall'inizio
+    cb->start += size;
+    if(cb->start == cb->end)
+        cb->start = cb->end = 0;
+
+    return 1;
+}
+
+/**
+ * @function uncompressBody
+ * @brief Sostituisce il blocco compresso nel buffer dati di \a data con i byte decompressi
+ * @return come uncompressBlock.
+ */
+static int uncompressBody(message_data_t *data, unsigned int zlen, size_t max)
+{
+    char *z = data->buf;
+    int r;
+
+    if(zlen == 0)
+        return 0;
+    if(z == NULL)
+    {
+        data->hdr.len = 0;
+        return -1;
+    }
+
+    r = uncompressBlock(z,zlen,data,max);
+    free(z);
+    return r;
+}
+
+int connbuf_uncompressRequest(message_t *msg, message_data_t *file, const unsigned int zlen[2])
+{
+    int r;
+
+    if(msg == NULL || file == NULL || zlen == NULL)
+        return -1;
+
+    // anche se il primo body non è valido libero il blocco del secondo
+    r = uncompressBody(&msg->data,zlen[0],maxdata);
+    if(uncompressBody(file,zlen[1],maxfile) == -1)
+        r = -1;
+
+    return r;
+}
+
+int connbuf_ready(connbuf_t *cb, int version)
+{
+    size_t size, avail;
+
+    if(cb == NULL)
+        return 0;
+
+    avail = cb->end - cb->start;
+    return (size = requestSize(cb->buf + cb->start,avail,version)) != 0 && size <= avail;
 }
@@ -14,6 +14,7 @@
 #define UNIX_PATH_MAX  64
 #endif
 
+#include <sys/types.h>
 #include <message.h>
 
 /**
@@ -40,6 +41,9 @@ int openConnection(char* path, unsigned int ntimes, unsigned int secs);
  * @function readHeader
  * @brief Legge l'header del messaggio
  *
+ * La lettura passa per un buffer associato al descrittore (vedi connbuf_readHeader),
+ * quindi sulla connessione vanno usate solo readHeader, readData e readMsg.
+ *
  * @param[in] fd     descrittore della connessione
  * @param[in] hdr    puntatore all'header del messaggio da ricevere
  *
@@ -73,6 +77,241 @@ int readMsg(long fd, message_t *msg);
 
 /* da completare da parte dello studente con altri metodi di interfaccia */
 
+#define CONNBUF_CHUNK 4096 /**< spazio libero minimo richiesto prima di ogni lettura nel buffer di una connessione. */
+
+#define HDR_SIZE      (sizeof(op_t) + MAX_NAME_LENGTH+1)                /**< byte di message_hdr_t sul socket (v1). */
+#define DATA_HDR_SIZE (MAX_NAME_LENGTH+1 + sizeof(unsigned int))        /**< byte di message_data_hdr_t sul socket (v1). */
+
+/* ------- versioni del protocollo -------
+ *
+ * v1: op_t e lunghezze nell'ordine dei byte dell'host, nickname su MAX_NAME_LENGTH+1 byte.
+ * v2: op e lunghezze come varint (7 bit per byte, dal meno significativo), nickname
+ *     preceduti dalla propria lunghezza e senza terminatore; un nickname vuoto occupa un byte.
+ *       header: op, lunghezza sender, sender
+ *       body:   lunghezza receiver, receiver, len, buf
+ * v3: come la v2, ma nel body len è seguita da zlen (varint): se zlen non è 0, buf è un blocco
+ *     di zlen byte compresso con lz_compress, che si decomprime in len byte. Vengono compressi
+ *     i body di almeno WIRE_ZMIN byte, se il blocco compresso è più piccolo.
+ *
+ * Ogni connessione parte in v1. Un client offre la versione più alta che conosce mettendo
+ * WIRE_HELLO seguito dal numero di versione (ad esempio "chatty/3") come receiver del
+ * CONNECT_OP (o REGISTER_OP); il server la accetta, eventualmente abbassandola, rispondendo
+ * ancora in v1 con un OP_OK che ha come sender la versione scelta. Da lì entrambi la usano.
+ * Un server v1 ignora il receiver e risponde con un altro sender: il client resta in v1.
+ */
+#define WIRE_V1 1 /**< protocollo originale, a campi di dimensione fissa. */
+#define WIRE_V2 2 /**< protocollo compatto, con varint e nickname di lunghezza variabile. */
+#define WIRE_V3 3 /**< protocollo compatto con i body lunghi compressi. */
+#define WIRE_MAX WIRE_V3 /**< versione più alta conosciuta. */
+#define WIRE_HELLO "chatty/" /**< prefisso del receiver con cui il client offre una versione, e del sender con cui il server la accetta. */
+
+#define WIRE_ZMIN 256 /**< byte minimi di un body perché venga compresso (v3). */
+
+#define VARINT_MAX 5 /**< byte massimi di un intero a 32 bit codificato come varint. */
+#define WIRE_UNIT_MAX (3*VARINT_MAX + MAX_NAME_LENGTH) /**< byte massimi di un header, o dell'header di un body, in v2 e v3. */
+
+/**
+ * @function wire_version
+ * @brief Restituisce la versione del protocollo usata su una connessione
+ *
+ * @param[in] fd descrittore della connessione
+ *
+ * @return WIRE_V1, WIRE_V2 o WIRE_V3.
+ */
+int wire_version(long fd);
+
+/**
+ * @function wire_setVersion
+ * @brief Imposta la versione del protocollo di una connessione (WIRE_V1 per una connessione nuova)
+ *
+ * @param[in] fd      descrittore della connessione
+ * @param[in] version WIRE_V1, WIRE_V2 o WIRE_V3
+ */
+void wire_setVersion(long fd, int version);
+
+/**
+ * @function wire_hello
+ * @brief Restituisce la versione indicata da un nickname del tipo WIRE_HELLO "<versione>"
+ *
+ * @param[in] name nickname (receiver dell'offerta o sender della risposta)
+ *
+ * @return versione indicata (almeno WIRE_V2), 0 se \a name non indica una versione.
+ */
+int wire_hello(const char *name);
+
+/**
+ * @function wire_offer
+ * @brief Lato server: registra l'offerta di una versione contenuta in un CONNECT_OP
+ *
+ * Va chiamata prima di rispondere alla richiesta: la risposta (inviata con sendHeader
+ * o sendRequest) accetta l'offerta se è un OP_OK, la rifiuta altrimenti.
+ *
+ * @param[in] fd  descrittore del client
+ * @param[in] msg richiesta ricevuta
+ * @param[in] max versione più alta che il server accetta (WIRE_V2 per non comprimere)
+ *
+ * @return 1 se la richiesta offriva una versione, 0 altrimenti.
+ */
+int wire_offer(long fd, message_t *msg, int max);
+
+/**
+ * @typedef connbuf_t
+ * @brief Ridefinizione della struttura connbuf_s
+ *
+ * @struct connbuf_s
+ * @brief Buffer di ricezione di una connessione
+ *
+ * I byte ricevuti vengono accumulati finché non contengono una richiesta completa,
+ * che viene poi estratta senza ulteriori system call.
+ *
+ * @param[in] buf   area di memoria del buffer
+ * @param[in] size  dimensione di buf
+ * @param[in] start indice del primo byte non ancora consumato
+ * @param[in] end   indice successivo all'ultimo byte ricevuto
+ */
+typedef struct connbuf_s
+{
+    char *buf;
+    size_t size;
+    size_t start;
+    size_t end;
+} connbuf_t;
+
+/**
+ * @function connbuf_create
+ * @brief Alloca un buffer di ricezione vuoto
+ *
+ * @return puntatore al buffer allocato.
+ * @return NULL in caso di errore.
+ */
+connbuf_t *connbuf_create(void);
+
+/**
+ * @function connbuf_destroy
+ * @brief Libera la memoria allocata con connbuf_create
+ *
+ * @param[in] cb buffer da liberare
+ */
+void connbuf_destroy(connbuf_t *cb);
+
+/**
+ * @function connbuf_fill
+ * @brief Esegue una sola read sulla connessione, accodando i byte letti al buffer
+ *
+ * Lo spazio libero viene adeguato alla richiesta in corso di ricezione, così che
+ * anche i messaggi lunghi richiedano poche letture.
+ *
+ * @param[in] cb buffer della connessione
+ * @param[in] fd descrittore della connessione (non bloccante)
+ *
+ * @return numero di byte letti.
+ * @return 0 se la connessione è stata chiusa.
+ * @return -1 in caso di errore (errno settato, EAGAIN se non ci sono dati disponibili,
+ *         EMSGSIZE se la richiesta in corso supera i limiti di connbuf_setLimits,
+ *         ENOMEM se non c'è memoria per riceverla, EPROTO se viola il protocollo).
+ */
+ssize_t connbuf_fill(connbuf_t *cb, long fd);
+
+/**
+ * @function connbuf_setLimits
+ * @brief Imposta le lunghezze massime dichiarabili dalle richieste lette con connbuf_fill
+ *
+ * Una richiesta che le supera non viene ricevuta: il buffer non cresce oltre questi
+ * limiti qualunque lunghezza dichiari il client. Per default non ci sono limiti.
+ *
+ * @param[in] data lunghezza massima del body di una richiesta
+ * @param[in] file lunghezza massima del contenuto di un file (body aggiuntivo del POSTFILE_OP)
+ */
+void connbuf_setLimits(size_t data, size_t file);
+
+/**
+ * @function connbuf_readHeader
+ * @brief Legge un header dalla connessione attraverso il buffer
+ *
+ * Il buffer viene riempito con letture grandi quanto lo spazio libero: i messaggi
+ * già ricevuti insieme a questo vengono poi estratti senza ulteriori system call.
+ *
+ * @param[in]  cb  buffer di lettura della connessione
+ * @param[in]  fd  descrittore della connessione
+ * @param[out] hdr header letto
+ *
+ * @return 1 in caso di successo, 0 se la connessione è chiusa, -1 in caso di errore (errno settato).
+ */
+int connbuf_readHeader(connbuf_t *cb, long fd, message_hdr_t *hdr);
+
+/**
+ * @function connbuf_readData
+ * @brief Legge un body dalla connessione attraverso il buffer (vedi connbuf_readHeader)
+ *
+ * @param[in]  cb   buffer di lettura della connessione
+ * @param[in]  fd   descrittore della connessione
+ * @param[out] data body letto (il buffer dati viene allocato)
+ *
+ * @return 1 in caso di successo, 0 se la connessione è chiusa, -1 in caso di errore (errno settato).
+ */
+int connbuf_readData(connbuf_t *cb, long fd, message_data_t *data);
+
+/**
+ * @function connbuf_put
+ * @brief Accoda al buffer dei byte già ricevuti altrove (ad esempio da un altro processo)
+ *
+ * @param[in] cb   buffer della connessione
+ * @param[in] data byte da accodare
+ * @param[in] len  numero di byte
+ *
+ * @return 0 in caso di successo.
+ * @return -1 in caso di errore (errno settato).
+ */
+int connbuf_put(connbuf_t *cb, const char *data, size_t len);
+
+/**
+ * @function connbuf_getRequest
+ * @brief Estrae dal buffer una richiesta completa, se presente
+ *
+ * Una richiesta è formata da un messaggio e, solo per POSTFILE_OP, dal body
+ * con il contenuto del file che il client invia subito dopo.
+ * I buffer dati estratti sono allocati con malloc (NULL se vuoti). I body compressi (v3)
+ * non vengono decompressi: il buffer dati contiene il blocco ricevuto, da passare a
+ * connbuf_uncompressRequest fuori dall'event loop.
+ *
+ * @param[in]  cb      buffer della connessione
+ * @param[in]  version versione del protocollo della connessione (wire_version)
+ * @param[out] msg     messaggio estratto
+ * @param[out] file    contenuto del file (solo per POSTFILE_OP)
+ * @param[out] zlen    dimensioni dei blocchi compressi di \a msg e \a file (0 se non compressi)
+ *
+ * @return 1 se è stata estratta una richiesta.
+ * @return 0 se il buffer non contiene ancora una richiesta completa.
+ */
+int connbuf_getRequest(connbuf_t *cb, int version, message_t *msg, message_data_t *file, unsigned int zlen[2]);
+
+/**
+ * @function connbuf_uncompressRequest
+ * @brief Decomprime i body di una richiesta estratta con connbuf_getRequest
+ *
+ * La lunghezza decompressa viene controllata con i limiti di connbuf_setLimits prima
+ * di allocare il buffer. Un blocco non valido, troppo lungo o per cui non c'è memoria
+ * viene scartato: il suo body risulta vuoto.
+ *
+ * @param[in,out] msg  messaggio
+ * @param[in,out] file contenuto del file
+ * @param[in]     zlen dimensioni dei blocchi restituite da connbuf_getRequest
+ *
+ * @return 0 in caso di successo, -1 se un blocco è stato scartato.
+ */
+int connbuf_uncompressRequest(message_t *msg, message_data_t *file, const unsigned int zlen[2]);
+
+/**
+ * @function connbuf_ready
+ * @brief Controlla, senza estrarla, se il buffer contiene una richiesta completa
+ *
+ * @param[in] cb      buffer della connessione
+ * @param[in] version versione del protocollo della connessione (wire_version)
+ *
+ * @return 1 se connbuf_getRequest estrarrebbe una richiesta, 0 altrimenti.
+ */
+int connbuf_ready(connbuf_t *cb, int version);
+
 
 // ------- client side ------
 /**
@@ -97,6 +336,19 @@ int sendRequest(long fd, message_t *msg);
  */
 int sendData(long fd, message_data_t *msg);
 
+/**
+ * @function sendFileRequest
+ * @brief Invia una richiesta seguita dal body con il contenuto del file (POSTFILE_OP),
+ * con una sola scrittura
+ *
+ * @param[in] fd     descrittore della connessione
+ * @param[in] msg    puntatore al messaggio da inviare
+ * @param[in] file   body con il contenuto del file
+ *
+ * @return <=0 se c'e' stato un errore
+ */
+int sendFileRequest(long fd, message_t *msg, message_data_t *file);
+
 
 /* da completare da parte dello studente con eventuali altri metodi di interfaccia */
 
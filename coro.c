@@ -0,0 +1,136 @@
+/*
+ * membox Progetto del corso di LSO 2017/2018
+ *
+ * Dipartimento di Informatica Università di Pisa
+ * Docenti: Prencipe, Torquati
+ *
+ */
+/**
+ * @file coro.c
+ * @author Jacopo Massa 543870 \n( <mailto:jacopomassa97@gmail.com> )
+ * @brief Implementazione delle funzioni del file coro.h
+ * @copyright **Si dichiara che il contenuto di questo file è in ogni sua parte opera
+       originale dell'autore**
+ * @see coro.h
+ */
+
+#define _GNU_SOURCE // ucontext, MAP_STACK
+#include <stdlib.h>
+#include <unistd.h>
+#include <errno.h>
+#include <sys/mman.h>
+
+#include <coro.h>
+
+static __thread coro_t *current = NULL; /**< coroutine in esecuzione nel thread (NULL se il thread esegue il proprio codice). */
+
+/**
+ * @function coro_main
+ * @brief Punto di ingresso di ogni coroutine: esegue la funzione e torna all'ultimo thread che l'ha ripresa
+ */
+static void coro_main(void)
+{
+    coro_t *c = current;
+
+    c->function(c->arg);
+    c->finished = 1;
+
+    // il contesto della coroutine non viene più ripreso: coro_resume restituisce 1
+    swapcontext(&c->ctx,&c->back);
+}
+
+coro_t *coro_create(void (*function)(void *), void *arg, size_t stacksize)
+{
+    coro_t *c;
+    size_t page = (size_t)sysconf(_SC_PAGESIZE);
+
+    if(function == NULL || stacksize == 0)
+    {
+        errno = EINVAL;
+        return NULL;
+    }
+    stacksize = (stacksize + page - 1) / page * page;
+
+    if((c = (coro_t*) malloc(sizeof(coro_t))) == NULL)
+        return NULL;
+
+    // la pagina di guardia fa terminare il processo a un overflow, invece di corrompere la memoria vicina
+    c->size = stacksize + page;
+    c->stack = mmap(NULL,c->size,PROT_READ|PROT_WRITE,MAP_PRIVATE|MAP_ANONYMOUS|MAP_STACK,-1,0);
+    if(c->stack == MAP_FAILED)
+    {
+        free(c);
+        return NULL;
+    }
+    if(mprotect(c->stack,page,PROT_NONE) == -1 || getcontext(&c->ctx) == -1)
+    {
+        coro_destroy(c);
+        return NULL;
+    }
+
+    c->ctx.uc_stack.ss_sp = c->stack + page;
+    c->ctx.uc_stack.ss_size = stacksize;
+    c->ctx.uc_link = NULL;
+    makecontext(&c->ctx,coro_main,0);
+
+    c->function = function;
+    c->arg = arg;
+    c->finished = 0;
+    c->waitfd = -1;
+    c->waitev = 0;
+    c->cancelled = 0;
+    return c;
+}
+
+int coro_resume(coro_t *c)
+{
+    coro_t *prev = current;
+
+    c->waitfd = -1;
+    c->waitev = 0;
+
+    // una coroutine può essere ripresa da un thread diverso da quello in cui si è sospesa
+    current = c;
+    swapcontext(&c->back,&c->ctx);
+    current = prev;
+
+    return c->finished;
+}
+
+int coro_wait(int fd, short events)
+{
+    coro_t *c = current;
+
+    if(c == NULL)
+        return -1;
+
+    c->waitfd = fd;
+    c->waitev = events;
+    swapcontext(&c->ctx,&c->back);
+
+    if(c->cancelled)
+    {
+        c->cancelled = 0;
+        return 1;
+    }
+    return 0;
+}
+
+void coro_cancel(coro_t *c)
+{
+    if(c != NULL)
+        c->cancelled = 1;
+}
+
+coro_t *coro_self(void)
+{
+    return current;
+}
+
+void coro_destroy(coro_t *c)
+{
+    if(c == NULL)
+        return;
+    munmap(c->stack,c->size);
+    free(c);
+}
@@ -0,0 +1,125 @@
+/*
+ * membox Progetto del corso di LSO 2017/2018
+ *
+ * Dipartimento di Informatica Università di Pisa
+ * Docenti: Prencipe, Torquati
+ *
+ */
+/**
+ * @file coro.h
+ * @author Jacopo Massa 543870 \n( <mailto:jacopomassa97@gmail.com> )
+ * @brief Coroutine con stack proprio (ucontext), per handler che si sospendono invece di bloccare un thread
+ *
+ * Una coroutine viene eseguita con coro_resume dal thread chiamante finché non
+ * termina o non si sospende con coro_wait; può poi essere ripresa da un thread
+ * qualsiasi. Per questo il codice eseguito in una coroutine non deve sospendersi
+ * con una mutex acquisita, né riusare dopo coro_wait l'indirizzo di una variabile
+ * thread-local letta prima (errno va riletto dopo ogni chiamata).
+ * @copyright **Si dichiara che il contenuto di questo file è in ogni sua parte opera
+       originale dell'autore**
+ */
+
+#ifndef CORO_H_
+#define CORO_H_
+
+#include <stddef.h>
+#include <ucontext.h>
+
+/**
+ * @typedef coro_t
+ * @brief Ridefinizione della struttura coro_s
+ *
+ * @struct coro_s
+ * @brief Coroutine
+ *
+ * @param[in] ctx      contesto della coroutine, salvato quando si sospende
+ * @param[in] back     contesto del thread che l'ha ripresa per ultimo, a cui torna sospendendosi
+ * @param[in] stack    area dello stack, con una pagina di guardia in fondo
+ * @param[in] size     dimensione di \a stack, compresa la pagina di guardia
+ * @param[in] function funzione eseguita dalla coroutine
+ * @param[in] arg      argomento di \a function
+ * @param[in] finished flag che indica che \a function è terminata
+ * @param[in] waitfd   descrittore atteso dall'ultima coro_wait (-1 = nessuno, va solo rimessa in esecuzione)
+ * @param[in] waitev   eventi attesi su \a waitfd (POLLIN, POLLOUT)
+ * @param[in] cancelled flag che indica che l'attesa è stata interrotta (vedi coro_cancel)
+ */
+typedef struct coro_s
+{
+    ucontext_t ctx;
+    ucontext_t back;
+    char *stack;
+    size_t size;
+    void (*function)(void *);
+    void *arg;
+    int finished;
+    int waitfd;
+    short waitev;
+    int cancelled;
+} coro_t;
+
+/**
+ * @function coro_create
+ * @brief Crea una coroutine che eseguirà \a function(\a arg), senza avviarla
+ *
+ * @param[in] function  funzione da eseguire
+ * @param[in] arg       argomento di \a function
+ * @param[in] stacksize dimensione dello stack (arrotondata a un multiplo della pagina)
+ *
+ * @return puntatore alla coroutine creata.
+ * @return NULL in caso di errore (errno settato).
+ */
+coro_t *coro_create(void (*function)(void *), void *arg, size_t stacksize);
+
+/**
+ * @function coro_resume
+ * @brief Esegue la coroutine nel thread chiamante finché non termina o si sospende
+ *
+ * @param[in] c coroutine da eseguire (creata o sospesa, non terminata)
+ *
+ * @return 1 se la coroutine è terminata, 0 se si è sospesa (vedi c->waitfd).
+ */
+int coro_resume(coro_t *c);
+
+/**
+ * @function coro_wait
+ * @brief Sospende la coroutine in esecuzione finché \a fd non è pronto per \a events
+ *
+ * La funzione non registra l'attesa: è chi ha chiamato coro_resume a farlo, quando
+ * la coroutine è già sospesa, e a riprenderla quando \a fd è pronto.
+ *
+ * @param[in] fd     descrittore da attendere (-1 = rimettere subito in esecuzione)
+ * @param[in] events eventi attesi (POLLIN, POLLOUT)
+ *
+ * @return 0 dopo che la coroutine è stata ripresa.
+ * @return 1 se è stata ripresa dopo coro_cancel, senza che \a fd sia pronto.
+ * @return -1 se il chiamante non è una coroutine (non c'è nulla da sospendere).
+ */
+int coro_wait(int fd, short events);
+
+/**
+ * @function coro_cancel
+ * @brief Interrompe l'attesa di una coroutine sospesa: quando verrà ripresa, coro_wait restituirà 1
+ *
+ * Va chiamata da chi ha registrato l'attesa, dopo averla annullata e prima di riprendere la coroutine.
+ *
+ * @param[in] c coroutine sospesa
+ */
+void coro_cancel(coro_t *c);
+
+/**
+ * @function coro_self
+ * @brief Restituisce la coroutine in esecuzione nel thread chiamante
+ *
+ * @return coroutine in esecuzione, NULL se il chiamante non è una coroutine.
+ */
+coro_t *coro_self(void);
+
+/**
+ * @function coro_destroy
+ * @brief Libera una coroutine terminata (o mai avviata)
+ *
+ * @param[in] c coroutine da liberare
+ */
+void coro_destroy(coro_t *c);
+
+#endif /* CORO_H_ */
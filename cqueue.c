@@ -0,0 +1,153 @@
+/*
+ * membox Progetto del corso di LSO 2017/2018
+ *
+ * Dipartimento di Informatica Università di Pisa
+ * Docenti: Prencipe, Torquati
+ *
+ */
+/**
+ * @file cqueue.c
+ * @author Jacopo Massa 543870 \n( <mailto:jacopomassa97@gmail.com> )
+ * @brief Implementazione delle funzioni del file cqueue.h
+ * @copyright **Si dichiara che il contenuto di questo file è in ogni sua parte opera
+       originale dell'autore**
+ * @see cqueue.h
+ */
+
+#define _POSIX_C_SOURCE 200809L
+#include <stdlib.h>
+#include <stdint.h>
+#include <unistd.h>
+#include <errno.h>
+#include <sys/eventfd.h>
+#include <cqueue.h>
+
+cqueue_t *cqueue_create(unsigned long size)
+{
+    cqueue_t *q;
+    unsigned long i, n = 1;
+
+    if(size == 0 || size > MAX_CQUEUE)
+        return NULL;
+
+    // la dimensione deve essere una potenza di 2, così l'indice si calcola con una maschera
+    while(n < size)
+        n <<= 1;
+
+    if((q = (cqueue_t*) calloc(1,sizeof(cqueue_t))) == NULL)
+        return NULL;
+
+    if((q->slots = (cqueue_slot_t*) malloc(sizeof(cqueue_slot_t)*n)) == NULL)
+    {
+        free(q);
+        return NULL;
+    }
+
+    if((q->efd = eventfd(0,EFD_CLOEXEC)) == -1)
+    {
+        free(q->slots);
+        free(q);
+        return NULL;
+    }
+
+    // ogni slot è libero per la posizione che gli corrisponde al primo giro
+    for(i = 0; i < n; i++)
+        q->slots[i].seq = i;
+
+    q->mask = n - 1;
+    q->head = q->tail = 0;
+    q->pending = 0;
+
+    return q;
+}
+
+int cqueue_push(cqueue_t *q, int fd)
+{
+    cqueue_slot_t *slot;
+    unsigned long pos, seq;
+    long dif;
+
+    if(q == NULL || fd < 0)
+        return -1;
+
+    // riservo uno slot libero avanzando tail con una CAS
+    pos = __atomic_load_n(&q->tail,__ATOMIC_RELAXED);
+    for(;;)
+    {
+        slot = &q->slots[pos & q->mask];
+        seq = __atomic_load_n(&slot->seq,__ATOMIC_ACQUIRE);
+        dif = (long)seq - (long)pos;
+
+        if(dif == 0)
+        {
+            if(__atomic_compare_exchange_n(&q->tail,&pos,pos+1,0,__ATOMIC_RELAXED,__ATOMIC_RELAXED))
+                break;
+        }
+        else if(dif < 0) // il consumatore non ha ancora liberato lo slot: coda piena
+            return -1;
+        else
+            pos = __atomic_load_n(&q->tail,__ATOMIC_RELAXED);
+    }
+
+    // pubblico l'elemento al consumatore
+    slot->fd = fd;
+    __atomic_store_n(&slot->seq,pos+1,__ATOMIC_RELEASE);
+
+    // suono il campanello solo se il consumatore potrebbe essere in attesa
+    if(__atomic_fetch_add(&q->pending,1,__ATOMIC_ACQ_REL) == 0)
+    {
+        uint64_t one = 1;
+        while(write(q->efd,&one,sizeof(one)) == -1)
+        {
+            if(errno != EINTR)
+                return -1;
+        }
+    }
+
+    return 0;
+}
+
+int cqueue_pop(cqueue_t *q, int *fd)
+{
+    cqueue_slot_t *slot;
+    unsigned long pos;
+
+    if(q == NULL || fd == NULL)
+        return 0;
+
+    pos = q->head;
+    slot = &q->slots[pos & q->mask];
+
+    // lo slot non è ancora stato pubblicato da un produttore
+    if(__atomic_load_n(&slot->seq,__ATOMIC_ACQUIRE) != pos+1)
+        return 0;
+
+    *fd = slot->fd;
+    q->head = pos+1;
+
+    // rendo lo slot disponibile ai produttori per il giro successivo
+    __atomic_store_n(&slot->seq,pos + q->mask + 1,__ATOMIC_RELEASE);
+
+    return 1;
+}
+
+long cqueue_ack(cqueue_t *q, long n)
+{
+    if(q == NULL)
+        return 0;
+
+    /* se il risultato è positivo qualche produttore ha già notificato un inserimento
+     * che non ho estratto; se è negativo ho estratto elementi non ancora notificati,
+     * e il produttore (trovando pending != 0) non suonerà il campanello */
+    return __atomic_sub_fetch(&q->pending,n,__ATOMIC_ACQ_REL);
+}
+
+void cqueue_destroy(cqueue_t *q)
+{
+    if(q == NULL)
+        return;
+
+    close(q->efd);
+    free(q->slots);
+    free(q);
+}
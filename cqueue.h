@@ -0,0 +1,126 @@
+/*
+ * membox Progetto del corso di LSO 2017/2018
+ *
+ * Dipartimento di Informatica Università di Pisa
+ * Docenti: Prencipe, Torquati
+ *
+ */
+/**
+ * @file cqueue.h
+ * @author Jacopo Massa 543870 \n( <mailto:jacopomassa97@gmail.com> )
+ * @brief Coda lock-free (più produttori, un consumatore) dei descrittori la cui richiesta è terminata
+ * @copyright **Si dichiara che il contenuto di questo file è in ogni sua parte opera
+       originale dell'autore**
+ */
+
+#ifndef CQUEUE_H_
+#define CQUEUE_H_
+
+#define MAX_CQUEUE 65536 /**< numero massimo di descrittori in attesa nella coda (potenza di 2). */
+#define CACHE_LINE 64 /**< dimensione di una linea di cache, usata per separare i campi condivisi. */
+
+/**
+ * @typedef cqueue_slot_t
+ * @brief Ridefinizione della struttura cqueue_slot_s
+ *
+ * @struct cqueue_slot_s
+ * @brief Elemento della coda
+ *
+ * @param[in] seq numero di sequenza che indica se lo slot è libero o pronto per essere letto
+ * @param[in] fd  descrittore memorizzato nello slot
+ */
+typedef struct cqueue_slot_s
+{
+    unsigned long seq;
+    int fd;
+} cqueue_slot_t;
+
+/**
+ * @typedef cqueue_t
+ * @brief Ridefinizione della struttura cqueue_s
+ *
+ * @struct cqueue_s
+ * @brief Struttura dati coda di completamento
+ *
+ * I campi scritti dai produttori e quelli scritti dal consumatore si trovano
+ * su linee di cache diverse, per evitare false condivisioni.
+ *
+ * @param[in] slots   array circolare degli elementi
+ * @param[in] mask    dimensione dell'array - 1
+ * @param[in] efd     eventfd usato come campanello per risvegliare il consumatore
+ * @param[in] tail    prossima posizione da riservare (produttori)
+ * @param[in] pending numero di inserimenti non ancora confermati dal consumatore
+ * @param[in] head    prossima posizione da leggere (consumatore)
+ */
+typedef struct cqueue_s
+{
+    cqueue_slot_t *slots;
+    unsigned long mask;
+    int efd;
+    char pad0[CACHE_LINE];
+    unsigned long tail;
+    long pending;
+    char pad1[CACHE_LINE];
+    unsigned long head;
+    char pad2[CACHE_LINE];
+} cqueue_t;
+
+/**
+ * @function cqueue_create
+ * @brief Alloca una coda di completamento e il relativo eventfd
+ *
+ * @param[in] size numero di elementi (arrotondato alla potenza di 2 successiva, al più MAX_CQUEUE)
+ *
+ * @return puntatore alla coda allocata.
+ * @return NULL, in caso di errore.
+ */
+cqueue_t *cqueue_create(unsigned long size);
+
+/**
+ * @function cqueue_push
+ * @brief Inserisce un descrittore nella coda (può essere chiamata da più thread)
+ *
+ * L'eventfd viene scritto solo se la coda era vuota: più completamenti
+ * ravvicinati costano al consumatore un solo risveglio.
+ *
+ * @param[in] q  coda in cui inserire
+ * @param[in] fd descrittore da inserire
+ *
+ * @return 0 in caso di successo.
+ * @return -1 se la coda è piena o in caso di errore.
+ */
+int cqueue_push(cqueue_t *q, int fd);
+
+/**
+ * @function cqueue_pop
+ * @brief Estrae un descrittore dalla coda (solo dal thread consumatore)
+ *
+ * @param[in]  q  coda da cui estrarre
+ * @param[out] fd descrittore estratto
+ *
+ * @return 1 se è stato estratto un elemento.
+ * @return 0 se non ci sono elementi pronti.
+ */
+int cqueue_pop(cqueue_t *q, int *fd);
+
+/**
+ * @function cqueue_ack
+ * @brief Conferma l'estrazione di \a n elementi, dopo aver svuotato la coda
+ *
+ * @param[in] q coda
+ * @param[in] n numero di elementi estratti dall'ultima conferma
+ *
+ * @return >0 se ci sono inserimenti notificati ma non ancora estratti: il consumatore deve continuare a svuotare la coda.
+ * @return <=0 se il consumatore può tornare in attesa sull'eventfd.
+ */
+long cqueue_ack(cqueue_t *q, long n);
+
+/**
+ * @function cqueue_destroy
+ * @brief Libera la memoria allocata con cqueue_create e chiude l'eventfd
+ *
+ * @param[in] q coda da eliminare
+ */
+void cqueue_destroy(cqueue_t *q);
+
+#endif /* CQUEUE_H_ */
@@ -0,0 +1,521 @@
+/*
+ * membox Progetto del corso di LSO 2017/2018
+ *
+ * Dipartimento di Informatica Università di Pisa
+ * Docenti: Prencipe, Torquati
+ *
+ */
+/**
+ * @file handover.c
+ * @author Jacopo Massa 543870 \n( <mailto:jacopomassa97@gmail.com> )
+ * @brief Implementazione delle funzioni del file handover.h
+ * @copyright **Si dichiara che il contenuto di questo file è in ogni sua parte opera
+       originale dell'autore**
+ * @see handover.h
+ */
+
+#define _POSIX_C_SOURCE 200809L
+#define _GNU_SOURCE // MSG_CMSG_CLOEXEC
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <unistd.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+#include <handover.h>
+
+/**
+ * @function hread
+ * @brief Legge esattamente \a size byte, senza terminare il processo in caso di errore
+ *
+ * @return 0 in caso di successo, -1 in caso di errore o di connessione chiusa (errno settato).
+ */
+static int hread(int fd, void *buf, size_t size)
+{
+    char *p = (char*) buf;
+    ssize_t r;
+
+    while(size > 0)
+    {
+        if((r = read(fd,p,size)) == -1)
+        {
+            if(errno == EINTR) continue;
+            return -1;
+        }
+        if(r == 0)
+        {
+            errno = ECONNRESET;
+            return -1;
+        }
+        p += r;
+        size -= (size_t) r;
+    }
+    return 0;
+}
+
+/**
+ * @function hwrite
+ * @brief Scrive esattamente \a size byte, senza terminare il processo in caso di errore
+ *
+ * @return 0 in caso di successo, -1 in caso di errore (errno settato).
+ */
+static int hwrite(int fd, const void *buf, size_t size)
+{
+    const char *p = (const char*) buf;
+    ssize_t r;
+
+    while(size > 0)
+    {
+        if((r = write(fd,p,size)) == -1)
+        {
+            if(errno == EINTR) continue;
+            return -1;
+        }
+        p += r;
+        size -= (size_t) r;
+    }
+    return 0;
+}
+
+/**
+ * @function sendfds
+ * @brief Invia \a len byte di \a buf, allegando i descrittori \a fds al primo byte
+ *
+ * @return 0 in caso di successo, -1 in caso di errore (errno settato).
+ */
+static int sendfds(int hfd, const int *fds, int n, const void *buf, size_t len)
+{
+    char cbuf[CMSG_SPACE(sizeof(int)*HANDOVER_FDS)];
+    struct msghdr mh;
+    struct cmsghdr *cm;
+    struct iovec iov;
+    ssize_t r;
+
+    memset(&mh,0,sizeof(mh));
+    memset(cbuf,0,sizeof(cbuf));
+    iov.iov_base = (void*) buf;
+    iov.iov_len = len;
+    mh.msg_iov = &iov;
+    mh.msg_iovlen = 1;
+    mh.msg_control = cbuf;
+    mh.msg_controllen = CMSG_SPACE(sizeof(int)*n);
+
+    cm = CMSG_FIRSTHDR(&mh);
+    cm->cmsg_level = SOL_SOCKET;
+    cm->cmsg_type = SCM_RIGHTS;
+    cm->cmsg_len = CMSG_LEN(sizeof(int)*n);
+    memcpy(CMSG_DATA(cm),fds,sizeof(int)*n);
+
+    while((r = sendmsg(hfd,&mh,0)) == -1)
+    {
+        if(errno != EINTR)
+            return -1;
+    }
+
+    // i descrittori sono già stati inviati con il primo byte
+    return hwrite(hfd,(const char*)buf + r,len - (size_t) r);
+}
+
+/**
+ * @function recvfds
+ * @brief Riceve \a len byte in \a buf e i descrittori (esattamente \a n) allegati al primo byte
+ *
+ * @return 0 in caso di successo, -1 in caso di errore (errno settato).
+ */
+static int recvfds(int hfd, int *fds, int n, void *buf, size_t len)
+{
+    char cbuf[CMSG_SPACE(sizeof(int)*HANDOVER_FDS)];
+    struct msghdr mh;
+    struct cmsghdr *cm;
+    struct iovec iov;
+    ssize_t r;
+    int got = 0;
+
+    memset(&mh,0,sizeof(mh));
+    iov.iov_base = buf;
+    iov.iov_len = len;
+    mh.msg_iov = &iov;
+    mh.msg_iovlen = 1;
+    mh.msg_control = cbuf;
+    mh.msg_controllen = sizeof(cbuf);
+
+    while((r = recvmsg(hfd,&mh,MSG_CMSG_CLOEXEC)) == -1)
+    {
+        if(errno != EINTR)
+            return -1;
+    }
+    if(r == 0)
+    {
+        errno = ECONNRESET;
+        return -1;
+    }
+
+    for(cm = CMSG_FIRSTHDR(&mh); cm != NULL; cm = CMSG_NXTHDR(&mh,cm))
+    {
+        if(cm->cmsg_level == SOL_SOCKET && cm->cmsg_type == SCM_RIGHTS)
+        {
+            got = (int)((cm->cmsg_len - CMSG_LEN(0)) / sizeof(int));
+            memcpy(fds,CMSG_DATA(cm),sizeof(int)*(got < n ? got : n));
+        }
+    }
+
+    if(got != n || (mh.msg_flags & MSG_CTRUNC))
+    {
+        for(int i=0; i < got && i < n; i++)
+            close(fds[i]);
+        errno = EPROTO;
+        return -1;
+    }
+
+    return hread(hfd,(char*)buf + r,len - (size_t) r);
+}
+
+/**
+ * @function sendMessage
+ * @brief Invia un messaggio della history
+ *
+ * @return 0 in caso di successo, -1 in caso di errore (errno settato).
+ */
+static int sendMessage(int hfd, message_t *msg)
+{
+    unsigned int len = (msg->data.buf != NULL) ? msg->data.hdr.len : 0;
+
+    if(hwrite(hfd,&msg->hdr,sizeof(message_hdr_t)) == -1 ||
+       hwrite(hfd,&msg->data.hdr,sizeof(message_data_hdr_t)) == -1 ||
+       hwrite(hfd,&len,sizeof(len)) == -1 ||
+       hwrite(hfd,msg->data.buf,len) == -1)
+        return -1;
+
+    return 0;
+}
+
+/**
+ * @function recvMessage
+ * @brief Riceve un messaggio della history, allocandone il buffer dati
+ *
+ * @return 0 in caso di successo, -1 in caso di errore (errno settato).
+ */
+static int recvMessage(int hfd, message_t *msg)
+{
+    unsigned int len;
+
+    msg->data.buf = NULL;
+    if(hread(hfd,&msg->hdr,sizeof(message_hdr_t)) == -1 ||
+       hread(hfd,&msg->data.hdr,sizeof(message_data_hdr_t)) == -1 ||
+       hread(hfd,&len,sizeof(len)) == -1)
+        return -1;
+
+    if(len > 0)
+    {
+        if((msg->data.buf = (char*) malloc(len)) == NULL)
+            return -1;
+        if(hread(hfd,msg->data.buf,len) == -1)
+        {
+            free(msg->data.buf);
+            msg->data.buf = NULL;
+            return -1;
+        }
+    }
+
+    return 0;
+}
+
+int handover_listen(const char *path)
+{
+    struct sockaddr_un sa;
+    int hsfd;
+
+    if(path == NULL)
+    {
+        errno = EINVAL;
+        return -1;
+    }
+
+    if((hsfd = socket(AF_UNIX,SOCK_STREAM | SOCK_CLOEXEC,0)) == -1)
+        return -1;
+
+    memset(&sa,0,sizeof(sa));
+    sa.sun_family = AF_UNIX;
+    strncpy(sa.sun_path,path,sizeof(sa.sun_path)-1);
+
+    unlink(path);
+    if(bind(hsfd,(struct sockaddr*)&sa,sizeof(sa)) == -1 || listen(hsfd,1) == -1)
+    {
+        int e = errno;
+        close(hsfd);
+        errno = e;
+        return -1;
+    }
+
+    return hsfd;
+}
+
+int handover_connect(const char *path)
+{
+    struct sockaddr_un sa;
+    int hfd;
+
+    if(path == NULL)
+    {
+        errno = EINVAL;
+        return -1;
+    }
+
+    if((hfd = socket(AF_UNIX,SOCK_STREAM | SOCK_CLOEXEC,0)) == -1)
+        return -1;
+
+    memset(&sa,0,sizeof(sa));
+    sa.sun_family = AF_UNIX;
+    strncpy(sa.sun_path,path,sizeof(sa.sun_path)-1);
+
+    for(int i=0; i < HANDOVER_RETRIES; i++)
+    {
+        if(connect(hfd,(struct sockaddr*)&sa,sizeof(sa)) == 0)
+            return hfd;
+
+        if(errno != ENOENT && errno != ECONNREFUSED && errno != EINTR)
+            break;
+
+        sleep(1); // il server non è ancora pronto
+    }
+
+    {
+        int e = errno;
+        close(hfd);
+        errno = e;
+    }
+    return -1;
+}
+
+int handover_send(int hfd, int sfd, icl_hash_t *users, struct statistics *stats, connbuf_t **conns, int maxconns)
+{
+    handover_hdr_t hdr;
+    handover_user_t u;
+    icl_entry_t *e;
+    node_t *node;
+    int fds[HANDOVER_FDS], n = 0, fd, version;
+    unsigned long len;
+    char ack;
+
+    if(hfd < 0 || sfd < 0 || users == NULL || stats == NULL || conns == NULL)
+    {
+        errno = EINVAL;
+        return -1;
+    }
+
+    memset(&hdr,0,sizeof(hdr));
+    hdr.magic = HANDOVER_MAGIC;
+    hdr.nusers = users->nentries;
+    hdr.stats = *stats;
+    for(fd = 0; fd < maxconns; fd++)
+        if(conns[fd] != NULL)
+            hdr.nclients++;
+
+    if(sendfds(hfd,&sfd,1,&hdr,sizeof(hdr)) == -1)
+        return -1;
+
+    // descrittori dei client: il numero nel vecchio processo serve a ricostruire gli utenti online
+    for(fd = 0; fd < maxconns; fd++)
+    {
+        if(conns[fd] == NULL)
+            continue;
+
+        fds[n++] = fd;
+        if(n == HANDOVER_FDS)
+        {
+            if(sendfds(hfd,fds,n,fds,sizeof(int)*n) == -1)
+                return -1;
+            n = 0;
+        }
+    }
+    if(n > 0 && sendfds(hfd,fds,n,fds,sizeof(int)*n) == -1)
+        return -1;
+
+    // versione del protocollo e byte ricevuti dai client ma non ancora eseguiti, nello stesso ordine dei descrittori
+    for(fd = 0; fd < maxconns; fd++)
+    {
+        if(conns[fd] == NULL)
+            continue;
+
+        version = wire_version(fd);
+        len = conns[fd]->end - conns[fd]->start;
+        if(hwrite(hfd,&version,sizeof(version)) == -1 ||
+           hwrite(hfd,&len,sizeof(len)) == -1 || hwrite(hfd,conns[fd]->buf + conns[fd]->start,len) == -1)
+            return -1;
+    }
+
+    // utenti registrati e relative history
+    for(int i=0; i < users->nbuckets; i++)
+    {
+        for(e = users->buckets[i]; e != NULL; e = e->next)
+        {
+            memset(&u,0,sizeof(u));
+            strncpy(u.name,(char*)e->key,MAX_NAME_LENGTH);
+            u.fd = e->fd;
+            u.online = e->online;
+            u.qlen = e->queue->qlen;
+            u.qcurr = e->queue->qcurr;
+            u.qmax = e->queue->qmax;
+
+            if(hwrite(hfd,&u,sizeof(u)) == -1)
+                return -1;
+
+            node = e->queue->head;
+            for(unsigned long j=0; j < u.qlen; j++, node = node->next)
+                if(sendMessage(hfd,&node->msg) == -1)
+                    return -1;
+        }
+    }
+
+    // attendo che il nuovo processo abbia ricevuto tutto
+    if(hread(hfd,&ack,sizeof(ack)) == -1)
+        return -1;
+
+    return 0;
+}
+
+int handover_recv(int hfd, int *sfd, icl_hash_t *users, struct statistics *stats, connbuf_t **conns, int maxconns, int **fds)
+{
+    handover_hdr_t hdr;
+    handover_user_t u;
+    icl_entry_t *e;
+    int *oldfds = NULL, *newfds = NULL, *map = NULL, maxold = -1, i, k, version;
+    unsigned long len;
+    char *data, ack = 1;
+
+    if(hfd < 0 || sfd == NULL || users == NULL || stats == NULL || conns == NULL || fds == NULL)
+    {
+        errno = EINVAL;
+        return -1;
+    }
+
+    if(recvfds(hfd,sfd,1,&hdr,sizeof(hdr)) == -1)
+        return -1;
+
+    if(hdr.magic != HANDOVER_MAGIC || hdr.nclients < 0 || hdr.nusers < 0)
+    {
+        errno = EPROTO;
+        goto err;
+    }
+    *stats = hdr.stats;
+
+    if((oldfds = (int*) malloc(sizeof(int)*(hdr.nclients+1))) == NULL ||
+       (newfds = (int*) malloc(sizeof(int)*(hdr.nclients+1))) == NULL)
+        goto err;
+
+    for(i = 0; i < hdr.nclients; i += k)
+    {
+        k = (hdr.nclients - i < HANDOVER_FDS) ? hdr.nclients - i : HANDOVER_FDS;
+        if(recvfds(hfd,newfds + i,k,oldfds + i,sizeof(int)*k) == -1)
+        {
+            hdr.nclients = i; // chiudo solo i descrittori già ricevuti
+            goto err;
+        }
+    }
+
+    // corrispondenza tra i descrittori del vecchio processo e quelli ricevuti
+    for(i = 0; i < hdr.nclients; i++)
+        if(oldfds[i] > maxold)
+            maxold = oldfds[i];
+    if((map = (int*) malloc(sizeof(int)*(maxold+2))) == NULL)
+        goto err;
+    for(i = 0; i <= maxold; i++)
+        map[i] = -1;
+
+    for(i = 0; i < hdr.nclients; i++)
+    {
+        if(oldfds[i] < 0 || newfds[i] >= maxconns)
+        {
+            errno = EMFILE;
+            goto err;
+        }
+        map[oldfds[i]] = newfds[i];
+
+        if(hread(hfd,&version,sizeof(version)) == -1 || hread(hfd,&len,sizeof(len)) == -1)
+            goto err;
+        wire_setVersion(newfds[i],version);
+        if((conns[newfds[i]] = connbuf_create()) == NULL)
+            goto err;
+        if(len > 0)
+        {
+            if((data = (char*) malloc(len)) == NULL)
+                goto err;
+            if(hread(hfd,data,len) == -1 || connbuf_put(conns[newfds[i]],data,len) == -1)
+            {
+                free(data);
+                goto err;
+            }
+            free(data);
+        }
+    }
+
+    for(i = 0; i < hdr.nusers; i++)
+    {
+        node_t *node, *prev = NULL;
+
+        if(hread(hfd,&u,sizeof(u)) == -1)
+            goto err;
+        u.name[MAX_NAME_LENGTH] = '\0';
+
+        if((e = icl_hash_insert(users,u.name,-1)) == NULL)
+        {
+            errno = EPROTO;
+            goto err;
+        }
+        e->online = u.online;
+        e->fd = (u.online && u.fd >= 0 && u.fd <= maxold) ? map[u.fd] : -1;
+        if(e->fd == -1)
+            e->online = 0;
+
+        // ricostruisco la history con la stessa disposizione dei nodi
+        e->queue->qlen = u.qlen;
+        e->queue->qcurr = u.qcurr;
+        e->queue->qmax = u.qmax;
+        for(unsigned long j=0; j < u.qlen; j++)
+        {
+            if((node = (node_t*) malloc(sizeof(node_t))) == NULL)
+            {
+                e->queue->qlen = j;
+                goto err;
+            }
+            node->next = NULL;
+            if(recvMessage(hfd,&node->msg) == -1)
+            {
+                free(node);
+                e->queue->qlen = j;
+                goto err;
+            }
+            if(prev) prev->next = node; else e->queue->head = node;
+            if(j+1 == u.qcurr) e->queue->tail = node;
+            prev = node;
+        }
+    }
+
+    if(hwrite(hfd,&ack,sizeof(ack)) == -1)
+        goto err;
+
+    free(oldfds);
+    free(map);
+    *fds = newfds;
+    return hdr.nclients;
+
+ err:
+    {
+        int err = errno;
+        close(*sfd);
+        for(i = 0; newfds && i < hdr.nclients; i++)
+        {
+            if(newfds[i] < maxconns)
+            {
+                connbuf_destroy(conns[newfds[i]]);
+                conns[newfds[i]] = NULL;
+            }
+            close(newfds[i]);
+        }
+        free(oldfds);
+        free(newfds);
+        free(map);
+        errno = err;
+    }
+    return -1;
+}
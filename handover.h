@@ -0,0 +1,142 @@
+/*
+ * membox Progetto del corso di LSO 2017/2018
+ *
+ * Dipartimento di Informatica Università di Pisa
+ * Docenti: Prencipe, Torquati
+ *
+ */
+/**
+ * @file handover.h
+ * @author Jacopo Massa 543870 \n( <mailto:jacopomassa97@gmail.com> )
+ * @brief Passaggio del socket, dei client connessi e dello stato del server a un nuovo processo
+ *
+ * Il processo in esecuzione ascolta su un socket dedicato (HandoverPath); il nuovo
+ * processo vi si connette e riceve, in ordine:
+ *  - l'header (handover_hdr_t), con il socket di connessione in SCM_RIGHTS;
+ *  - i descrittori dei client, a gruppi di HANDOVER_FDS, ognuno con il proprio numero nel vecchio processo;
+ *  - la versione del protocollo e i byte già ricevuti da ogni client ma non ancora eseguiti;
+ *  - gli utenti registrati (handover_user_t), ognuno seguito dalla propria history.
+ * Il nuovo processo conferma la ricezione con un byte, dopo il quale il vecchio può terminare.
+ * @copyright **Si dichiara che il contenuto di questo file è in ogni sua parte opera
+       originale dell'autore**
+ */
+
+#ifndef HANDOVER_H_
+#define HANDOVER_H_
+
+#include <config.h>
+#include <stats.h>
+#include <icl_hash.h>
+#include <connections.h>
+
+#define HANDOVER_MAGIC 0x43484132 /**< identifica lo stato inviato da un server chatty compatibile. */
+#define HANDOVER_FDS 64 /**< numero massimo di descrittori inviati con un singolo messaggio. */
+#define HANDOVER_RETRIES 10 /**< tentativi di connessione al processo in esecuzione, a distanza di un secondo. */
+
+/**
+ * @typedef handover_hdr_t
+ * @brief Ridefinizione della struttura handover_hdr_s
+ *
+ * @struct handover_hdr_s
+ * @brief Header dello stato inviato al nuovo processo
+ *
+ * @param[in] magic    HANDOVER_MAGIC
+ * @param[in] nclients numero di client connessi
+ * @param[in] nusers   numero di utenti registrati
+ * @param[in] stats    statistiche del server
+ */
+typedef struct handover_hdr_s
+{
+    unsigned int magic;
+    int nclients;
+    int nusers;
+    struct statistics stats;
+} handover_hdr_t;
+
+/**
+ * @typedef handover_user_t
+ * @brief Ridefinizione della struttura handover_user_s
+ *
+ * @struct handover_user_s
+ * @brief Utente registrato e stato della sua history
+ *
+ * @param[in] name   nickname dell'utente
+ * @param[in] fd     descrittore del client nel vecchio processo
+ * @param[in] online flag che indica se l'utente è connesso
+ * @param[in] qlen   numero di messaggi nella history
+ * @param[in] qcurr  posizione dell'ultimo messaggio inserito
+ * @param[in] qmax   dimensione massima della history
+ */
+typedef struct handover_user_s
+{
+    char name[MAX_NAME_LENGTH+1];
+    int fd;
+    int online;
+    unsigned long qlen;
+    unsigned int qcurr;
+    unsigned int qmax;
+} handover_user_t;
+
+/**
+ * @function handover_listen
+ * @brief Crea il socket su cui il server attende un nuovo processo
+ *
+ * @param[in] path percorso del socket
+ *
+ * @return descrittore del socket in ascolto.
+ * @return -1 in caso di errore (errno settato).
+ */
+int handover_listen(const char *path);
+
+/**
+ * @function handover_connect
+ * @brief Si connette al server in esecuzione, riprovando per HANDOVER_RETRIES secondi
+ *
+ * @param[in] path percorso del socket
+ *
+ * @return descrittore della connessione.
+ * @return -1 in caso di errore (errno settato).
+ */
+int handover_connect(const char *path);
+
+/**
+ * @function handover_send
+ * @brief Invia al nuovo processo il socket di connessione, i client e lo stato del server
+ *
+ * Il server deve essere fermo: nessun thread può accettare connessioni, leggere
+ * dai client o eseguire richieste durante l'invio.
+ *
+ * @param[in] hfd      connessione con il nuovo processo
+ * @param[in] sfd      socket di connessione dei client
+ * @param[in] users    tabella degli utenti registrati
+ * @param[in] stats    statistiche del server
+ * @param[in] conns    buffer di ricezione dei client, indicizzati per descrittore (NULL se il descrittore non è un client)
+ * @param[in] maxconns dimensione di \a conns
+ *
+ * @return 0 se il nuovo processo ha confermato la ricezione.
+ * @return -1 in caso di errore (errno settato): il server può riprendere l'esecuzione.
+ */
+int handover_send(int hfd, int sfd, icl_hash_t *users, struct statistics *stats, connbuf_t **conns, int maxconns);
+
+/**
+ * @function handover_recv
+ * @brief Riceve dal server in esecuzione il socket di connessione, i client e lo stato
+ *
+ * Gli utenti vengono inseriti in \a users (che deve essere vuota), con il descrittore
+ * ricevuto in questo processo; i byte non ancora eseguiti di ogni client vengono
+ * copiati nel suo buffer in \a conns.
+ *
+ * @param[in]  hfd      connessione con il server in esecuzione
+ * @param[out] sfd      socket di connessione dei client
+ * @param[in]  users    tabella degli utenti registrati
+ * @param[out] stats    statistiche del server
+ * @param[in]  conns    buffer di ricezione dei client, indicizzati per descrittore
+ * @param[in]  maxconns dimensione di \a conns
+ * @param[out] fds      descrittori dei client ricevuti (array allocato con malloc)
+ *
+ * @return numero di client ricevuti.
+ * @return -1 in caso di errore (errno settato).
+ */
+int handover_recv(int hfd, int *sfd, icl_hash_t *users, struct statistics *stats, connbuf_t **conns, int maxconns, int **fds);
+
+#endif /* HANDOVER_H_ */
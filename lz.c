@@ -0,0 +1,196 @@
+/*
+ * membox Progetto del corso di LSO 2017/2018
+ *
+ * Dipartimento di Informatica Università di Pisa
+ * Docenti: Prencipe, Torquati
+ *
+ */
+/**
+ * @file lz.c
+ * @author Jacopo Massa 543870 \n( <mailto:jacopomassa97@gmail.com> )
+ * @brief Implementazione delle funzioni del file lz.h
+ * @copyright **Si dichiara che il contenuto di questo file è in ogni sua parte opera
+       originale dell'autore**
+ * @see lz.h
+ */
+
+#include <stdint.h>
+#include <string.h>
+
+#include <lz.h>
+
+/**
+ * @function lz_read32
+ * @brief Legge 4 byte non allineati
+ */
+static inline uint32_t lz_read32(const unsigned char *p)
+{
+    uint32_t v;
+    memcpy(&v,p,sizeof(v));
+    return v;
+}
+
+/**
+ * @function lz_hash
+ * @brief Posizione nella tabella hash di una sequenza di 4 byte
+ */
+static inline unsigned int lz_hash(uint32_t v)
+{
+    return (unsigned int)((v * 2654435761U) >> (32 - LZ_HASHLOG));
+}
+
+/**
+ * @function lz_putLength
+ * @brief Scrive la parte di una lunghezza che non entra nei 4 bit del token (byte a 255 e resto)
+ * @return posizione successiva all'ultimo byte scritto.
+ */
+static inline unsigned char *lz_putLength(unsigned char *op, size_t len)
+{
+    for(len -= 15; len >= 255; len -= 255)
+        *op++ = 255;
+    *op++ = (unsigned char)len;
+    return op;
+}
+
+/**
+ * @function lz_getLength
+ * @brief Legge il seguito di una lunghezza il cui token vale 15 (vedi lz_putLength)
+ * @return 0 in caso di successo, -1 se il blocco termina prima della lunghezza.
+ */
+static inline int lz_getLength(const unsigned char **ip, const unsigned char *iend, size_t *len)
+{
+    unsigned char b;
+
+    do
+    {
+        if(*ip >= iend)
+            return -1;
+        b = *(*ip)++;
+        *len += b;
+    } while(b == 255);
+
+    return 0;
+}
+
+/**
+ * @function lz_putSequence
+ * @brief Scrive una sequenza: token, letterali e, se \a mlen >= LZ_MINMATCH, il match
+ * @return posizione successiva all'ultimo byte scritto.
+ */
+static unsigned char *lz_putSequence(unsigned char *op, const unsigned char *lit, size_t nlit, size_t offset, size_t mlen)
+{
+    unsigned char *token = op++;
+    size_t m = (mlen >= LZ_MINMATCH) ? mlen - LZ_MINMATCH : 0;
+
+    *token = (unsigned char)(((nlit >= 15) ? 15 : nlit) << 4);
+    if(nlit >= 15)
+        op = lz_putLength(op,nlit);
+    memcpy(op,lit,nlit);
+    op += nlit;
+
+    // l'ultima sequenza del blocco ha solo letterali
+    if(mlen < LZ_MINMATCH)
+        return op;
+
+    *op++ = (unsigned char)(offset & 0xff);
+    *op++ = (unsigned char)(offset >> 8);
+    *token |= (unsigned char)((m >= 15) ? 15 : m);
+    if(m >= 15)
+        op = lz_putLength(op,m);
+    return op;
+}
+
+size_t lz_compress(const char *src, size_t n, char *dst, size_t cap)
+{
+    uint32_t table[1 << LZ_HASHLOG];
+    const unsigned char *base = (const unsigned char*) src, *end = base + n;
+    const unsigned char *ip = base, *anchor = base, *ref, *mp, *rp;
+    unsigned char *op = (unsigned char*) dst;
+    uint32_t seq;
+    unsigned int h;
+
+    // con lo spazio per il caso peggiore le scritture non vanno controllate
+    if(cap < lz_bound(n) || n > UINT32_MAX)
+        return 0;
+
+    if(n > LZ_MFLIMIT)
+    {
+        memset(table,0,sizeof(table));
+        for(ip++; ip < end - LZ_MFLIMIT; )
+        {
+            seq = lz_read32(ip);
+            h = lz_hash(seq);
+            ref = base + table[h];
+            table[h] = (uint32_t)(ip - base);
+
+            if(ref >= ip || ip - ref > LZ_MAXOFFSET || lz_read32(ref) != seq)
+            {
+                // più a lungo non trovo match, più velocemente avanzo: i dati incomprimibili costano poco
+                ip += 1 + ((size_t)(ip - anchor) >> 6);
+                continue;
+            }
+
+            // estendo il match all'indietro sui letterali in attesa, e in avanti fino agli ultimi letterali
+            while(ip > anchor && ref > base && ip[-1] == ref[-1])
+            {
+                ip--;
+                ref--;
+            }
+            for(mp = ip + LZ_MINMATCH, rp = ref + LZ_MINMATCH; mp < end - LZ_LASTLITERALS && *mp == *rp; mp++, rp++);
+
+            op = lz_putSequence(op,anchor,(size_t)(ip - anchor),(size_t)(ip - ref),(size_t)(mp - ip));
+            ip = anchor = mp;
+        }
+    }
+
+    op = lz_putSequence(op,anchor,(size_t)(end - anchor),0,0);
+    return (size_t)(op - (unsigned char*) dst);
+}
+
+int lz_decompress(const char *src, size_t n, char *dst, size_t len)
+{
+    const unsigned char *ip = (const unsigned char*) src, *iend = ip + n;
+    unsigned char *op = (unsigned char*) dst, *oend = op + len, *ref;
+    size_t nlit, mlen, offset;
+    unsigned char token;
+
+    for(;;)
+    {
+        if(ip >= iend)
+            return -1;
+        token = *ip++;
+
+        nlit = token >> 4;
+        if(nlit == 15 && lz_getLength(&ip,iend,&nlit) == -1)
+            return -1;
+        if(nlit > (size_t)(iend - ip) || nlit > (size_t)(oend - op))
+            return -1;
+        memcpy(op,ip,nlit);
+        op += nlit;
+        ip += nlit;
+
+        // il blocco termina con una sequenza di soli letterali
+        if(ip == iend)
+            break;
+
+        if(iend - ip < 2)
+            return -1;
+        offset = (size_t)ip[0] | ((size_t)ip[1] << 8);
+        ip += 2;
+        if(offset == 0 || offset > (size_t)(op - (unsigned char*) dst))
+            return -1;
+
+        mlen = token & 15;
+        if(mlen == 15 && lz_getLength(&ip,iend,&mlen) == -1)
+            return -1;
+        mlen += LZ_MINMATCH;
+        if(mlen > (size_t)(oend - op))
+            return -1;
+
+        // copia byte per byte: il match può sovrapporsi ai byte che sta producendo
+        for(ref = op - offset; mlen > 0; mlen--)
+            *op++ = *ref++;
+    }
+
+    return (op == oend) ? 0 : -1;
+}
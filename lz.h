@@ -0,0 +1,71 @@
+/*
+ * membox Progetto del corso di LSO 2017/2018
+ *
+ * Dipartimento di Informatica Università di Pisa
+ * Docenti: Prencipe, Torquati
+ *
+ */
+/**
+ * @file lz.h
+ * @author Jacopo Massa 543870 \n( <mailto:jacopomassa97@gmail.com> )
+ * @brief Compressione veloce di blocchi di byte, nel formato dei blocchi LZ4
+ *
+ * Un blocco è una sequenza di letterali (byte copiati) e di match (copie di byte già
+ * prodotti, entro LZ_MAXOFFSET byte all'indietro). Il compressore cerca i match con una
+ * tabella hash di sequenze di 4 byte: è pensato per la velocità, non per il rapporto
+ * di compressione, che sui testi e sui log resta comunque alto.
+ * @copyright **Si dichiara che il contenuto di questo file è in ogni sua parte opera
+       originale dell'autore**
+ */
+
+#ifndef LZ_H_
+#define LZ_H_
+
+#include <stddef.h>
+
+#define LZ_MINMATCH     4     /**< lunghezza minima di un match. */
+#define LZ_LASTLITERALS 5     /**< byte finali di un blocco che sono sempre letterali. */
+#define LZ_MFLIMIT      12    /**< distanza minima dalla fine del blocco a cui può iniziare un match. */
+#define LZ_MAXOFFSET    65535 /**< distanza massima fra un match e i byte che copia. */
+#define LZ_HASHLOG      12    /**< logaritmo del numero di posizioni nella tabella hash del compressore. */
+
+/**
+ * @function lz_bound
+ * @brief Dimensione massima di un blocco compresso
+ *
+ * @param[in] n byte da comprimere
+ *
+ * @return byte sufficienti a comprimere \a n byte qualsiasi.
+ */
+static inline size_t lz_bound(size_t n) { return n + n/255 + 16; }
+
+/**
+ * @function lz_compress
+ * @brief Comprime un blocco di byte
+ *
+ * @param[in]  src byte da comprimere
+ * @param[in]  n   numero di byte di \a src
+ * @param[out] dst blocco compresso
+ * @param[in]  cap dimensione di \a dst (almeno lz_bound(\a n))
+ *
+ * @return dimensione del blocco compresso, 0 se \a cap non è sufficiente.
+ */
+size_t lz_compress(const char *src, size_t n, char *dst, size_t cap);
+
+/**
+ * @function lz_decompress
+ * @brief Decomprime un blocco prodotto da lz_compress
+ *
+ * Il blocco viene controllato: dati corrotti o di lunghezza diversa da quella attesa
+ * non fanno mai leggere o scrivere fuori dai buffer.
+ *
+ * @param[in]  src blocco compresso
+ * @param[in]  n   dimensione del blocco
+ * @param[out] dst byte decompressi
+ * @param[in]  len numero esatto di byte che il blocco deve produrre
+ *
+ * @return 0 in caso di successo, -1 se il blocco non è valido.
+ */
+int lz_decompress(const char *src, size_t n, char *dst, size_t len);
+
+#endif /* LZ_H_ */
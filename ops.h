@@ -42,6 +42,8 @@ typedef enum {
     /* 
      * aggiungere qui eltre operazioni che si vogliono implementare 
      */
+    POSTTXTLIST_OP   = 13,  /**<  richiesta di invio di un messaggio testuale a una lista di nickname
+                                  (nel buffer: i nickname terminati da '\0', un nickname vuoto, poi il testo) */
 
     /* ------------------------------------------ */
     /*    messaggi inviati dal server             */
@@ -56,6 +58,7 @@ typedef enum {
     OP_NICK_UNKNOWN = 27,  /**<  nickname non riconosciuto */
     OP_MSG_TOOLONG  = 28,  /**<  messaggio con size troppo lunga */
     OP_NO_SUCH_FILE = 29,  /**<  il file richiesto non esiste */
+    OP_SERVER_BUSY  = 30,  /**<  server sovraccarico, la richiesta non è stata eseguita */
     
 
     /* 
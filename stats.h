@@ -28,6 +28,8 @@ struct statistics {
     unsigned long nfiledelivered;               /**< numero di file consegnati */
     unsigned long nfilenotdelivered;            /**< numero di file non ancora consegnati */
     unsigned long nerrors;                      /**< numero di messaggi di errore */
+    unsigned long nbusy;                        /**< numero di richieste rifiutate con OP_SERVER_BUSY */
+    unsigned long nthrottled;                   /**< numero di volte in cui il server ha smesso di accettare richieste per sovraccarico */
 };
 
 /* aggiungere qui altre funzioni di utilita' per le statistiche */
@@ -45,7 +47,7 @@ static inline int printStats(FILE *fout)
 {
     extern struct statistics chattyStats;
 
-    if (fprintf(fout, "%ld - %ld %ld %ld %ld %ld %ld %ld\n",
+    if (fprintf(fout, "%ld - %ld %ld %ld %ld %ld %ld %ld %ld %ld\n",
 		(unsigned long)time(NULL),
 		chattyStats.nusers,
 		chattyStats.nonline,
@@ -53,7 +55,9 @@ static inline int printStats(FILE *fout)
 		chattyStats.nnotdelivered,
 		chattyStats.nfiledelivered,
 		chattyStats.nfilenotdelivered,
-		chattyStats.nerrors
+		chattyStats.nerrors,
+		chattyStats.nbusy,
+		chattyStats.nthrottled
 		) < 0) return -1;
     fflush(fout);
     return 0;
@@ -120,6 +120,24 @@ if [[ $md5lib != $md53 ]]; then
     exit 1
 fi
 
+# messaggio a una lista di destinatari con un duplicato e un nickname inesistente:
+# ogni destinatario lo riceve una volta sola e l'errore viene comunque restituito
+OP_NICK_UNKNOWN=27
+
+./client -l $1 -k topolino -S "lista da topolino":qui,quo,qui,nessuno
+e=$?
+if [[ $((256-e)) != $OP_NICK_UNKNOWN ]]; then
+    echo "Errore non corrispondente $e"
+    exit 1
+fi
+for nick in qui quo; do
+    n=$(./client -l $1 -k $nick -p | grep -c "\[topolino:\] lista da topolino")
+    if [[ $n != 1 ]]; then
+        echo "$nick ha ricevuto $n copie del messaggio"
+        exit 1
+    fi
+done
+
 echo "Test OK!"
 exit 0
 
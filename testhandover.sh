@@ -0,0 +1,60 @@
+#!/bin/bash
+
+if [[ $# != 2 ]]; then
+    echo "usa $0 unix_path conf_file"
+    exit 1
+fi
+
+# pippo e pluto devono essere gia' registrati (vedi testfile.sh)
+
+# pippo resta connesso durante la sostituzione del server e deve ricevere 2 messaggi
+./client -l $1 -k pippo -R 2 &
+pid=$!
+
+# aspetto un po' per essere sicuro che il client sia partito
+sleep 1
+
+# primo messaggio, ricevuto dal server in esecuzione
+./client -l $1 -k pluto -S "prima della sostituzione":pippo
+if [[ $? != 0 ]]; then
+    exit 1
+fi
+
+# un nuovo processo subentra al server, che termina dopo avergli passato client e stato
+vecchio=$(pidof chatty)
+./chatty -f $2 -u &
+
+for ((i=0;i<50;++i)); do
+    if ! kill -0 $vecchio 2> /dev/null; then
+        break
+    fi
+    sleep 0.2
+done
+if kill -0 $vecchio 2> /dev/null; then
+    echo "Il server $vecchio non e' stato sostituito"
+    exit 1
+fi
+
+# secondo messaggio, ricevuto dal nuovo processo e consegnato a pippo sulla stessa connessione
+./client -l $1 -k pluto -S "dopo la sostituzione":pippo
+if [[ $? != 0 ]]; then
+    exit 1
+fi
+
+wait $pid
+if [[ $? != 0 ]]; then
+    echo "pippo non ha ricevuto i messaggi durante la sostituzione"
+    exit 1
+fi
+
+# la history di pippo contiene entrambi i messaggi
+for msg in "prima della sostituzione" "dopo la sostituzione"; do
+    n=$(./client -l $1 -k pippo -p | grep -c "\[pluto:\] $msg")
+    if [[ $n != 1 ]]; then
+        echo "Messaggio '$msg' trovato $n volte nella history di pippo"
+        exit 1
+    fi
+done
+
+echo "Test OK!"
+exit 0
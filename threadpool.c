@@ -14,195 +14,874 @@
  * @see threadpool.h
  */
 
+#define _POSIX_C_SOURCE 200809L
+#define _GNU_SOURCE // syscall, pthread_setaffinity_np
 #include <stdlib.h>
 #include <pthread.h>
 #include <unistd.h>
+#include <time.h>
+#include <limits.h>
+#include <errno.h>
+#include <sched.h>
+#include <sys/syscall.h>
+#include <sys/mman.h>
+#include <linux/futex.h>
 
 #include <threadpool.h>
 #include <utility.h>
 #include <string.h>
 
+/**
+ * @function threadpool_futex
+ * @brief Esegue un'operazione FUTEX_WAIT o FUTEX_WAKE privata al processo su \a addr
+ *
+ * @return risultato della system call (-1 con errno ETIMEDOUT se l'attesa è scaduta).
+ */
+static inline long threadpool_futex(int *addr, int op, int val, const struct timespec *timeout)
+{
+    return syscall(SYS_futex, addr, op | FUTEX_PRIVATE_FLAG, val, timeout, NULL, 0);
+}
+
+/**
+ * @function threadpool_now
+ * @brief Restituisce l'istante attuale in millisecondi, con la precisione del tick del kernel
+ */
+static inline long threadpool_now(void)
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC_COARSE,&ts);
+    return ts.tv_sec * 1000 + ts.tv_nsec / 1000000;
+}
+
+static void threadpool_grow(threadpool_t *pool);
+
+static __thread threadpool_worker_t *self = NULL; /**< stato del thread del pool chiamante (NULL se non è un thread del pool in modalità work stealing) */
+
+/**
+ * @function ring_init
+ * @brief Alloca una coda di \a size lavori (potenza di 2), con tutti gli slot liberi
+ *
+ * @return 0 in caso di successo, -1 in caso di errore.
+ */
+static int ring_init(threadpool_ring_t *ring, unsigned long size)
+{
+    unsigned long i;
+
+    ring->head = ring->tail = 0;
+    ring->size = size;
+    if((ring->slots = (threadpool_task_t *)malloc(sizeof(threadpool_task_t) * size)) == NULL)
+        return -1;
+
+    ring->mapped = 0;
+
+    // ogni slot è inizialmente libero per la posizione corrispondente
+    for(i = 0; i < size; i++)
+        ring->slots[i].seq = i;
+    return 0;
+}
+
+/**
+ * @function ring_init_on
+ * @brief Come ring_init, ma con le pagine della coda sul nodo NUMA della CPU \a cpu
+ *
+ * Il kernel colloca una pagina sul nodo del thread che la scrive per primo: le
+ * pagine vengono prese con mmap (mai toccate prima, a differenza della memoria
+ * riusata da malloc) e inizializzate dopo aver spostato il thread chiamante su \a cpu.
+ *
+ * @return 0 in caso di successo, -1 in caso di errore.
+ */
+static int ring_init_on(threadpool_ring_t *ring, unsigned long size, int cpu)
+{
+    cpu_set_t old, set;
+    unsigned long i, bytes = sizeof(threadpool_task_t) * size;
+    void *slots;
+
+    if(cpu < 0 || pthread_getaffinity_np(pthread_self(),sizeof(old),&old) != 0)
+        return ring_init(ring,size);
+
+    if((slots = mmap(NULL,bytes,PROT_READ|PROT_WRITE,MAP_PRIVATE|MAP_ANONYMOUS,-1,0)) == MAP_FAILED)
+        return -1;
+
+    CPU_ZERO(&set);
+    CPU_SET(cpu,&set);
+    pthread_setaffinity_np(pthread_self(),sizeof(set),&set);
+
+    ring->head = ring->tail = 0;
+    ring->size = size;
+    ring->slots = (threadpool_task_t *)slots;
+    ring->mapped = bytes;
+    for(i = 0; i < size; i++)
+        ring->slots[i].seq = i;
+
+    pthread_setaffinity_np(pthread_self(),sizeof(old),&old);
+    return 0;
+}
+
+/**
+ * @function ring_free
+ * @brief Libera la memoria allocata con ring_init o ring_init_on
+ */
+static void ring_free(threadpool_ring_t *ring)
+{
+    if(ring->slots == NULL)
+        return;
+    if(ring->mapped)
+        munmap(ring->slots,ring->mapped);
+    else
+        free(ring->slots);
+}
+
+/**
+ * @function ring_push
+ * @brief Inserisce un lavoro nella coda, senza bloccarsi
+ *
+ * Il lavoro viene contato in pool->pending prima di essere pubblicato, così il
+ * pool non risulta mai inattivo con un lavoro in sospeso.
+ *
+ * @return 0 in caso di successo, -1 se la coda è piena.
+ */
+static int ring_push(threadpool_t *pool, threadpool_ring_t *ring, void (*function)(void *), void *arg)
+{
+    unsigned long mask = ring->size - 1;
+    unsigned long pos = __atomic_load_n(&ring->tail,__ATOMIC_RELAXED);
+    threadpool_task_t *slot;
+    long dif;
+
+    for(;;)
+    {
+        slot = &ring->slots[pos & mask];
+        dif = (long)__atomic_load_n(&slot->seq,__ATOMIC_ACQUIRE) - (long)pos;
+
+        if(dif == 0)
+        {
+            // lo slot è libero per la posizione pos: provo a prenotarlo
+            if(__atomic_compare_exchange_n(&ring->tail,&pos,pos+1,1,__ATOMIC_RELAXED,__ATOMIC_RELAXED))
+                break;
+        }
+        else if(dif < 0)
+            return -1; // lo slot contiene ancora un lavoro del giro precedente
+        else
+            pos = __atomic_load_n(&ring->tail,__ATOMIC_RELAXED); // un altro thread mi ha preceduto
+    }
+
+    __atomic_add_fetch(&pool->pending,1,__ATOMIC_RELAXED);
+
+    slot->function = function;
+    slot->arg = arg;
+    if(pool->min_threads < pool->max_threads)
+        slot->when = threadpool_now();
+    __atomic_store_n(&slot->seq,pos + 1,__ATOMIC_SEQ_CST);
+    return 0;
+}
+
+/**
+ * @function ring_pop
+ * @brief Estrae un lavoro dalla coda, senza bloccarsi
+ *
+ * @param[in]  ring coda da cui estrarre
+ * @param[out] task lavoro estratto
+ *
+ * @return 1 se è stato estratto un lavoro, 0 se la coda è vuota.
+ */
+static int ring_pop(threadpool_ring_t *ring, threadpool_task_t *task)
+{
+    unsigned long mask = ring->size - 1;
+    unsigned long pos = __atomic_load_n(&ring->head,__ATOMIC_RELAXED);
+    threadpool_task_t *slot;
+    long dif;
+
+    for(;;)
+    {
+        slot = &ring->slots[pos & mask];
+        dif = (long)__atomic_load_n(&slot->seq,__ATOMIC_ACQUIRE) - (long)(pos + 1);
+
+        if(dif == 0)
+        {
+            // lo slot contiene il lavoro in posizione pos: provo a prenotarlo
+            if(__atomic_compare_exchange_n(&ring->head,&pos,pos+1,1,__ATOMIC_RELAXED,__ATOMIC_RELAXED))
+                break;
+        }
+        else if(dif < 0)
+            return 0; // nessun lavoro pubblicato in questa posizione
+        else
+            pos = __atomic_load_n(&ring->head,__ATOMIC_RELAXED); // un altro thread mi ha preceduto
+    }
+
+    task->function = slot->function;
+    task->arg = slot->arg;
+    task->when = slot->when;
+
+    // libero lo slot per il giro successivo della coda
+    __atomic_store_n(&slot->seq,pos + mask + 1,__ATOMIC_RELEASE);
+    return 1;
+}
+
+/**
+ * @function ring_push_batch
+ * @brief Inserisce fino a \a n lavori nella coda con una sola CAS su tail
+ *
+ * Vengono prenotati solo gli slot consecutivi già liberi per il giro corrente:
+ * nessun altro produttore può prenderli senza far fallire la CAS, e i consumatori
+ * non toccano gli slot liberi.
+ *
+ * @return numero di lavori inseriti (0 se la coda è piena).
+ */
+static int ring_push_batch(threadpool_t *pool, threadpool_ring_t *ring, void (*function)(void *), void **args, int n)
+{
+    unsigned long mask = ring->size - 1;
+    unsigned long pos = __atomic_load_n(&ring->tail,__ATOMIC_RELAXED);
+    long dif;
+    int i, m;
+
+    for(;;)
+    {
+        for(m = 0; m < n && (unsigned long)m <= mask; m++)
+        {
+            if(__atomic_load_n(&ring->slots[(pos + m) & mask].seq,__ATOMIC_ACQUIRE) != pos + m)
+                break;
+        }
+
+        if(m > 0)
+        {
+            // prenoto in blocco gli m slot liberi
+            if(__atomic_compare_exchange_n(&ring->tail,&pos,pos+m,1,__ATOMIC_RELAXED,__ATOMIC_RELAXED))
+                break;
+            continue;
+        }
+
+        dif = (long)__atomic_load_n(&ring->slots[pos & mask].seq,__ATOMIC_ACQUIRE) - (long)pos;
+        if(dif < 0)
+            return 0; // coda piena
+        pos = __atomic_load_n(&ring->tail,__ATOMIC_RELAXED); // un altro thread mi ha preceduto
+    }
+
+    __atomic_add_fetch(&pool->pending,m,__ATOMIC_RELAXED);
+
+    for(i = 0; i < m; i++)
+    {
+        threadpool_task_t *slot = &ring->slots[(pos + i) & mask];
+        slot->function = function;
+        slot->arg = args[i];
+        if(pool->min_threads < pool->max_threads)
+            slot->when = threadpool_now();
+        __atomic_store_n(&slot->seq,pos + i + 1,__ATOMIC_SEQ_CST);
+    }
+    return m;
+}
+
+/**
+ * @function ring_pop_batch
+ * @brief Estrae fino a \a k lavori consecutivi dalla coda con una sola CAS su head
+ *
+ * Con \a share viene estratta solo metà dei lavori pubblicati (almeno uno): gli
+ * altri restano agli altri thread, risvegliati per la stessa raffica.
+ *
+ * @param[in]  ring  coda da cui estrarre
+ * @param[out] tasks lavori estratti, nell'ordine della coda
+ * @param[in]  k     numero massimo di lavori da estrarre
+ * @param[in]  share flag che indica che altri thread possono servire la coda
+ *
+ * @return numero di lavori estratti (0 se la coda è vuota).
+ */
+static int ring_pop_batch(threadpool_ring_t *ring, threadpool_task_t *tasks, int k, int share)
+{
+    unsigned long mask = ring->size - 1;
+    unsigned long pos = __atomic_load_n(&ring->head,__ATOMIC_RELAXED);
+    threadpool_task_t *slot;
+    long dif;
+    int i, m;
+
+    for(;;)
+    {
+        for(m = 0; m < k && (unsigned long)m <= mask; m++)
+        {
+            if(__atomic_load_n(&ring->slots[(pos + m) & mask].seq,__ATOMIC_ACQUIRE) != pos + m + 1)
+                break;
+        }
+
+        if(m > 0)
+        {
+            if(share)
+                m -= m / 2;
+            // i lavori pubblicati non possono sparire senza che head avanzi e la CAS fallisca
+            if(__atomic_compare_exchange_n(&ring->head,&pos,pos+m,1,__ATOMIC_RELAXED,__ATOMIC_RELAXED))
+                break;
+            continue;
+        }
+
+        dif = (long)__atomic_load_n(&ring->slots[pos & mask].seq,__ATOMIC_ACQUIRE) - (long)(pos + 1);
+        if(dif < 0)
+            return 0; // nessun lavoro pubblicato in questa posizione
+        pos = __atomic_load_n(&ring->head,__ATOMIC_RELAXED); // un altro thread mi ha preceduto
+    }
+
+    for(i = 0; i < m; i++)
+    {
+        slot = &ring->slots[(pos + i) & mask];
+        tasks[i].function = slot->function;
+        tasks[i].arg = slot->arg;
+        tasks[i].when = slot->when;
+        __atomic_store_n(&slot->seq,pos + i + mask + 1,__ATOMIC_RELEASE);
+    }
+    return m;
+}
+
+/**
+ * @function ring_ready
+ * @brief Controlla se in testa alla coda c'è un lavoro già pubblicato
+ */
+static int ring_ready(threadpool_ring_t *ring)
+{
+    unsigned long pos = __atomic_load_n(&ring->head,__ATOMIC_SEQ_CST);
+    threadpool_task_t *slot = &ring->slots[pos & (ring->size - 1)];
+
+    return __atomic_load_n(&slot->seq,__ATOMIC_SEQ_CST) == pos + 1;
+}
+
+/**
+ * @function threadpool_lane
+ * @brief Sceglie la corsia da cui il thread \a w prova per prima a estrarre un lavoro
+ *
+ * Su ogni ciclo di THREADPOOL_WEIGHT_HIGH + THREADPOOL_WEIGHT_NORMAL + THREADPOOL_WEIGHT_LOW
+ * estrazioni, ogni corsia è la preferita per un numero di volte pari al proprio peso:
+ * anche la corsia a priorità più bassa viene servita almeno una volta per ciclo.
+ */
+static inline int threadpool_lane(threadpool_worker_t *w)
+{
+    unsigned int t = w->tick++ % (THREADPOOL_WEIGHT_HIGH + THREADPOOL_WEIGHT_NORMAL + THREADPOOL_WEIGHT_LOW);
+
+    if(t < THREADPOOL_WEIGHT_HIGH)
+        return threadpool_lane_high;
+    if(t < THREADPOOL_WEIGHT_HIGH + THREADPOOL_WEIGHT_NORMAL)
+        return threadpool_lane_normal;
+    return threadpool_lane_low;
+}
+
+/**
+ * @function threadpool_pop_lane
+ * @brief Estrae un gruppo di lavori dalla corsia \a lane (per la corsia normale, prima dalla coda del thread)
+ *
+ * I lavori estratti vanno in w->batch; il primo viene restituito in \a task.
+ */
+static inline int threadpool_pop_lane(threadpool_t *pool, threadpool_worker_t *w, int lane, threadpool_task_t *task)
+{
+    int share = (__atomic_load_n(&pool->thread_count,__ATOMIC_RELAXED) > 1);
+
+    w->nbatch = 0;
+    if(lane == threadpool_lane_normal && (pool->flags & threadpool_stealing))
+        w->nbatch = ring_pop_batch(&w->local,w->batch,THREADPOOL_BATCH,share);
+    if(w->nbatch == 0)
+        w->nbatch = ring_pop_batch(&pool->lanes[lane],w->batch,THREADPOOL_BATCH,share);
+    if(w->nbatch == 0)
+        return 0;
+
+    *task = w->batch[0];
+    w->next = 1;
+    return 1;
+}
+
+/**
+ * @function threadpool_pop
+ * @brief Estrae il prossimo lavoro per il thread \a w
+ *
+ * L'ordine è: i lavori già estratti in blocco, la corsia scelta da threadpool_lane,
+ * le altre corsie in ordine di priorità, le code degli altri thread a partire da
+ * una vittima casuale (da cui si ruba un lavoro alla volta).
+ * La coda del thread fa parte della corsia normale.
+ *
+ * @param[in]  pool threadpool da cui estrarre
+ * @param[in]  w    stato del thread
+ * @param[out] task lavoro estratto
+ *
+ * @return 1 se è stato estratto un lavoro, 0 se tutte le code sono vuote.
+ */
+static int threadpool_pop(threadpool_t *pool, threadpool_worker_t *w, threadpool_task_t *task)
+{
+    int i, victim, lane;
+
+    // prima i lavori rimasti dall'ultima estrazione in blocco
+    if(w->next < w->nbatch)
+    {
+        *task = w->batch[w->next++];
+        return 1;
+    }
+
+    lane = threadpool_lane(w);
+
+    if(threadpool_pop_lane(pool,w,lane,task))
+        return 1;
+
+    for(i = 0; i < THREADPOOL_LANES; i++)
+    {
+        if(i != lane && threadpool_pop_lane(pool,w,i,task))
+            return 1;
+    }
+
+    if(!(pool->flags & threadpool_stealing) || pool->nworkers == 1)
+        return 0;
+
+    // xorshift: basta che thread diversi non scelgano tutti la stessa vittima
+    w->seed ^= w->seed << 13;
+    w->seed ^= w->seed >> 17;
+    w->seed ^= w->seed << 5;
+    victim = w->seed % pool->nworkers;
+
+    for(i = 0; i < pool->nworkers; i++, victim = (victim + 1) % pool->nworkers)
+    {
+        if(victim != w->id && ring_pop(&pool->workers[victim].local,task))
+            return 1;
+    }
+    return 0;
+}
+
+/**
+ * @function threadpool_ready
+ * @brief Controlla se in una delle code del pool c'è un lavoro già pubblicato
+ */
+static int threadpool_ready(threadpool_t *pool)
+{
+    int i;
+
+    for(i = 0; i < THREADPOOL_LANES; i++)
+    {
+        if(ring_ready(&pool->lanes[i]))
+            return 1;
+    }
+
+    for(i = 0; (pool->flags & threadpool_stealing) && i < pool->nworkers; i++)
+    {
+        if(ring_ready(&pool->workers[i].local))
+            return 1;
+    }
+    return 0;
+}
+
+/**
+ * @function threadpool_notify
+ * @brief Risveglia fino a \a n thread sospesi, se ce ne sono (vedi threadpool_park)
+ *
+ * Se nessun thread è sospeso e i lavori accodati superano THREADPOOL_GROW_DEPTH
+ * per thread, il pool viene ingrandito.
+ *
+ * @param[in] pool threadpool a cui sono stati aggiunti dei lavori
+ * @param[in] n    numero di lavori aggiunti
+ */
+static void threadpool_notify(threadpool_t *pool, int n)
+{
+    int count;
+
+    __atomic_thread_fence(__ATOMIC_SEQ_CST);
+    if(__atomic_load_n(&pool->sleepers,__ATOMIC_SEQ_CST) > 0)
+    {
+        __atomic_add_fetch(&pool->epoch,1,__ATOMIC_SEQ_CST);
+        threadpool_futex(&pool->epoch,FUTEX_WAKE,n,NULL);
+        return;
+    }
+
+    // pending conta anche i lavori in esecuzione, al più uno per thread
+    count = __atomic_load_n(&pool->thread_count,__ATOMIC_RELAXED);
+    if(count < pool->max_threads &&
+       __atomic_load_n(&pool->pending,__ATOMIC_RELAXED) > count * (THREADPOOL_GROW_DEPTH + 1))
+        threadpool_grow(pool);
+}
+
+/**
+ * @function threadpool_park
+ * @brief Sospende il thread chiamante finché non viene aggiunto un lavoro o il pool termina
+ *
+ * Il thread si annuncia in sleepers prima di ricontrollare le code: un produttore
+ * che pubblica un lavoro dopo il controllo vede sleepers > 0 e incrementa epoch,
+ * quindi la FUTEX_WAIT ritorna subito invece di perdere il risveglio.
+ * Qualunque thread risvegliato può eseguire il lavoro, anche se è nella coda di un altro.
+ *
+ * @param[in] pool    threadpool del thread
+ * @param[in] timeout durata massima dell'attesa (NULL = illimitata)
+ *
+ * @return 1 se l'attesa è scaduta senza che arrivasse un lavoro, 0 altrimenti.
+ */
+static int threadpool_park(threadpool_t *pool, const struct timespec *timeout)
+{
+    int epoch = __atomic_load_n(&pool->epoch,__ATOMIC_ACQUIRE);
+    int expired = 0;
+
+    __atomic_add_fetch(&pool->sleepers,1,__ATOMIC_SEQ_CST);
+
+    if(!threadpool_ready(pool) && !__atomic_load_n(&pool->shutdown,__ATOMIC_SEQ_CST))
+    {
+        if(threadpool_futex(&pool->epoch,FUTEX_WAIT,epoch,timeout) == -1 && errno == ETIMEDOUT)
+            expired = !threadpool_ready(pool);
+    }
+
+    __atomic_sub_fetch(&pool->sleepers,1,__ATOMIC_RELAXED);
+    return expired;
+}
+
+/**
+ * @function threadpool_retire
+ * @brief Decide se un thread rimasto inattivo per THREADPOOL_SHRINK_IDLE secondi può terminare
+ *
+ * @return 1 se il thread deve terminare (è già stato tolto da thread_count), 0 se il pool è già al minimo.
+ */
+static int threadpool_retire(threadpool_t *pool)
+{
+    int count = __atomic_load_n(&pool->thread_count,__ATOMIC_RELAXED);
+
+    while(count > pool->min_threads)
+    {
+        if(__atomic_compare_exchange_n(&pool->thread_count,&count,count-1,1,__ATOMIC_SEQ_CST,__ATOMIC_RELAXED))
+            return 1;
+    }
+    return 0;
+}
+
 /**
  * @function threadpool_thread
  * @brief funzione eseguita da tutti i thread del pool
  *
- * @param[in] threadpool threadpool di cui fa parte il thread
+ * @param[in] arg stato del thread, con il threadpool di cui fa parte
  *
  * @return (void*)NULL.
  */
-static void *threadpool_thread(void *threadpool)
+static void *threadpool_thread(void *arg)
 {
-    threadpool_t *pool = (threadpool_t *)threadpool;
+    threadpool_worker_t *w = (threadpool_worker_t *)arg;
+    threadpool_t *pool = w->pool;
     threadpool_task_t task;
+    struct timespec idle = {THREADPOOL_SHRINK_IDLE, 0};
+    int elastic = (pool->min_threads < pool->max_threads);
+    int shutdown, spin = 0;
+
+    // la coda del thread esiste solo in modalità work stealing
+    if(pool->flags & threadpool_stealing)
+        self = w;
 
     for(;;)
     {
-        // uso la lock per poter attendere sulla variabile di condizione
-        LOCK(pool->lock,"pool->lock in threadpool_thread");
+        shutdown = __atomic_load_n(&pool->shutdown,__ATOMIC_ACQUIRE);
+        if(shutdown == immediate_shutdown)
+            break;
 
-        /* Mi metto in attesa sulla variabile di condizione,
-         * controllando che nel frattempo il pool non stia terminando
-         */
-        while((pool->count == 0) && (!pool->shutdown)) {
-            pthread_cond_wait(&(pool->notify), &(pool->lock));
+        if(threadpool_pop(pool,w,&task))
+        {
+            // il lavoro ha atteso troppo in coda: servono più thread
+            if(elastic && threadpool_now() - task.when > THREADPOOL_GROW_WAIT)
+                threadpool_grow(pool);
+
+            // eseguo il lavoro estratto dalla coda
+            (*(task.function))(task.arg);
+            __atomic_sub_fetch(&pool->pending,1,__ATOMIC_RELEASE);
+            spin = 0;
+            continue;
         }
 
-        // ricontrollo un'eventuale terminazione dopo essere tornato dalla wait
-        if((pool->shutdown == immediate_shutdown) ||
-           ((pool->shutdown == graceful_shutdown) &&
-            (pool->count == 0))) {
+        // code vuote: in caso di terminazione graduale non ci sono più lavori da processare
+        if(shutdown == graceful_shutdown)
             break;
+
+        // riprovo per qualche giro prima di sospendermi, per non pagare una system call a ogni raffica
+        if(spin++ < THREADPOOL_SPIN)
+            continue;
+
+        // un thread in più rispetto al minimo termina dopo THREADPOOL_SHRINK_IDLE secondi senza lavoro
+        if(threadpool_park(pool,(elastic) ? &idle : NULL) && threadpool_retire(pool))
+        {
+            __atomic_store_n(&w->state,threadpool_worker_exited,__ATOMIC_RELEASE);
+            __atomic_sub_fetch(&pool->started,1,__ATOMIC_RELEASE);
+            pthread_exit(NULL);
         }
+        spin = 0;
+    }
+
+    __atomic_sub_fetch(&pool->started,1,__ATOMIC_RELEASE);
+    pthread_exit(NULL);
+}
+
+/**
+ * @function threadpool_spawn
+ * @brief Avvia un thread del pool nello slot \a i di workers
+ *
+ * Va chiamata da un solo thread alla volta (quello che ha ottenuto pool->growing,
+ * o threadpool_create_elastic prima che il pool sia visibile).
+ *
+ * @return 0 in caso di successo, -1 in caso di errore.
+ */
+static int threadpool_spawn(threadpool_t *pool, int i)
+{
+    pthread_attr_t attr, *pattr = NULL;
+    cpu_set_t set;
+    int err;
 
-        // estraggo un lavoro dalla coda condivisa
-        task.function = pool->queue[pool->head].function;
-        task.arg = pool->queue[pool->head].arg;
-        pool->head = (pool->head + 1) % pool->queue_size;
-        pool->count -= 1;
+    // lo slot di un thread terminato per inattività viene riusato dopo averlo atteso
+    if(pool->workers[i].state == threadpool_worker_exited)
+        pthread_join(pool->threads[i], NULL);
 
-        UNLOCK(pool->lock,"pool->lock in threadpool_thread");
+    // il thread nasce già sulla propria CPU, così anche il suo stack è sul nodo giusto
+    if(pool->workers[i].cpu >= 0 && pthread_attr_init(&attr) == 0)
+    {
+        CPU_ZERO(&set);
+        CPU_SET(pool->workers[i].cpu,&set);
+        pthread_attr_setaffinity_np(&attr,sizeof(set),&set);
+        pattr = &attr;
+    }
+
+    pool->workers[i].state = threadpool_worker_running;
+    __atomic_add_fetch(&pool->started,1,__ATOMIC_RELAXED);
+    __atomic_add_fetch(&pool->thread_count,1,__ATOMIC_RELAXED);
 
-        // eseguo il lavoro estratto dalla coda
-        (*(task.function))(task.arg);
+    err = pthread_create(&(pool->threads[i]), pattr, threadpool_thread, (void*)&pool->workers[i]);
+    if(pattr)
+        pthread_attr_destroy(pattr);
+    if(err != 0)
+    {
+        pool->workers[i].state = threadpool_worker_free;
+        __atomic_sub_fetch(&pool->started,1,__ATOMIC_RELAXED);
+        __atomic_sub_fetch(&pool->thread_count,1,__ATOMIC_RELAXED);
+        return -1;
     }
+    return 0;
+}
+
+/**
+ * @function threadpool_grow
+ * @brief Aggiunge un thread al pool, se non ha raggiunto max_threads
+ *
+ * Se un altro thread sta già ingrandendo il pool la chiamata non fa nulla.
+ */
+static void threadpool_grow(threadpool_t *pool)
+{
+    int i, unlocked = 0;
 
-    pool->started--;
+    if(!__atomic_compare_exchange_n(&pool->growing,&unlocked,1,0,__ATOMIC_ACQUIRE,__ATOMIC_RELAXED))
+        return;
 
-    UNLOCK(pool->lock,"pool->lock in threadpool_thread");
-    pthread_exit(NULL);
+    if(!__atomic_load_n(&pool->shutdown,__ATOMIC_ACQUIRE) &&
+       __atomic_load_n(&pool->thread_count,__ATOMIC_RELAXED) < pool->max_threads)
+    {
+        // un thread che ha appena lasciato thread_count può non aver ancora liberato il suo slot
+        for(i = 0; i < pool->nworkers; i++)
+        {
+            if(__atomic_load_n(&pool->workers[i].state,__ATOMIC_ACQUIRE) != threadpool_worker_running)
+            {
+                threadpool_spawn(pool,i);
+                break;
+            }
+        }
+    }
+
+    __atomic_store_n(&pool->growing,0,__ATOMIC_RELEASE);
 }
 
 threadpool_t *threadpool_create(int thread_count, int queue_size)
 {
-    threadpool_t *pool;
+    return threadpool_create_elastic(thread_count, thread_count, queue_size, 0);
+}
+
+threadpool_t *threadpool_create_flags(int thread_count, int queue_size, int flags)
+{
+    return threadpool_create_elastic(thread_count, thread_count, queue_size, flags);
+}
+
+threadpool_t *threadpool_create_elastic(int min_threads, int max_threads, int queue_size, int flags)
+{
+    return threadpool_create_pinned(min_threads, max_threads, queue_size, flags, NULL, 0);
+}
+
+threadpool_t *threadpool_create_pinned(int min_threads, int max_threads, int queue_size, int flags,
+                                       const int *cpus, int ncpus)
+{
+    threadpool_t *pool = NULL;
+    unsigned long size, local = 1;
     int i;
 
-    if(thread_count <= 0 || thread_count > MAX_THREADS || queue_size <= 0 || queue_size > MAX_QUEUE)
+    if(min_threads <= 0 || max_threads < min_threads || max_threads > MAX_THREADS ||
+       queue_size <= 0 || queue_size > MAX_QUEUE || (cpus != NULL && ncpus <= 0))
         return NULL;
 
-    if((pool = (threadpool_t *)malloc(sizeof(threadpool_t))) == NULL)
-        goto err;
+    // le code hanno head e tail su linee di cache diverse: pool e thread vanno allocati allineati
+    if(posix_memalign((void**)&pool, THREADPOOL_CACHELINE, sizeof(threadpool_t)) != 0)
+        return NULL;
+    memset(pool,0,sizeof(threadpool_t));
+
+    // gli indici delle code vengono ridotti con una maschera
+    for(size = 1; size < (unsigned long)queue_size; size <<= 1);
 
     // inizializzo del pool
     pool->thread_count = 0;
-    pool->queue_size = queue_size;
-    pool->head = pool->tail = pool->count = 0;
-    pool->shutdown = pool->started = 0;
-
-    // alloco memoria per i thread e per la coda condivisa
-    pool->threads = (pthread_t *)malloc(sizeof(pthread_t) * thread_count);
-    pool->queue = (threadpool_task_t *)malloc
-        (sizeof(threadpool_task_t) * queue_size);
-
-    /* Inizializzo la mutex e la variabile di condizione */
-    if((pthread_mutex_init(&(pool->lock), NULL) != 0) ||
-       (pthread_cond_init(&(pool->notify), NULL) != 0) ||
-       (pool->threads == NULL) ||
-       (pool->queue == NULL)) {
+    pool->min_threads = min_threads;
+    pool->max_threads = max_threads;
+    pool->queue_size = size;
+    pool->flags = flags;
+    pool->shutdown = pool->started = pool->growing = 0;
+    pool->pending = pool->sleepers = pool->epoch = 0;
+
+    // alloco memoria per tutti i thread che il pool può contenere e per il loro stato
+    if((pool->threads = (pthread_t *)malloc(sizeof(pthread_t) * max_threads)) == NULL)
+        goto err;
+    if(posix_memalign((void**)&pool->workers, THREADPOOL_CACHELINE, sizeof(threadpool_worker_t) * max_threads) != 0)
+    {
+        pool->workers = NULL;
         goto err;
     }
+    memset(pool->workers,0,sizeof(threadpool_worker_t) * max_threads);
+    pool->nworkers = max_threads;
+
+    if(flags & threadpool_stealing)
+    {
+        // metà della capacità resta alla coda condivisa, il resto viene diviso fra i thread
+        for(local = 1; local * max_threads < size / 2; local <<= 1);
+        size = (size > 2) ? size / 2 : size;
+    }
+
+    for(i = 0; i < max_threads; i++)
+    {
+        pool->workers[i].pool = pool;
+        pool->workers[i].id = i;
+        pool->workers[i].seed = 2463534242U + i; // il seme dello xorshift non può essere 0
+        pool->workers[i].cpu = (cpus != NULL) ? cpus[i % ncpus] : -1;
+        if((flags & threadpool_stealing) && ring_init_on(&pool->workers[i].local,local,pool->workers[i].cpu) < 0)
+            goto err;
+    }
+
+    for(i = 0; i < THREADPOOL_LANES; i++)
+    {
+        if(ring_init(&pool->lanes[i],size) < 0)
+            goto err;
+    }
 
-    // faccio partire l'esecuzione di ogni thread con la funzione 'threadpool_thread'
-    for(i = 0; i < thread_count; i++) {
-        if(pthread_create(&(pool->threads[i]), NULL, threadpool_thread, (void*)pool) != 0)
+    // faccio partire l'esecuzione dei primi min_threads thread con la funzione 'threadpool_thread'
+    for(i = 0; i < min_threads; i++) {
+        if(threadpool_spawn(pool,i) < 0)
         {
             threadpool_destroy(pool, 0);
             return NULL;
         }
-        pool->thread_count++;
-        pool->started++;
     }
 
     return pool;
 
  err:
-    if(pool) //in caso di errore libero la memoria allocata
-    {
-        threadpool_free(pool);
-    }
+    threadpool_free(pool); // in caso di errore libero la memoria allocata
     return NULL;
 }
 
 int threadpool_add(threadpool_t *pool, void (*function)(void *), void *arg)
 {
-    int err = 0;
-    int next;
+    return threadpool_add_prio(pool, threadpool_lane_normal, function, arg);
+}
 
-    if(pool == NULL || function == NULL)
+int threadpool_add_prio(threadpool_t *pool, int lane, void (*function)(void *), void *arg)
+{
+    if(pool == NULL || function == NULL || lane < 0 || lane >= THREADPOOL_LANES)
         return threadpool_invalid;
 
-    if(pthread_mutex_lock(&(pool->lock)) != 0)
-        return threadpool_lock_failure;
+    // un thread del pool in modalità work stealing accoda i propri lavori normali nella propria coda
+    if(lane == threadpool_lane_normal && self && self->pool == pool)
+        return threadpool_add_to(pool, self->id, function, arg);
 
-    next = (pool->tail + 1) % pool->queue_size;
+    // controllo che il pool non stia terminando
+    if(__atomic_load_n(&pool->shutdown,__ATOMIC_ACQUIRE))
+        return threadpool_shutdown;
 
-    do
+    if(ring_push(pool,&pool->lanes[lane],function,arg) < 0)
+        return threadpool_queue_full;
+
+    threadpool_notify(pool,1);
+    return 0;
+}
+
+int threadpool_add_to(threadpool_t *pool, unsigned int key, void (*function)(void *), void *arg)
+{
+    if(pool == NULL || function == NULL)
+        return threadpool_invalid;
+
+    // controllo che il pool non stia terminando
+    if(__atomic_load_n(&pool->shutdown,__ATOMIC_ACQUIRE))
+        return threadpool_shutdown;
+
+    // se la coda del thread è piena il lavoro ripiega sulla coda condivisa
+    if(!(pool->flags & threadpool_stealing) || ring_push(pool,&pool->workers[key % pool->nworkers].local,function,arg) < 0)
     {
-        // controllo che la coda di lavori non sia piena
-        if(pool->count == pool->queue_size)
-        {
-            err = threadpool_queue_full;
-            break;
-        }
+        if(ring_push(pool,&pool->lanes[threadpool_lane_normal],function,arg) < 0)
+            return threadpool_queue_full;
+    }
 
-        // controllo che il pool non stia terminando
-        if(pool->shutdown) {
-            err = threadpool_shutdown;
-            break;
-        }
+    threadpool_notify(pool,1);
+    return 0;
+}
+
+int threadpool_add_batch(threadpool_t *pool, int lane, void (*function)(void *), void **args,
+                         const unsigned int *keys, int n)
+{
+    int i, added = 0;
 
-        // aggiungo il lavoro alla coda
-        pool->queue[pool->tail].function = function;
-        pool->queue[pool->tail].arg = arg;
-        pool->tail = next;
-        pool->count += 1;
+    if(pool == NULL || function == NULL || args == NULL || n < 0 || lane < 0 || lane >= THREADPOOL_LANES)
+        return threadpool_invalid;
+
+    // controllo che il pool non stia terminando
+    if(__atomic_load_n(&pool->shutdown,__ATOMIC_ACQUIRE))
+        return threadpool_shutdown;
 
-        // segnalo ai thread del pool che c'è qualcosa nella coda
-        if(pthread_cond_signal(&(pool->notify)) != 0)
+    // con le chiavi ogni lavoro va nella coda del proprio thread, e quelli che non entrano nella corsia condivisa
+    if(keys != NULL && lane == threadpool_lane_normal && (pool->flags & threadpool_stealing))
+    {
+        for(i = 0; i < n; i++)
         {
-            err = threadpool_lock_failure;
-            break;
+            if(ring_push(pool,&pool->workers[keys[i] % pool->nworkers].local,function,args[i]) < 0 &&
+               ring_push(pool,&pool->lanes[lane],function,args[i]) < 0)
+                break;
         }
-    } while(0);
+        added = i;
+    }
+    else
+        added = ring_push_batch(pool,&pool->lanes[lane],function,args,n);
 
-    if(pthread_mutex_unlock(&pool->lock) != 0)
-        err = threadpool_lock_failure;
+    // un solo risveglio per tutto il gruppo, di al più tanti thread quanti sono i lavori
+    if(added > 0)
+        threadpool_notify(pool,added);
+    return added;
+}
 
-    return err;
+int threadpool_pending(threadpool_t *pool)
+{
+    if(pool == NULL)
+        return threadpool_invalid;
+
+    return __atomic_load_n(&pool->pending,__ATOMIC_RELAXED);
 }
 
 int threadpool_destroy(threadpool_t *pool, int flags)
 {
-    int i, err = 0;
+    int i, err = 0, expected = 0;
 
     if(pool == NULL)
         return threadpool_invalid;
 
-    if(pthread_mutex_lock(&(pool->lock)) != 0)
-        return threadpool_lock_failure;
-
     do
     {
         // controllo che il pool non stia terminando
-        if(pool->shutdown)
+        if(!__atomic_compare_exchange_n(&pool->shutdown,&expected,
+                                        (flags & threadpool_graceful) ? graceful_shutdown : immediate_shutdown,
+                                        0,__ATOMIC_SEQ_CST,__ATOMIC_SEQ_CST))
         {
             err = threadpool_shutdown;
             break;
         }
 
-        pool->shutdown = (flags & threadpool_graceful) ?
-            graceful_shutdown : immediate_shutdown;
+        // attendo che un eventuale ingrandimento del pool sia terminato: dopo non ne inizieranno altri
+        while(!__atomic_compare_exchange_n(&pool->growing,&expected,1,0,__ATOMIC_ACQUIRE,__ATOMIC_RELAXED))
+        {
+            expected = 0;
+            sched_yield();
+        }
 
         // risveglio tutti i thread del pool
-        if((pthread_cond_broadcast(&(pool->notify)) != 0) ||
-           (pthread_mutex_unlock(&(pool->lock)) != 0)) {
-            err = threadpool_lock_failure;
-            break;
-        }
+        __atomic_add_fetch(&pool->epoch,1,__ATOMIC_SEQ_CST);
+        threadpool_futex(&pool->epoch,FUTEX_WAKE,INT_MAX,NULL);
 
-        // attendo la terminazione di tutti i thread
-        for(i = 0; i < pool->thread_count; i++) {
-            if(pthread_join(pool->threads[i], NULL) != 0) {
+        // attendo la terminazione di tutti i thread, compresi quelli terminati per inattività
+        for(i = 0; i < pool->nworkers; i++) {
+            if(pool->workers[i].state != threadpool_worker_free &&
+               pthread_join(pool->threads[i], NULL) != 0) {
                 err = threadpool_thread_failure;
             }
         }
@@ -215,26 +894,39 @@ int threadpool_destroy(threadpool_t *pool, int flags)
     return err;
 }
 
+int threadpool_wait(threadpool_t *pool)
+{
+    struct timespec ts = {0, 1000000};
+
+    if(pool == NULL)
+        return threadpool_invalid;
+
+    /* Attesa attiva: viene usata raramente e non deve rallentare l'esecuzione dei lavori.
+     * Un lavoro che ne aggiunge un altro lo conta in pending prima di terminare,
+     * quindi pending arriva a 0 solo quando la coda è vuota e nessun thread lavora. */
+    while(__atomic_load_n(&pool->pending,__ATOMIC_ACQUIRE) != 0)
+        nanosleep(&ts,NULL);
+
+    return 0;
+}
+
 int threadpool_free(threadpool_t *pool)
 {
+    int i;
+
     if(pool == NULL || pool->started > 0) {
         return -1;
     }
 
-    // controllo che effettivamente sono riuscito ad allocare il pool
-    if(pool->threads) {
-        free(pool->threads);
-        free(pool->queue);
-
-        /* Avendo allocato i thread dopo aver inizializzato
-         * la mutex e la variabile di condizione, sono sicuro che esse sono
-         * inizializzate.
-         *
-         * Effettuo una LOCK sulla mutex solo per sicurezza */
-        LOCK(pool->lock,"pool->lock in threadpool free");
-        pthread_mutex_destroy(&(pool->lock));
-        pthread_cond_destroy(&(pool->notify));
+    if(pool->workers)
+    {
+        for(i = 0; i < pool->nworkers; i++)
+            ring_free(&pool->workers[i].local);
+        free(pool->workers);
     }
+    free(pool->threads);
+    for(i = 0; i < THREADPOOL_LANES; i++)
+        ring_free(&pool->lanes[i]);
     free(pool);
     return 0;
 }
@@ -21,6 +21,32 @@
 
 #include <pthread.h>
 
+#define THREADPOOL_CACHELINE 64 /**< dimensione di una linea di cache, per separare gli indici della coda. */
+#define THREADPOOL_SPIN 64 /**< tentativi di estrazione prima che un thread inattivo si sospenda. */
+#define THREADPOOL_GROW_DEPTH 4 /**< lavori in attesa per thread oltre i quali un pool elastico aggiunge un thread. */
+#define THREADPOOL_GROW_WAIT 10 /**< attesa in coda (millisecondi) oltre la quale un pool elastico aggiunge un thread. */
+#define THREADPOOL_SHRINK_IDLE 30 /**< secondi senza lavoro dopo i quali un thread oltre il minimo termina. */
+#define THREADPOOL_LANES 3 /**< numero di corsie di priorità (threadpool_lane_t). */
+#define THREADPOOL_BATCH 8 /**< numero massimo di lavori che un thread estrae da una coda con una sola CAS. */
+#define THREADPOOL_WEIGHT_HIGH 8 /**< estrazioni per ciclo in cui la corsia alta è la preferita. */
+#define THREADPOOL_WEIGHT_NORMAL 4 /**< estrazioni per ciclo in cui la corsia normale è la preferita. */
+#define THREADPOOL_WEIGHT_LOW 1 /**< estrazioni per ciclo in cui la corsia bassa è la preferita. */
+
+/**
+ * @typedef threadpool_lane_t
+ * @brief Ridefinizione della enum threadpool_lane_s
+ */
+/**
+ * @enum threadpool_lane_s
+ * @brief Corsie di priorità dei lavori
+ */
+typedef enum threadpool_lane_s
+{
+    threadpool_lane_high   = 0, /**< lavori brevi e sensibili alla latenza */
+    threadpool_lane_normal = 1, /**< lavori aggiunti con threadpool_add e threadpool_add_to */
+    threadpool_lane_low    = 2  /**< lavori lunghi, come i trasferimenti di file */
+} threadpool_lane_t;
+
 /**
  * @typedef threadpool_task_t
  * @brief Ridefinizione della struttura threadpool_task_s
@@ -28,15 +54,95 @@
  *  @struct threadpool_task_s
  *  @brief Elemento della coda dei lavori
  *
+ *  @param[in] seq      numero di sequenza dello slot: vale la posizione in cui lo slot
+ *                      può essere riempito, più uno quando contiene un lavoro
  *  @param[in] function puntatore alla funzione che dovrà essere eseguita
  *  @param[in] argument argomento da passare a function
+ *  @param[in] when     istante di inserimento in millisecondi (solo nei pool elastici)
  */
 typedef struct threadpool_task_s
 {
+    unsigned long seq;
     void (*function)(void *);
     void *arg;
+    long when;
 } threadpool_task_t;
 
+/**
+ * @typedef threadpool_ring_t
+ * @brief Ridefinizione della struttura threadpool_ring_s
+ *
+ *  @struct threadpool_ring_s
+ *  @brief Coda di lavori limitata e senza lock (algoritmo di Vyukov)
+ *
+ *  Produttori e consumatori si contendono solo tail e head con una CAS, e ogni
+ *  slot indica con il proprio numero di sequenza se è libero o pieno.
+ *
+ *  @param[in] slots coda contenente i lavori da eseguire
+ *  @param[in] size  grandezza della coda (potenza di 2)
+ *  @param[in] mapped byte di slots allocati con mmap (0 se allocati con malloc)
+ *  @param[in] head  posizione del prossimo lavoro da estrarre
+ *  @param[in] tail  posizione in cui inserire il prossimo lavoro
+ */
+typedef struct threadpool_ring_s
+{
+    threadpool_task_t *slots;
+    unsigned long size;
+    unsigned long mapped;
+    unsigned long head __attribute__((aligned(THREADPOOL_CACHELINE)));
+    unsigned long tail __attribute__((aligned(THREADPOOL_CACHELINE)));
+} threadpool_ring_t;
+
+struct threadpool_s;
+
+/**
+ * @typedef threadpool_worker_state_t
+ * @brief Ridefinizione della enum threadpool_worker_state_s
+ */
+/**
+ * @enum threadpool_worker_state_s
+ * @brief Stato dello slot di un thread del pool
+ */
+typedef enum threadpool_worker_state_s
+{
+    threadpool_worker_free    = 0, /**< slot mai usato */
+    threadpool_worker_running = 1, /**< thread in esecuzione */
+    threadpool_worker_exited  = 2  /**< thread terminato per inattività, da attendere prima di riusare lo slot */
+} threadpool_worker_state_t;
+
+/**
+ * @typedef threadpool_worker_t
+ * @brief Ridefinizione della struttura threadpool_worker_s
+ *
+ *  @struct threadpool_worker_s
+ *  @brief Stato di un thread del pool
+ *
+ *  @param[in] pool  threadpool di cui fa parte il thread
+ *  @param[in] id    indice del thread nel pool
+ *  @param[in] state stato dello slot (threadpool_worker_state_t)
+ *  @param[in] seed  stato del generatore con cui il thread sceglie le vittime da derubare
+ *  @param[in] tick  numero di estrazioni, che sceglie la corsia preferita
+ *  @param[in] cpu   CPU a cui è vincolato il thread (-1 = nessun vincolo)
+ *  @param[in] nbatch numero di lavori estratti con l'ultima estrazione in blocco
+ *  @param[in] next   indice in \a batch del prossimo lavoro da eseguire
+ *  @param[in] batch  lavori estratti in blocco e non ancora eseguiti
+ *  @param[in] local coda dei lavori destinati al thread, da cui gli altri thread possono rubare
+ *                   (solo in modalità work stealing, allocata sul nodo NUMA di \a cpu)
+ */
+typedef struct threadpool_worker_s
+{
+    struct threadpool_s *pool;
+    int id;
+    int state;
+    int cpu;
+    unsigned int seed;
+    unsigned int tick;
+    int nbatch;
+    int next;
+    threadpool_task_t batch[THREADPOOL_BATCH];
+    threadpool_ring_t local;
+} threadpool_worker_t;
+
 /**
  * @typedef threadpool_t
  * @brief Ridefinizione della struttura threadpool_s
@@ -44,31 +150,52 @@ typedef struct threadpool_task_s
  *  @struct threadpool_s
  *  @brief Struttura dati threadpool
  *
- *  @param[in] lock         variabile mutex per l'accesso in mutua esclusione alla coda dei lavori
- *  @param[in] notify       variabile di condizione per notificare i thread
+ *  I lavori vengono accodati in una delle corsie condivise lanes, secondo la loro
+ *  priorità; ogni thread le serve in proporzione ai pesi THREADPOOL_WEIGHT_*, così
+ *  i lavori brevi passano davanti ai lunghi senza che questi restino mai fermi.
+ *  Tutti i lavori normali passano dalla corsia normale, a meno che il pool sia creato
+ *  con threadpool_stealing: in quel caso ogni thread ha anche una propria coda,
+ *  su cui finiscono i lavori aggiunti dal thread stesso o destinati a lui con
+ *  threadpool_add_to. Un thread senza lavoro nella propria coda e in quella
+ *  condivisa ne ruba uno dalla coda di un altro thread scelto a caso.
+ *  I thread senza lavoro si sospendono con una futex su epoch, incrementato da
+ *  threadpool_add solo se qualche thread è in attesa (sleepers > 0).
+ *  Un pool elastico (min_threads < max_threads) aggiunge un thread quando la coda
+ *  si allunga o un lavoro attende troppo, e lo toglie dopo un periodo di inattività.
+ *
  *  @param[in] threads      Array contenente gli ID dei thread del pool
- *  @param[in] queue        coda contenente i lavori da eseguire
- *  @param[in] thread_count numero di thread
- *  @param[in] queue_size   grandezza della coda dei lavori
- *  @param[in] head         indice del primo elemento
- *  @param[in] tail         indice dell'ultimo elemento
- *  @param[in] count        numero di lavori da eseguire
+ *  @param[in] workers      stato dei thread
+ *  @param[in] nworkers     dimensione di workers (pari a max_threads)
+ *  @param[in] thread_count numero di thread attivi
+ *  @param[in] min_threads  numero minimo di thread
+ *  @param[in] max_threads  numero massimo di thread
+ *  @param[in] queue_size   grandezza della coda dei lavori (potenza di 2)
+ *  @param[in] flags        modalità del pool (threadpool_create_flags_t)
  *  @param[in] shutdown     flag che indica se il pool sta terminando
  *  @param[in] started      numero di thread avviati
+ *  @param[in] growing      flag che indica che un thread sta ingrandendo il pool
+ *  @param[in] pending      numero di lavori accodati o in esecuzione
+ *  @param[in] sleepers     numero di thread sospesi sulla futex
+ *  @param[in] epoch        parola della futex, incrementata a ogni risveglio
+ *  @param[in] lanes        code dei lavori condivise fra tutti i thread, una per corsia
  */
 typedef struct threadpool_s
 {
-    pthread_mutex_t lock;
-    pthread_cond_t notify;
     pthread_t *threads;
-    threadpool_task_t *queue;
+    threadpool_worker_t *workers;
+    int nworkers;
     int thread_count;
+    int min_threads;
+    int max_threads;
     int queue_size;
-    int head;
-    int tail;
-    int count;
+    int flags;
     int shutdown;
     int started;
+    int growing;
+    int pending;
+    int sleepers;
+    int epoch;
+    threadpool_ring_t lanes[THREADPOOL_LANES];
 }threadpool_t;
 
 /**
@@ -115,22 +242,94 @@ typedef enum threadpool_destroy_flags_s{
     threadpool_graceful       = 1 /**< ridenominazione del valore 1 */
 } threadpool_destroy_flags_t;
 
+/**
+ * @typedef threadpool_create_flags_s
+ * @brief Ridefinizione della enum threadpool_create_flags_t
+ */
+/**
+ * @enum threadpool_create_flags_s
+ * @brief Modalità di funzionamento del threadpool
+ */
+typedef enum threadpool_create_flags_s{
+    threadpool_stealing       = 1 /**< una coda per thread, con furto dei lavori fra i thread */
+} threadpool_create_flags_t;
+
 /**
  * @function threadpool_create
  * @brief Crea un pool di thread
  *
  * @param[in] thread_count numero di thread da inserire nel pool.
- * @param[in] queue_size   grandezza della coda dei lavori.
+ * @param[in] queue_size   grandezza della coda dei lavori (arrotondata alla potenza di 2 successiva).
  *
  * @return puntatore al threadpool creato.
  * @return NULL, in caso di errore.
  */
 threadpool_t *threadpool_create(int thread_count, int queue_size);
 
+/**
+ * @function threadpool_create_flags
+ * @brief Crea un pool di thread con la modalità indicata
+ *
+ * Con threadpool_stealing la capacità \a queue_size viene divisa fra le code
+ * condivise e le code dei thread.
+ *
+ * @param[in] thread_count numero di thread da inserire nel pool.
+ * @param[in] queue_size   grandezza della coda dei lavori (arrotondata alla potenza di 2 successiva).
+ * @param[in] flags        0 oppure threadpool_stealing.
+ *
+ * @return puntatore al threadpool creato.
+ * @return NULL, in caso di errore.
+ */
+threadpool_t *threadpool_create_flags(int thread_count, int queue_size, int flags);
+
+/**
+ * @function threadpool_create_elastic
+ * @brief Crea un pool che varia fra \a min_threads e \a max_threads thread secondo il carico
+ *
+ * Il pool parte con \a min_threads thread; ne aggiunge uno quando i lavori in attesa
+ * superano THREADPOOL_GROW_DEPTH per thread o un lavoro resta in coda più di
+ * THREADPOOL_GROW_WAIT millisecondi, e un thread oltre il minimo termina dopo
+ * THREADPOOL_SHRINK_IDLE secondi senza lavoro.
+ *
+ * @param[in] min_threads numero minimo di thread.
+ * @param[in] max_threads numero massimo di thread (non oltre MAX_THREADS).
+ * @param[in] queue_size  grandezza della coda dei lavori (arrotondata alla potenza di 2 successiva).
+ * @param[in] flags       0 oppure threadpool_stealing.
+ *
+ * @return puntatore al threadpool creato.
+ * @return NULL, in caso di errore.
+ */
+threadpool_t *threadpool_create_elastic(int min_threads, int max_threads, int queue_size, int flags);
+
+/**
+ * @function threadpool_create_pinned
+ * @brief Crea un pool elastico i cui thread sono vincolati a delle CPU
+ *
+ * Il thread nello slot i viene vincolato alla CPU cpus[i % ncpus]: ordinando le CPU
+ * alternando i nodi NUMA, ogni nodo riceve la propria quota di thread. In modalità
+ * work stealing la coda di ogni thread viene allocata e inizializzata dalla sua CPU,
+ * così il kernel ne colloca le pagine sul nodo del thread.
+ *
+ * @param[in] min_threads numero minimo di thread.
+ * @param[in] max_threads numero massimo di thread (non oltre MAX_THREADS).
+ * @param[in] queue_size  grandezza della coda dei lavori (arrotondata alla potenza di 2 successiva).
+ * @param[in] flags       0 oppure threadpool_stealing.
+ * @param[in] cpus        CPU a cui vincolare i thread (NULL = nessun vincolo).
+ * @param[in] ncpus       numero di CPU in \a cpus.
+ *
+ * @return puntatore al threadpool creato.
+ * @return NULL, in caso di errore.
+ */
+threadpool_t *threadpool_create_pinned(int min_threads, int max_threads, int queue_size, int flags,
+                                       const int *cpus, int ncpus);
+
 /**
  * @function threadpool_add
  * @brief Aggiunge un nuovo lavoro alla coda dei lavori del threadpool
  *
+ * Con threadpool_stealing, un lavoro aggiunto da un thread del pool finisce
+ * nella coda del thread stesso.
+ *
  * @param[in] pool     threadpool in cui aggiungere il lavoro
  * @param[in] function puntatore alla funzione che dovrà essere eseguita
  * @param[in] arg argomento da passare alla funzione
@@ -142,6 +341,69 @@ threadpool_t *threadpool_create(int thread_count, int queue_size);
  */
 int threadpool_add(threadpool_t *pool, void (*function)(void *), void *arg);
 
+/**
+ * @function threadpool_add_prio
+ * @brief Aggiunge un lavoro nella corsia di priorità \a lane
+ *
+ * @param[in] pool     threadpool in cui aggiungere il lavoro
+ * @param[in] lane     corsia (threadpool_lane_t)
+ * @param[in] function puntatore alla funzione che dovrà essere eseguita
+ * @param[in] arg argomento da passare alla funzione
+ *
+ * @return 0 in caso di successo.
+ * @return <0 in caso di errore.
+ */
+int threadpool_add_prio(threadpool_t *pool, int lane, void (*function)(void *), void *arg);
+
+/**
+ * @function threadpool_add_to
+ * @brief Aggiunge un lavoro alla coda del thread associato a \a key
+ *
+ * Lavori con la stessa chiave vengono eseguiti preferibilmente dallo stesso thread,
+ * salvo che un thread inattivo li rubi. Senza threadpool_stealing, o se la coda
+ * del thread è piena, equivale a threadpool_add.
+ *
+ * @param[in] pool     threadpool in cui aggiungere il lavoro
+ * @param[in] key      chiave che sceglie il thread (ad esempio il descrittore di un client)
+ * @param[in] function puntatore alla funzione che dovrà essere eseguita
+ * @param[in] arg argomento da passare alla funzione
+ *
+ * @return 0 in caso di successo.
+ * @return <0 in caso di errore.
+ */
+int threadpool_add_to(threadpool_t *pool, unsigned int key, void (*function)(void *), void *arg);
+
+/**
+ * @function threadpool_add_batch
+ * @brief Aggiunge un gruppo di lavori con la stessa funzione nella corsia \a lane
+ *
+ * Nella coda condivisa i lavori vengono prenotati con una sola CAS, e al termine
+ * vengono risvegliati al più tanti thread sospesi quanti sono i lavori aggiunti.
+ * Con threadpool_stealing e \a keys, i lavori della corsia normale vanno nella coda
+ * del thread associato alla propria chiave, come con threadpool_add_to.
+ *
+ * @param[in] pool     threadpool in cui aggiungere i lavori
+ * @param[in] lane     corsia (threadpool_lane_t)
+ * @param[in] function puntatore alla funzione che dovrà essere eseguita
+ * @param[in] args     argomenti da passare alla funzione, uno per lavoro
+ * @param[in] keys     chiavi che scelgono il thread, una per lavoro (NULL = nessuna preferenza)
+ * @param[in] n        numero di lavori
+ *
+ * @return numero di lavori aggiunti, nell'ordine di \a args (meno di \a n se la coda è piena).
+ * @return <0 in caso di errore.
+ */
+int threadpool_add_batch(threadpool_t *pool, int lane, void (*function)(void *), void **args,
+                         const unsigned int *keys, int n);
+
+/**
+ * @function threadpool_pending
+ * @brief Restituisce il numero di lavori accodati o in esecuzione
+ * @param[in] pool threadpool da controllare
+ *
+ * @return numero di lavori (il valore può essere già cambiato al ritorno).
+ */
+int threadpool_pending(threadpool_t *pool);
+
 /**
  * @function threadpool_destroy
  * @brief Ferma i thread e lascia la memoria occupata dal pool in uno stato consistente
@@ -154,6 +416,19 @@ int threadpool_add(threadpool_t *pool, void (*function)(void *), void *arg);
  */
 int threadpool_destroy(threadpool_t *pool, int flags);
 
+/**
+ * @function threadpool_wait
+ * @brief Attende che la coda sia vuota e che nessun thread stia eseguendo un lavoro
+ * @param[in] pool threadpool da attendere
+ *
+ * Il pool continua ad accettare lavori: il chiamante deve assicurarsi che non ne
+ * vengano aggiunti di nuovi (se non dai lavori stessi), altrimenti l'attesa può non terminare.
+ *
+ * @return 0, in caso di successo.
+ * @return codice di errore del pool, in caso di errore.
+ */
+int threadpool_wait(threadpool_t *pool);
+
 
 /**
  * @function threadpool_free
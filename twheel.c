@@ -0,0 +1,169 @@
+/*
+ * membox Progetto del corso di LSO 2017/2018
+ *
+ * Dipartimento di Informatica Università di Pisa
+ * Docenti: Prencipe, Torquati
+ *
+ */
+/**
+ * @file twheel.c
+ * @author Jacopo Massa 543870 \n( <mailto:jacopomassa97@gmail.com> )
+ * @brief Implementazione delle funzioni del file twheel.h
+ * @copyright **Si dichiara che il contenuto di questo file è in ogni sua parte opera
+       originale dell'autore**
+ * @see twheel.h
+ */
+
+#include <stdlib.h>
+#include <twheel.h>
+
+/**
+ * @function twheel_insert
+ * @brief Inserisce un timer nello slot corrispondente alla sua distanza da w->now
+ *
+ * @param[in] w       ruota dei timer
+ * @param[in] n       timer da inserire (non attivo)
+ * @param[in] expires tick di scadenza (se già passato, il timer scade al tick corrente)
+ */
+static void twheel_insert(twheel_t *w, twnode_t *n, unsigned long expires)
+{
+    unsigned long delta;
+    twnode_t *head;
+    int l = 0;
+
+    if(expires < w->now)
+        expires = w->now;
+
+    // oltre l'ultimo livello il timer viene anticipato: il chiamante lo riattiverà alla scadenza
+    delta = expires - w->now;
+    if(delta >= (1UL << (TW_LEVELS*TW_BITS)))
+    {
+        delta = (1UL << (TW_LEVELS*TW_BITS)) - 1;
+        expires = w->now + delta;
+    }
+
+    while(l < TW_LEVELS-1 && delta >= (1UL << ((l+1)*TW_BITS)))
+        l++;
+
+    n->expires = expires;
+    head = &w->slots[l][(expires >> (l*TW_BITS)) & TW_MASK];
+
+    // inserimento in coda alla lista circolare dello slot
+    n->next = head;
+    n->prev = head->prev;
+    head->prev->next = n;
+    head->prev = n;
+}
+
+/**
+ * @function twheel_detach
+ * @brief Sposta tutti i timer di uno slot nella lista \a list, svuotando lo slot
+ *
+ * @param[in]  head sentinella dello slot
+ * @param[out] list sentinella della lista in cui spostare i timer
+ */
+static void twheel_detach(twnode_t *head, twnode_t *list)
+{
+    if(head->next == head)
+    {
+        list->next = list->prev = list;
+        return;
+    }
+
+    list->next = head->next;
+    list->prev = head->prev;
+    list->next->prev = list;
+    list->prev->next = list;
+    head->next = head->prev = head;
+}
+
+twheel_t *twheel_create(unsigned long now)
+{
+    twheel_t *w;
+    int l;
+    unsigned long i;
+
+    if((w = (twheel_t*) malloc(sizeof(twheel_t))) == NULL)
+        return NULL;
+
+    for(l = 0; l < TW_LEVELS; l++)
+        for(i = 0; i < TW_SLOTS; i++)
+            w->slots[l][i].next = w->slots[l][i].prev = &w->slots[l][i];
+
+    w->now = now;
+
+    return w;
+}
+
+void twheel_add(twheel_t *w, twnode_t *n, unsigned long expires)
+{
+    if(w == NULL || n == NULL)
+        return;
+
+    twheel_del(n);
+
+    // lo slot del tick corrente è già stato elaborato
+    if(expires <= w->now)
+        expires = w->now + 1;
+
+    twheel_insert(w,n,expires);
+}
+
+void twheel_del(twnode_t *n)
+{
+    if(n == NULL || n->next == NULL)
+        return;
+
+    n->prev->next = n->next;
+    n->next->prev = n->prev;
+    n->next = n->prev = NULL;
+}
+
+int twheel_pending(const twnode_t *n)
+{
+    return n != NULL && n->next != NULL;
+}
+
+int twheel_advance(twheel_t *w, unsigned long now, void (*fn)(twnode_t*, void*), void *arg)
+{
+    twnode_t list, *n;
+    int l, nexpired = 0;
+
+    if(w == NULL || fn == NULL)
+        return 0;
+
+    while(w->now < now)
+    {
+        w->now++;
+
+        // a ogni giro completo di un livello ridistribuisco lo slot corrente del livello superiore
+        for(l = 1; l < TW_LEVELS; l++)
+        {
+            if(w->now & ((1UL << (l*TW_BITS)) - 1))
+                break;
+
+            twheel_detach(&w->slots[l][(w->now >> (l*TW_BITS)) & TW_MASK],&list);
+            while((n = list.next) != &list)
+            {
+                twheel_del(n);
+                twheel_insert(w,n,n->expires);
+            }
+        }
+
+        // i timer dello slot corrente del livello 0 sono scaduti
+        twheel_detach(&w->slots[0][w->now & TW_MASK],&list);
+        while((n = list.next) != &list)
+        {
+            twheel_del(n);
+            fn(n,arg);
+            nexpired++;
+        }
+    }
+
+    return nexpired;
+}
+
+void twheel_destroy(twheel_t *w)
+{
+    free(w);
+}
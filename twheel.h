@@ -0,0 +1,127 @@
+/*
+ * membox Progetto del corso di LSO 2017/2018
+ *
+ * Dipartimento di Informatica Università di Pisa
+ * Docenti: Prencipe, Torquati
+ *
+ */
+/**
+ * @file twheel.h
+ * @author Jacopo Massa 543870 \n( <mailto:jacopomassa97@gmail.com> )
+ * @brief Ruota dei timer gerarchica, con inserimento e cancellazione in tempo costante
+ *
+ * Il tempo è misurato in tick. Il livello 0 contiene i timer che scadono entro
+ * TW_SLOTS tick, ogni livello successivo copre un intervallo TW_SLOTS volte più
+ * ampio; quando il livello inferiore completa un giro, lo slot corrispondente del
+ * livello superiore viene ridistribuito.
+ * La ruota non è thread-safe: deve essere usata da un solo thread.
+ * @copyright **Si dichiara che il contenuto di questo file è in ogni sua parte opera
+       originale dell'autore**
+ */
+
+#ifndef TWHEEL_H_
+#define TWHEEL_H_
+
+#define TW_BITS 6 /**< log2 del numero di slot di ogni livello. */
+#define TW_SLOTS (1UL << TW_BITS) /**< numero di slot di ogni livello. */
+#define TW_MASK (TW_SLOTS - 1) /**< maschera degli indici di uno slot. */
+#define TW_LEVELS 4 /**< numero di livelli: la scadenza massima è TW_SLOTS^TW_LEVELS tick. */
+
+/**
+ * @typedef twnode_t
+ * @brief Ridefinizione della struttura twnode_s
+ *
+ * @struct twnode_s
+ * @brief Timer, da includere nella struttura dell'oggetto da temporizzare
+ *
+ * @param[in] prev    timer precedente nello slot
+ * @param[in] next    timer successivo nello slot (NULL se il timer non è attivo)
+ * @param[in] expires tick di scadenza
+ */
+typedef struct twnode_s
+{
+    struct twnode_s *prev;
+    struct twnode_s *next;
+    unsigned long expires;
+} twnode_t;
+
+/**
+ * @typedef twheel_t
+ * @brief Ridefinizione della struttura twheel_s
+ *
+ * @struct twheel_s
+ * @brief Struttura dati ruota dei timer
+ *
+ * @param[in] now   ultimo tick elaborato
+ * @param[in] slots sentinelle delle liste circolari di ogni slot, per ogni livello
+ */
+typedef struct twheel_s
+{
+    unsigned long now;
+    twnode_t slots[TW_LEVELS][TW_SLOTS];
+} twheel_t;
+
+/**
+ * @function twheel_create
+ * @brief Alloca una ruota dei timer vuota
+ *
+ * @param[in] now tick corrente
+ *
+ * @return puntatore alla ruota allocata.
+ * @return NULL, in caso di errore.
+ */
+twheel_t *twheel_create(unsigned long now);
+
+/**
+ * @function twheel_add
+ * @brief Attiva un timer, o ne sposta la scadenza se è già attivo
+ *
+ * @param[in] w       ruota dei timer
+ * @param[in] n       timer da attivare
+ * @param[in] expires tick di scadenza (se già passato, il timer scade al tick successivo)
+ */
+void twheel_add(twheel_t *w, twnode_t *n, unsigned long expires);
+
+/**
+ * @function twheel_del
+ * @brief Disattiva un timer (se non è attivo non fa nulla)
+ *
+ * @param[in] n timer da disattivare
+ */
+void twheel_del(twnode_t *n);
+
+/**
+ * @function twheel_pending
+ * @brief Indica se un timer è attivo
+ *
+ * @param[in] n timer
+ *
+ * @return 1 se il timer è attivo, 0 altrimenti.
+ */
+int twheel_pending(const twnode_t *n);
+
+/**
+ * @function twheel_advance
+ * @brief Fa avanzare la ruota fino al tick \a now, eseguendo \a fn per ogni timer scaduto
+ *
+ * Quando viene chiamata \a fn il timer è già stato disattivato, quindi la
+ * funzione può riattivarlo con una nuova scadenza.
+ *
+ * @param[in] w   ruota dei timer
+ * @param[in] now tick corrente
+ * @param[in] fn  funzione da eseguire per ogni timer scaduto
+ * @param[in] arg argomento passato a \a fn
+ *
+ * @return numero di timer scaduti.
+ */
+int twheel_advance(twheel_t *w, unsigned long now, void (*fn)(twnode_t*, void*), void *arg);
+
+/**
+ * @function twheel_destroy
+ * @brief Libera la memoria allocata con twheel_create (i timer non vengono toccati)
+ *
+ * @param[in] w ruota da eliminare
+ */
+void twheel_destroy(twheel_t *w);
+
+#endif /* TWHEEL_H_ */
@@ -0,0 +1,396 @@
+/*
+ * membox Progetto del corso di LSO 2017/2018
+ *
+ * Dipartimento di Informatica Università di Pisa
+ * Docenti: Prencipe, Torquati
+ *
+ */
+/**
+ * @file uring.c
+ * @author Jacopo Massa 543870 \n( <mailto:jacopomassa97@gmail.com> )
+ * @brief Implementazione delle funzioni del file uring.h
+ * @copyright **Si dichiara che il contenuto di questo file è in ogni sua parte opera
+       originale dell'autore**
+ * @see uring.h
+ */
+
+#define _GNU_SOURCE
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <unistd.h>
+#include <pthread.h>
+#include <uring.h>
+
+#if defined(HAVE_IO_URING)
+
+#include <sys/mman.h>
+#include <sys/syscall.h>
+#include <sys/socket.h>
+#include <linux/io_uring.h>
+
+#define URING_ACCEPT 2 /**< user_data della accept multishot. */
+#define URING_CANCEL 3 /**< user_data dell'annullamento della accept. */
+
+/**< flag che indica se il backend è abilitato */
+static int uring_enabled = 0;
+
+/**< chiave per il ring di ogni thread */
+static pthread_key_t uring_key;
+/**< garantisce che la chiave venga creata una sola volta */
+static pthread_once_t uring_once = PTHREAD_ONCE_INIT;
+
+/**
+ * @function uring_free
+ * @brief Chiude il ring e libera la memoria mappata (distruttore della chiave)
+ *
+ * @param[in] ring ring da liberare
+ */
+static void uring_free(void *ring)
+{
+    uring_t *r = (uring_t*) ring;
+    if(r == NULL) return;
+
+    if(r->sqes) munmap(r->sqes,r->sqes_len);
+    if(r->cq_ptr && r->cq_ptr != r->sq_ptr) munmap(r->cq_ptr,r->cq_len);
+    if(r->sq_ptr) munmap(r->sq_ptr,r->sq_len);
+    if(r->fd >= 0) close(r->fd);
+    free(r);
+}
+
+/**
+ * @function uring_key_create
+ * @brief Crea la chiave usata per memorizzare il ring di ogni thread
+ */
+static void uring_key_create(void) { pthread_key_create(&uring_key,uring_free); }
+
+/**
+ * @function uring_setup
+ * @brief Crea un ring e mappa le sue code in memoria
+ *
+ * @return puntatore al ring creato.
+ * @return NULL in caso di errore (errno settato).
+ */
+static uring_t *uring_setup(void)
+{
+    struct io_uring_params p;
+    uring_t *r;
+
+    if((r = (uring_t*) calloc(1,sizeof(uring_t))) == NULL)
+        return NULL;
+
+    memset(&p,0,sizeof(p));
+    if((r->fd = (int) syscall(__NR_io_uring_setup,URING_ENTRIES,&p)) < 0)
+    {
+        free(r);
+        return NULL;
+    }
+
+    r->sq_len = p.sq_off.array + p.sq_entries*sizeof(unsigned);
+    r->cq_len = p.cq_off.cqes + p.cq_entries*sizeof(struct io_uring_cqe);
+
+    // con IORING_FEAT_SINGLE_MMAP le due code condividono la stessa area
+    if(p.features & IORING_FEAT_SINGLE_MMAP)
+        r->sq_len = r->cq_len = (r->sq_len > r->cq_len) ? r->sq_len : r->cq_len;
+
+    r->sq_ptr = mmap(NULL,r->sq_len,PROT_READ|PROT_WRITE,MAP_SHARED|MAP_POPULATE,r->fd,IORING_OFF_SQ_RING);
+    if(r->sq_ptr == MAP_FAILED)
+    {
+        r->sq_ptr = NULL;
+        goto err;
+    }
+
+    if(p.features & IORING_FEAT_SINGLE_MMAP)
+        r->cq_ptr = r->sq_ptr;
+    else
+    {
+        r->cq_ptr = mmap(NULL,r->cq_len,PROT_READ|PROT_WRITE,MAP_SHARED|MAP_POPULATE,r->fd,IORING_OFF_CQ_RING);
+        if(r->cq_ptr == MAP_FAILED)
+        {
+            r->cq_ptr = NULL;
+            goto err;
+        }
+    }
+
+    r->sqes_len = p.sq_entries*sizeof(struct io_uring_sqe);
+    r->sqes = mmap(NULL,r->sqes_len,PROT_READ|PROT_WRITE,MAP_SHARED|MAP_POPULATE,r->fd,IORING_OFF_SQES);
+    if(r->sqes == MAP_FAILED)
+    {
+        r->sqes = NULL;
+        goto err;
+    }
+
+    r->sq_head  = (unsigned*)((char*)r->sq_ptr + p.sq_off.head);
+    r->sq_tail  = (unsigned*)((char*)r->sq_ptr + p.sq_off.tail);
+    r->sq_mask  = (unsigned*)((char*)r->sq_ptr + p.sq_off.ring_mask);
+    r->sq_array = (unsigned*)((char*)r->sq_ptr + p.sq_off.array);
+    r->cq_head  = (unsigned*)((char*)r->cq_ptr + p.cq_off.head);
+    r->cq_tail  = (unsigned*)((char*)r->cq_ptr + p.cq_off.tail);
+    r->cq_mask  = (unsigned*)((char*)r->cq_ptr + p.cq_off.ring_mask);
+    r->cqes     = (struct io_uring_cqe*)((char*)r->cq_ptr + p.cq_off.cqes);
+    r->accepting = 0;
+    r->multishot = 1;
+    r->stopping = 0;
+
+    return r;
+
+ err:
+    {
+        int e = errno;
+        uring_free(r);
+        errno = e;
+    }
+    return NULL;
+}
+
+/**
+ * @function uring_sqe
+ * @brief Prepara la prossima SQE libera, azzerata
+ *
+ * @param[in] r ring del thread
+ *
+ * @return puntatore alla SQE, che verrà inviata con la prossima uring_enter.
+ * @return NULL se la submission queue è piena.
+ */
+static struct io_uring_sqe *uring_sqe(uring_t *r)
+{
+    unsigned tail = *r->sq_tail;
+    unsigned head = __atomic_load_n(r->sq_head,__ATOMIC_ACQUIRE);
+    unsigned idx;
+
+    if(tail - head > *r->sq_mask)
+        return NULL;
+
+    idx = tail & *r->sq_mask;
+    memset(&r->sqes[idx],0,sizeof(struct io_uring_sqe));
+    r->sq_array[idx] = idx;
+    __atomic_store_n(r->sq_tail,tail+1,__ATOMIC_RELEASE);
+
+    return &r->sqes[idx];
+}
+
+/**
+ * @function uring_enter
+ * @brief Invia le SQE preparate e attende (eventualmente) dei completamenti
+ *
+ * Se l'attesa viene interrotta il chiamante deve ricontrollare la completion queue.
+ *
+ * @param[in] r        ring del thread
+ * @param[in] submit   numero di SQE da inviare
+ * @param[in] wait     numero minimo di completamenti da attendere
+ *
+ * @return 0 in caso di successo.
+ * @return -1 in caso di errore (errno settato).
+ */
+static int uring_enter(uring_t *r, unsigned submit, unsigned wait)
+{
+    long res;
+    unsigned flags = wait ? IORING_ENTER_GETEVENTS : 0;
+
+    while((res = syscall(__NR_io_uring_enter,r->fd,submit,wait,flags,NULL,0)) == -1)
+    {
+        if(errno != EINTR)
+            return -1;
+    }
+
+    return 0;
+}
+
+/**
+ * @function uring_cqe
+ * @brief Estrae un completamento dalla completion queue, se presente
+ *
+ * @param[in]  r   ring del thread
+ * @param[out] cqe completamento estratto
+ *
+ * @return 1 se è stato estratto un completamento.
+ * @return 0 se la completion queue è vuota.
+ */
+static int uring_cqe(uring_t *r, struct io_uring_cqe *cqe)
+{
+    unsigned head = *r->cq_head;
+
+    if(head == __atomic_load_n(r->cq_tail,__ATOMIC_ACQUIRE))
+        return 0;
+
+    *cqe = r->cqes[head & *r->cq_mask];
+    __atomic_store_n(r->cq_head,head+1,__ATOMIC_RELEASE);
+    return 1;
+}
+
+int uring_enable(int on)
+{
+    uring_t *probe;
+
+    if(!on)
+        return uring_enabled = 0;
+
+    // verifico che il kernel supporti io_uring prima di abilitarlo
+    if((probe = uring_setup()) == NULL)
+        return uring_enabled = 0;
+
+    uring_free(probe);
+    return uring_enabled = 1;
+}
+
+uring_t *uring_get(void)
+{
+    uring_t *r;
+
+    if(!uring_enabled)
+        return NULL;
+
+    pthread_once(&uring_once,uring_key_create);
+
+    if((r = (uring_t*) pthread_getspecific(uring_key)) == NULL)
+    {
+        // ring non disponibile per questo thread: torno alle system call tradizionali
+        if((r = uring_setup()) == NULL)
+            return NULL;
+        pthread_setspecific(uring_key,r);
+    }
+
+    return r;
+}
+
+int uring_accept(uring_t *r, int sfd, int *fds, int max)
+{
+    struct io_uring_sqe *sqe;
+    struct io_uring_cqe cqe;
+    int n = 0;
+
+    if(r == NULL || sfd < 0 || fds == NULL || max <= 0)
+    {
+        errno = EINVAL;
+        return -1;
+    }
+
+    for(;;)
+    {
+        // (ri)armo la accept se il kernel ha terminato la precedente
+        if(!r->accepting)
+        {
+            if((sqe = uring_sqe(r)) == NULL)
+            {
+                errno = EBUSY;
+                return -1;
+            }
+            sqe->opcode = IORING_OP_ACCEPT;
+            sqe->fd = sfd;
+            sqe->user_data = URING_ACCEPT;
+            sqe->accept_flags = SOCK_NONBLOCK | SOCK_CLOEXEC;
+            if(r->multishot)
+                sqe->ioprio = IORING_ACCEPT_MULTISHOT;
+            if(uring_enter(r,1,0) == -1)
+                return -1;
+            r->accepting = 1;
+        }
+
+        // raccolgo tutte le connessioni già completate
+        while(n < max && uring_cqe(r,&cqe))
+        {
+            if(cqe.user_data != URING_ACCEPT)
+                continue;
+
+            if(!(cqe.flags & IORING_CQE_F_MORE))
+                r->accepting = 0;
+
+            if(cqe.res >= 0)
+                fds[n++] = cqe.res;
+            else if(cqe.res == -EINVAL && r->multishot) // kernel senza accept multishot
+                r->multishot = 0;
+            else if(cqe.res != -EINTR && cqe.res != -EAGAIN && cqe.res != -ECONNABORTED)
+            {
+                if(n > 0) return n;
+                errno = -cqe.res;
+                return -1;
+            }
+
+            if(!r->accepting)
+                break;
+        }
+
+        if(n > 0)
+            return n;
+
+        if(r->accepting && uring_enter(r,0,1) == -1)
+            return -1;
+    }
+}
+
+int uring_accept_stop(uring_t *r, int *fds, int max)
+{
+    struct io_uring_sqe *sqe;
+    struct io_uring_cqe cqe;
+    int n = 0;
+
+    if(r == NULL || fds == NULL || max <= 0)
+    {
+        errno = EINVAL;
+        return -1;
+    }
+
+    if(!r->accepting)
+        return 0;
+
+    // chiedo al kernel di annullare la accept ancora attiva
+    if(!r->stopping)
+    {
+        if((sqe = uring_sqe(r)) == NULL)
+        {
+            errno = EBUSY;
+            return -1;
+        }
+        sqe->opcode = IORING_OP_ASYNC_CANCEL;
+        sqe->addr = URING_ACCEPT;
+        sqe->user_data = URING_CANCEL;
+        if(uring_enter(r,1,0) == -1)
+            return -1;
+        r->stopping = 1;
+    }
+
+    // raccolgo le connessioni accettate prima dell'annullamento, finché la accept non termina
+    while(r->accepting && n < max)
+    {
+        if(!uring_cqe(r,&cqe))
+        {
+            if(uring_enter(r,0,1) == -1)
+                return -1;
+            continue;
+        }
+
+        if(cqe.user_data != URING_ACCEPT)
+            continue;
+
+        if(!(cqe.flags & IORING_CQE_F_MORE))
+            r->accepting = 0;
+
+        if(cqe.res >= 0)
+            fds[n++] = cqe.res;
+    }
+
+    if(!r->accepting)
+        r->stopping = 0;
+
+    return n;
+}
+
+#else /* !HAVE_IO_URING */
+
+int uring_enable(int on) { return 0; }
+
+uring_t *uring_get(void) { return NULL; }
+
+int uring_accept(uring_t *r, int sfd, int *fds, int max)
+{
+    errno = ENOSYS;
+    return -1;
+}
+
+int uring_accept_stop(uring_t *r, int *fds, int max)
+{
+    errno = ENOSYS;
+    return -1;
+}
+
+#endif /* HAVE_IO_URING */
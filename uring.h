@@ -0,0 +1,136 @@
+/*
+ * membox Progetto del corso di LSO 2017/2018
+ *
+ * Dipartimento di Informatica Università di Pisa
+ * Docenti: Prencipe, Torquati
+ *
+ */
+/**
+ * @file uring.h
+ * @author Jacopo Massa 543870 \n( <mailto:jacopomassa97@gmail.com> )
+ * @brief Accept multishot basata su io_uring, usata dal listener al posto di accept4 quando disponibile
+ *
+ * Ogni thread possiede il proprio ring, creato alla prima operazione. Una sola SQE
+ * resta attiva tra una raccolta e l'altra, quindi una raffica di connessioni costa
+ * una system call invece di una accept4 per connessione. I messaggi dei client
+ * continuano a passare per readv/writev: una lettura o scrittura sincrona tramite
+ * il ring costerebbe comunque una io_uring_enter ciascuna.
+ * Se il backend è disabilitato (a tempo di compilazione con HAVE_IO_URING, o
+ * nella configurazione con IoUring) o il kernel non lo supporta, uring_get
+ * ritorna NULL e il chiamante usa le normali system call.
+ * @copyright **Si dichiara che il contenuto di questo file è in ogni sua parte opera
+       originale dell'autore**
+ */
+
+#ifndef URING_H_
+#define URING_H_
+
+#include <sys/types.h>
+
+#define URING_ENTRIES 64 /**< numero di SQE di ogni ring. */
+
+/**
+ * @typedef uring_t
+ * @brief Ridefinizione della struttura uring_s
+ *
+ * @struct uring_s
+ * @brief Ring io_uring di un thread, con le code mappate in memoria
+ *
+ * @param[in] fd         descrittore restituito da io_uring_setup
+ * @param[in] sq_head    testa della submission queue (aggiornata dal kernel)
+ * @param[in] sq_tail    coda della submission queue (aggiornata dal thread)
+ * @param[in] sq_mask    maschera degli indici della submission queue
+ * @param[in] sq_array   array di indici delle SQE
+ * @param[in] sqes       array delle SQE
+ * @param[in] cq_head    testa della completion queue (aggiornata dal thread)
+ * @param[in] cq_tail    coda della completion queue (aggiornata dal kernel)
+ * @param[in] cq_mask    maschera degli indici della completion queue
+ * @param[in] cqes       array delle CQE
+ * @param[in] sq_ptr     area mappata della submission queue
+ * @param[in] cq_ptr     area mappata della completion queue
+ * @param[in] sq_len     dimensione di sq_ptr
+ * @param[in] cq_len     dimensione di cq_ptr
+ * @param[in] sqes_len   dimensione di sqes
+ * @param[in] accepting  flag che indica se è attiva una accept multishot
+ * @param[in] multishot  flag che indica se il kernel supporta la accept multishot
+ * @param[in] stopping   flag che indica che è stato chiesto l'annullamento della accept
+ */
+typedef struct uring_s
+{
+    int fd;
+    unsigned *sq_head;
+    unsigned *sq_tail;
+    unsigned *sq_mask;
+    unsigned *sq_array;
+    struct io_uring_sqe *sqes;
+    unsigned *cq_head;
+    unsigned *cq_tail;
+    unsigned *cq_mask;
+    struct io_uring_cqe *cqes;
+    void *sq_ptr;
+    void *cq_ptr;
+    size_t sq_len;
+    size_t cq_len;
+    size_t sqes_len;
+    int accepting;
+    int multishot;
+    int stopping;
+} uring_t;
+
+/**
+ * @function uring_enable
+ * @brief Abilita o disabilita il backend per tutti i thread del processo
+ *
+ * @param[in] on 1 per abilitare, 0 per disabilitare
+ *
+ * @return 1 se il backend è stato abilitato.
+ * @return 0 se è disabilitato o non è supportato.
+ */
+int uring_enable(int on);
+
+/**
+ * @function uring_get
+ * @brief Restituisce il ring del thread chiamante, creandolo se necessario
+ *
+ * @return puntatore al ring del thread.
+ * @return NULL se il backend non è abilitato o non è disponibile.
+ */
+uring_t *uring_get(void);
+
+/**
+ * @function uring_accept
+ * @brief Accetta una o più connessioni con una accept multishot
+ *
+ * La SQE resta attiva tra una chiamata e l'altra, quindi una raffica di connessioni
+ * viene raccolta con una sola system call. Se il kernel non supporta la modalità
+ * multishot si usa una accept singola.
+ * Le connessioni accettate sono non bloccanti e chiuse automaticamente con exec.
+ *
+ * @param[in]  r   ring del thread
+ * @param[in]  sfd socket in ascolto
+ * @param[out] fds descrittori delle connessioni accettate
+ * @param[in]  max dimensione di \a fds
+ *
+ * @return numero di connessioni accettate (almeno una).
+ * @return -1 in caso di errore (errno settato).
+ */
+int uring_accept(uring_t *r, int sfd, int *fds, int max);
+
+/**
+ * @function uring_accept_stop
+ * @brief Annulla la accept attiva, restituendo le connessioni che il kernel ha già accettato
+ *
+ * Va chiamata finché non restituisce 0: da quel momento il ring non accetta più
+ * connessioni, che restano nella coda del socket. La successiva uring_accept
+ * riattiva la accept.
+ *
+ * @param[in]  r   ring del thread
+ * @param[out] fds descrittori delle connessioni accettate
+ * @param[in]  max dimensione di \a fds
+ *
+ * @return numero di connessioni accettate prima dell'annullamento (0 se la accept è terminata).
+ * @return -1 in caso di errore (errno settato).
+ */
+int uring_accept_stop(uring_t *r, int *fds, int max);
+
+#endif /* URING_H_ */
@@ -21,7 +21,7 @@
 #include <ctype.h>
 #include <string.h>
 
-
+int (*waitHook)(int fd, short events) = NULL;
 
 void parseConfigurationFile(config_t *conf, char* filepath)
 {
@@ -34,6 +34,26 @@ void parseConfigurationFile(config_t *conf, char* filepath)
     conf->MaxHistMsgs   = 0;
     conf->DirName       = NULL;
     conf->StatFileName  = NULL;
+    conf->ReactorThreads= 1;
+    conf->IoUring       = 0;
+    conf->WorkerRearm   = 0;
+    conf->ListenBacklog = 0;
+    conf->IdleTimeout   = 0;
+    conf->HandoverPath  = NULL;
+    conf->WorkStealing  = 0;
+    conf->ConnectionAffinity = 0;
+    conf->MinThreads    = 0;
+    conf->MaxThreads    = 0;
+    conf->LockPartitions= 0;
+    conf->HighWatermark = 0;
+    conf->LowWatermark  = 0;
+    conf->BusyReply     = 0;
+    conf->ListenerCPUs  = NULL;
+    conf->ReactorCPUs   = NULL;
+    conf->PoolCPUs      = NULL;
+    conf->DiskThreads   = 0;
+    conf->Coroutines    = 0;
+    conf->Compression   = 0;
 
     FILE *fp;
     char buf[MAX_BUF_LENGTH];
@@ -115,6 +135,110 @@ void parseConfigurationFile(config_t *conf, char* filepath)
             strncpy(conf->StatFileName, value, strlen(value)+1);
             continue;
         }
+        if(strcmp(field,"ReactorThreads") == 0)
+        {
+            conf->ReactorThreads = atoi(value);
+            continue;
+        }
+        if(strcmp(field,"IoUring") == 0)
+        {
+            conf->IoUring = atoi(value);
+            continue;
+        }
+        if(strcmp(field,"WorkerRearm") == 0)
+        {
+            conf->WorkerRearm = atoi(value);
+            continue;
+        }
+        if(strcmp(field,"ListenBacklog") == 0)
+        {
+            conf->ListenBacklog = atoi(value);
+            continue;
+        }
+        if(strcmp(field,"IdleTimeout") == 0)
+        {
+            conf->IdleTimeout = atoi(value);
+            continue;
+        }
+        if(strcmp(field,"HandoverPath") == 0)
+        {
+            SYSCALL(conf->HandoverPath = (char*) malloc(sizeof(char)*strlen(value)+1),NULL,"malloc HandoverPath in parseConfigurationFile");
+            strncpy(conf->HandoverPath, value, strlen(value)+1);
+            continue;
+        }
+        if(strcmp(field,"WorkStealing") == 0)
+        {
+            conf->WorkStealing = atoi(value);
+            continue;
+        }
+        if(strcmp(field,"ConnectionAffinity") == 0)
+        {
+            conf->ConnectionAffinity = atoi(value);
+            continue;
+        }
+        if(strcmp(field,"MinThreads") == 0)
+        {
+            conf->MinThreads = atoi(value);
+            continue;
+        }
+        if(strcmp(field,"MaxThreads") == 0)
+        {
+            conf->MaxThreads = atoi(value);
+            continue;
+        }
+        if(strcmp(field,"LockPartitions") == 0)
+        {
+            conf->LockPartitions = atoi(value);
+            continue;
+        }
+        if(strcmp(field,"HighWatermark") == 0)
+        {
+            conf->HighWatermark = atoi(value);
+            continue;
+        }
+        if(strcmp(field,"LowWatermark") == 0)
+        {
+            conf->LowWatermark = atoi(value);
+            continue;
+        }
+        if(strcmp(field,"BusyReply") == 0)
+        {
+            conf->BusyReply = atoi(value);
+            continue;
+        }
+        if(strcmp(field,"ListenerCPUs") == 0)
+        {
+            SYSCALL(conf->ListenerCPUs = (char*) malloc(sizeof(char)*strlen(value)+1),NULL,"malloc ListenerCPUs in parseConfigurationFile");
+            strncpy(conf->ListenerCPUs, value, strlen(value)+1);
+            continue;
+        }
+        if(strcmp(field,"ReactorCPUs") == 0)
+        {
+            SYSCALL(conf->ReactorCPUs = (char*) malloc(sizeof(char)*strlen(value)+1),NULL,"malloc ReactorCPUs in parseConfigurationFile");
+            strncpy(conf->ReactorCPUs, value, strlen(value)+1);
+            continue;
+        }
+        if(strcmp(field,"PoolCPUs") == 0)
+        {
+            SYSCALL(conf->PoolCPUs = (char*) malloc(sizeof(char)*strlen(value)+1),NULL,"malloc PoolCPUs in parseConfigurationFile");
+            strncpy(conf->PoolCPUs, value, strlen(value)+1);
+            continue;
+        }
+        if(strcmp(field,"DiskThreads") == 0)
+        {
+            conf->DiskThreads = atoi(value);
+            continue;
+        }
+        if(strcmp(field,"Coroutines") == 0)
+        {
+            conf->Coroutines = atoi(value);
+            continue;
+        }
+        if(strcmp(field,"Compression") == 0)
+        {
+            conf->Compression = atoi(value);
+            continue;
+        }
     }
     fclose(fp);
 }
@@ -127,6 +251,10 @@ int conf_destroy(config_t *conf)
     if(conf->UnixPath)      free(conf->UnixPath);
     if(conf->StatFileName)  free(conf->StatFileName);
     if(conf->DirName)       free(conf->DirName);
+    if(conf->HandoverPath)  free(conf->HandoverPath);
+    if(conf->ListenerCPUs)  free(conf->ListenerCPUs);
+    if(conf->ReactorCPUs)   free(conf->ReactorCPUs);
+    if(conf->PoolCPUs)      free(conf->PoolCPUs);
     free(conf);
 
     return 0;
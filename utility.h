@@ -21,6 +21,8 @@
 #include <unistd.h>
 #include <errno.h>
 #include <pthread.h>
+#include <poll.h>
+#include <sys/uio.h>
 
 /**
  * @def ERRORE(m)
@@ -74,6 +76,26 @@
  * @param[in] MaxHistMsgs       numero massimo di messaggi che il server ricorda per ogni client
  * @param[in] DirName           directory dove memorizzare i files da inviare agli utenti
  * @param[in] StatFileName      file nel quale verranno scritte le statistiche del server
+ * @param[in] ReactorThreads    numero di event loop tra cui vengono distribuite le connessioni
+ * @param[in] IoUring           flag che fa accettare le connessioni al listener con una accept multishot io_uring
+ * @param[in] WorkerRearm       flag che fa riarmare il client direttamente al thread del pool, senza passare dall'event loop
+ * @param[in] ListenBacklog     dimensione della coda delle connessioni in attesa di essere accettate (0 = SOMAXCONN)
+ * @param[in] IdleTimeout       secondi di inattività dopo i quali un client viene disconnesso (0 = mai)
+ * @param[in] HandoverPath      socket su cui un nuovo processo può subentrare al server (NULL = disabilitato)
+ * @param[in] WorkStealing      flag che dà una coda di lavori a ogni thread del pool, con furto dei lavori fra i thread
+ * @param[in] ConnectionAffinity flag che fa scrivere su ogni client un solo thread alla volta, senza lock (coda dei messaggi in uscita)
+ * @param[in] MinThreads        numero minimo di thread nel pool elastico (0 = ThreadsInPool)
+ * @param[in] MaxThreads        numero massimo di thread nel pool elastico (0 = MinThreads, pool fisso)
+ * @param[in] LockPartitions    numero di partizioni (e di lock) della tabella degli utenti (0 = ThreadsInPool)
+ * @param[in] HighWatermark     lavori nel pool oltre i quali il server smette di accettare richieste (0 = MAX_QUEUE/4)
+ * @param[in] LowWatermark      lavori nel pool sotto i quali il server torna ad accettare richieste (0 = HighWatermark/2)
+ * @param[in] BusyReply         flag che fa rispondere OP_SERVER_BUSY alle richieste invece di lasciarle in attesa
+ * @param[in] ListenerCPUs      CPU su cui eseguire il listener, nel formato "0-3,8" (NULL = nessun vincolo)
+ * @param[in] ReactorCPUs       CPU fra cui distribuire gli event loop, uno per CPU (NULL = nessun vincolo)
+ * @param[in] PoolCPUs          CPU fra cui distribuire i thread del pool, uno per CPU (NULL = nessun vincolo)
+ * @param[in] DiskThreads       numero di thread del pool dedicato alle operazioni sui file (0 = eseguite dal pool delle richieste)
+ * @param[in] Coroutines        flag che esegue le richieste in coroutine, sospese quando un client non è pronto (richiede ConnectionAffinity)
+ * @param[in] Compression       flag che accetta la compressione dei body lunghi con i client che la offrono (protocollo v3)
  */
 typedef struct config_s
 {
@@ -85,6 +107,26 @@ typedef struct config_s
     int MaxHistMsgs;
     char* DirName;
     char* StatFileName;
+    int ReactorThreads;
+    int IoUring;
+    int WorkerRearm;
+    int ListenBacklog;
+    int IdleTimeout;
+    char* HandoverPath;
+    int WorkStealing;
+    int ConnectionAffinity;
+    int MinThreads;
+    int MaxThreads;
+    int LockPartitions;
+    int HighWatermark;
+    int LowWatermark;
+    int BusyReply;
+    char* ListenerCPUs;
+    char* ReactorCPUs;
+    char* PoolCPUs;
+    int DiskThreads;
+    int Coroutines;
+    int Compression;
 
 }config_t;
 
@@ -110,6 +152,39 @@ void parseConfigurationFile(config_t *conf, char* filepath);
 int conf_destroy(config_t *conf);
 
 
+/**
+ * @var waitHook
+ * @brief Attesa alternativa a poll usata da waitReady, impostata dal programma all'avvio (NULL = solo poll)
+ *
+ * Il server con Coroutines = 1 vi registra coro_wait (vedi coro.h): restituisce -1 fuori
+ * da una coroutine, 0 quando il descrittore è pronto, 1 se l'attesa è stata annullata.
+ */
+extern int (*waitHook)(int fd, short events);
+
+/**
+ * @function waitReady
+ * @brief Attende che un descrittore non bloccante sia di nuovo pronto per \a events
+ *
+ * In una coroutine si sospende, lasciando il thread ad altre richieste; altrimenti
+ * attende con poll.
+ *
+ * @param fd     descrittore della connessione
+ * @param events eventi attesi (POLLIN, POLLOUT)
+ *
+ * @return \a 1 (riprovare l'operazione) o \a 0 (attesa interrotta: il client va considerato chiuso)
+ */
+static inline int waitReady(long fd, short events)
+{
+    int r;
+
+    if (waitHook != NULL && (r = waitHook((int)fd,events)) >= 0)
+        return r == 0;
+
+    struct pollfd pfd = { .fd = (int)fd, .events = events };
+    poll(&pfd,1,-1);
+    return 1;
+}
+
 /**
  * @function readn
  * @brief Reimplementazione della funzione \a read di libreria.
@@ -133,6 +208,11 @@ static inline int readn(long fd, void *buf, size_t size, char* msg)
         {
             if (errno == EINTR)
                 continue;
+            else if (errno == EAGAIN || errno == EWOULDBLOCK) // socket non bloccante: attendo nuovi dati
+            {
+                if (!waitReady(fd,POLLIN)) return 0;
+                continue;
+            }
             else if (errno == ECONNRESET) // ignoro il caso in cui la connessione sul socket è resettata
                 return 1;
             else
@@ -168,6 +248,11 @@ static inline int writen(long fd, void *buf, size_t size, char *msg)
         {
             if (errno == EINTR)
                 continue;
+            else if (errno == EAGAIN || errno == EWOULDBLOCK) // socket non bloccante: attendo che si liberi spazio
+            {
+                if (!waitReady(fd,POLLOUT)) return 0;
+                continue;
+            }
             else if (errno == EPIPE) // ignoro il caso in cui il socket non funziona correttamente
                 return 0;
             else
@@ -180,6 +265,59 @@ static inline int writen(long fd, void *buf, size_t size, char *msg)
     return 1;
 }
 
+/**
+ * @function writevn
+ * @brief Come writen, ma scrive più buffer con una sola writev, ripetendola in caso di scrittura parziale
+ *
+ * @param fd     descrittore della connessione
+ * @param iov    buffer da scrivere (modificato durante la scrittura)
+ * @param iovcnt numero di buffer
+ * @param msg    messaggio da stampare in caso di errore
+ *
+ * @return \a 1 (successo) o \a 0 (connessione chiusa)
+ */
+static inline int writevn(long fd, struct iovec *iov, int iovcnt, char *msg)
+{
+    ssize_t r;
+    while(iovcnt > 0)
+    {
+        if (iov->iov_len == 0) // buffer vuoto o già scritto
+        {
+            iov++;
+            iovcnt--;
+            continue;
+        }
+        if ((r = writev((int)fd,iov,iovcnt)) == -1)
+        {
+            if (errno == EINTR)
+                continue;
+            else if (errno == EAGAIN || errno == EWOULDBLOCK) // socket non bloccante: attendo che si liberi spazio
+            {
+                if (!waitReady(fd,POLLOUT)) return 0;
+                continue;
+            }
+            else if (errno == EPIPE) // ignoro il caso in cui il socket non funziona correttamente
+                return 0;
+            else
+                ERRORE(msg)
+        }
+        if (r == 0) return 0;
+        // scrittura parziale: riparto dal primo byte non scritto
+        while (iovcnt > 0 && (size_t)r >= iov->iov_len)
+        {
+            r -= (ssize_t)iov->iov_len;
+            iov++;
+            iovcnt--;
+        }
+        if (iovcnt > 0)
+        {
+            iov->iov_base = (char*)iov->iov_base + r;
+            iov->iov_len -= (size_t)r;
+        }
+    }
+    return 1;
+}
+
 
 
 /**
@@ -200,6 +338,26 @@ static inline void printConfiguration(FILE* stream, config_t *conf)
     fprintf(stream,"MaxHistMsgs: %d\n",conf->MaxHistMsgs);
     fprintf(stream,"DirName: %s\n",conf->DirName);
     fprintf(stream,"StatFileName: %s\n",conf->StatFileName);
+    fprintf(stream,"ReactorThreads: %d\n",conf->ReactorThreads);
+    fprintf(stream,"IoUring: %d\n",conf->IoUring);
+    fprintf(stream,"WorkerRearm: %d\n",conf->WorkerRearm);
+    fprintf(stream,"ListenBacklog: %d\n",conf->ListenBacklog);
+    fprintf(stream,"IdleTimeout: %d\n",conf->IdleTimeout);
+    fprintf(stream,"HandoverPath: %s\n",conf->HandoverPath);
+    fprintf(stream,"WorkStealing: %d\n",conf->WorkStealing);
+    fprintf(stream,"ConnectionAffinity: %d\n",conf->ConnectionAffinity);
+    fprintf(stream,"MinThreads: %d\n",conf->MinThreads);
+    fprintf(stream,"MaxThreads: %d\n",conf->MaxThreads);
+    fprintf(stream,"LockPartitions: %d\n",conf->LockPartitions);
+    fprintf(stream,"HighWatermark: %d\n",conf->HighWatermark);
+    fprintf(stream,"LowWatermark: %d\n",conf->LowWatermark);
+    fprintf(stream,"BusyReply: %d\n",conf->BusyReply);
+    fprintf(stream,"ListenerCPUs: %s\n",conf->ListenerCPUs);
+    fprintf(stream,"ReactorCPUs: %s\n",conf->ReactorCPUs);
+    fprintf(stream,"PoolCPUs: %s\n",conf->PoolCPUs);
+    fprintf(stream,"DiskThreads: %d\n",conf->DiskThreads);
+    fprintf(stream,"Coroutines: %d\n",conf->Coroutines);
+    fprintf(stream,"Compression: %d\n",conf->Compression);
 }
 
 